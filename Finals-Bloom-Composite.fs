@@ -5,10 +5,52 @@ uniform sampler2D hdrScene;
 uniform sampler2D bloomBlur;
 uniform float bloomStrength;
 uniform float exposure;
+uniform bool upscale; // scene was rendered below the window resolution
 out vec4 fragmentColor;
 
+// catmull-rom upscale from 9 bilinear taps, clamped to the 2x2 texels around the sample
+// so edges stay sharp without the dark/bright halos plain bicubic leaves around them
+// reference: https://gist.github.com/TheRealMJP/c83b8c0f46b63f3a88a5986f4fa982b5
+vec3 upscaleScene(vec2 uv) {
+    vec2 texSize = vec2(textureSize(hdrScene, 0));
+    vec2 samplePos = uv * texSize;
+    vec2 texPos1 = floor(samplePos - 0.5) + 0.5;
+    vec2 f = samplePos - texPos1;
+
+    vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+    vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+    vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+    vec2 w3 = f * f * (-0.5 + 0.5 * f);
+
+    // the middle two taps on each axis are merged into one bilinear fetch
+    vec2 w12 = w1 + w2;
+    vec2 texPos0 = (texPos1 - 1.0) / texSize;
+    vec2 texPos3 = (texPos1 + 2.0) / texSize;
+    vec2 texPos12 = (texPos1 + w2 / w12) / texSize;
+
+    vec3 result = vec3(0.0);
+    result += texture(hdrScene, vec2(texPos0.x,  texPos0.y)).rgb  * w0.x  * w0.y;
+    result += texture(hdrScene, vec2(texPos12.x, texPos0.y)).rgb  * w12.x * w0.y;
+    result += texture(hdrScene, vec2(texPos3.x,  texPos0.y)).rgb  * w3.x  * w0.y;
+    result += texture(hdrScene, vec2(texPos0.x,  texPos12.y)).rgb * w0.x  * w12.y;
+    result += texture(hdrScene, vec2(texPos12.x, texPos12.y)).rgb * w12.x * w12.y;
+    result += texture(hdrScene, vec2(texPos3.x,  texPos12.y)).rgb * w3.x  * w12.y;
+    result += texture(hdrScene, vec2(texPos0.x,  texPos3.y)).rgb  * w0.x  * w3.y;
+    result += texture(hdrScene, vec2(texPos12.x, texPos3.y)).rgb  * w12.x * w3.y;
+    result += texture(hdrScene, vec2(texPos3.x,  texPos3.y)).rgb  * w3.x  * w3.y;
+
+    // anti-ringing: keep the result within the range of the nearest texels
+    ivec2 maxTexel = ivec2(texSize) - 1;
+    ivec2 base = ivec2(texPos1 - 0.5);
+    vec3 a = texelFetch(hdrScene, clamp(base,               ivec2(0), maxTexel), 0).rgb;
+    vec3 b = texelFetch(hdrScene, clamp(base + ivec2(1, 0), ivec2(0), maxTexel), 0).rgb;
+    vec3 c = texelFetch(hdrScene, clamp(base + ivec2(0, 1), ivec2(0), maxTexel), 0).rgb;
+    vec3 d = texelFetch(hdrScene, clamp(base + ivec2(1, 1), ivec2(0), maxTexel), 0).rgb;
+    return clamp(result, min(min(a, b), min(c, d)), max(max(a, b), max(c, d)));
+}
+
 void main() {
-    vec3 hdrColor   = texture(hdrScene,  shaderTexCoord).rgb;
+    vec3 hdrColor   = upscale ? upscaleScene(shaderTexCoord) : texture(hdrScene, shaderTexCoord).rgb;
     vec3 bloomColor = texture(bloomBlur, shaderTexCoord).rgb;
 
     hdrColor += bloomColor * bloomStrength;
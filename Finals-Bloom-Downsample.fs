@@ -0,0 +1,64 @@
+#version 330 core
+
+in vec2 shaderTexCoord;
+uniform sampler2D image;
+uniform bool firstPass;
+uniform float threshold;
+out vec4 fragmentColor;
+
+// 13-tap downsample, also does the bright pass on the first (full resolution) input
+// reference: https://www.iryoku.com/next-generation-post-processing-in-call-of-duty-advanced-warfare/
+
+float luminance(vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+vec3 tap(vec2 offset) {
+    vec3 color = texture(image, shaderTexCoord + offset).rgb;
+    if (firstPass && luminance(color) <= threshold)
+        color = vec3(0.0);
+    return color;
+}
+
+// on the first pass the groups are weighted by 1 / (1 + luma) (karis average)
+// so that single very bright pixels don't flicker as the camera moves
+float groupWeight(vec3 average) {
+    return firstPass ? 1.0 / (1.0 + luminance(average)) : 1.0;
+}
+
+void main() {
+    vec2 texel = 1.0 / textureSize(image, 0);
+
+    vec3 a = tap(texel * vec2(-2.0,  2.0));
+    vec3 b = tap(texel * vec2( 0.0,  2.0));
+    vec3 c = tap(texel * vec2( 2.0,  2.0));
+    vec3 d = tap(texel * vec2(-2.0,  0.0));
+    vec3 e = tap(vec2(0.0));
+    vec3 f = tap(texel * vec2( 2.0,  0.0));
+    vec3 g = tap(texel * vec2(-2.0, -2.0));
+    vec3 h = tap(texel * vec2( 0.0, -2.0));
+    vec3 i = tap(texel * vec2( 2.0, -2.0));
+    vec3 j = tap(texel * vec2(-1.0,  1.0));
+    vec3 k = tap(texel * vec2( 1.0,  1.0));
+    vec3 l = tap(texel * vec2(-1.0, -1.0));
+    vec3 m = tap(texel * vec2( 1.0, -1.0));
+
+    vec3 groups[5] = vec3[](
+        (j + k + l + m) * 0.25,
+        (a + b + d + e) * 0.25,
+        (b + c + e + f) * 0.25,
+        (d + e + g + h) * 0.25,
+        (e + f + h + i) * 0.25
+    );
+    float weights[5] = float[](0.5, 0.125, 0.125, 0.125, 0.125);
+
+    vec3 result = vec3(0.0);
+    float totalWeight = 0.0;
+    for (int n = 0; n < 5; n++) {
+        float w = weights[n] * groupWeight(groups[n]);
+        result += groups[n] * w;
+        totalWeight += w;
+    }
+
+    fragmentColor = vec4(result / totalWeight, 1.0);
+}
@@ -1,15 +0,0 @@
-#version 330 core
-
-in vec2 shaderTexCoord;
-uniform sampler2D hdrScene;
-uniform float threshold;
-out vec4 fragmentColor;
-
-void main() {
-    vec3 color = texture(hdrScene, shaderTexCoord).rgb;
-    float brightness = dot(color, vec3(0.2126, 0.7152, 0.0722)); // luminance
-    if (brightness > threshold)
-        fragmentColor = vec4(color, 1.0);
-    else
-        fragmentColor = vec4(0.0, 0.0, 0.0, 1.0);
-}
\ No newline at end of file
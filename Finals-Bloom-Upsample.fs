@@ -0,0 +1,24 @@
+#version 330 core
+
+in vec2 shaderTexCoord;
+uniform sampler2D image;
+out vec4 fragmentColor;
+
+// 3x3 tent filter, added on top of the next larger mip with additive blending
+// reference: https://www.iryoku.com/next-generation-post-processing-in-call-of-duty-advanced-warfare/
+
+void main() {
+    vec2 texel = 1.0 / textureSize(image, 0);
+
+    vec3 result = texture(image, shaderTexCoord).rgb * 4.0;
+    result += texture(image, shaderTexCoord + texel * vec2(-1.0,  0.0)).rgb * 2.0;
+    result += texture(image, shaderTexCoord + texel * vec2( 1.0,  0.0)).rgb * 2.0;
+    result += texture(image, shaderTexCoord + texel * vec2( 0.0,  1.0)).rgb * 2.0;
+    result += texture(image, shaderTexCoord + texel * vec2( 0.0, -1.0)).rgb * 2.0;
+    result += texture(image, shaderTexCoord + texel * vec2(-1.0,  1.0)).rgb;
+    result += texture(image, shaderTexCoord + texel * vec2( 1.0,  1.0)).rgb;
+    result += texture(image, shaderTexCoord + texel * vec2(-1.0, -1.0)).rgb;
+    result += texture(image, shaderTexCoord + texel * vec2( 1.0, -1.0)).rgb;
+
+    fragmentColor = vec4(result / 16.0, 1.0);
+}
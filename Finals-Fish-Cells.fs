@@ -0,0 +1,8 @@
+#version 330 core
+
+flat in int start;
+out int cellStart;
+
+void main() {
+    cellStart = start;
+}
@@ -0,0 +1,26 @@
+#version 330 core
+
+// one point per sorted key of the fish grid; the first key of each bucket writes where the
+// bucket starts into the bucket's texel of the cell table, every other point is clipped away
+
+uniform usampler2D sortedKeys;
+uniform ivec2 cellTableSize; // the target, with the viewport covering all of it
+
+flat out int start;
+
+ivec2 texelOf(int index, int width) {
+    return ivec2(index % width, index / width);
+}
+
+void main() {
+    int keyWidth = textureSize(sortedKeys, 0).x;
+    uint bucket = texelFetch(sortedKeys, texelOf(gl_VertexID, keyWidth), 0).r;
+    bool first = gl_VertexID == 0 || texelFetch(sortedKeys, texelOf(gl_VertexID - 1, keyWidth), 0).r != bucket;
+
+    start = gl_VertexID;
+    gl_Position = vec4(2.0, 2.0, 0.0, 1.0);
+    if (first) {
+        vec2 cell = vec2(texelOf(int(bucket), cellTableSize.x)) + 0.5;
+        gl_Position = vec4(cell / vec2(cellTableSize) * 2.0 - 1.0, 0.0, 1.0);
+    }
+}
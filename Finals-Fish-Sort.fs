@@ -0,0 +1,45 @@
+#version 330 core
+
+// the (bucket, fish) keys of the GPU fish grid, one texel each, sorted by bitonic merge:
+// with makeKeys the keys are made from the fish positions, otherwise this is one compare
+// and swap pass of the sort, between every key and the one stride away; the keys past
+// fishCount pad the sort to a power of two and sort last
+
+uniform bool makeKeys;
+uniform samplerBuffer fishState; // 3 texels per fish, position first
+uniform int fishCount;
+uniform uint bucketMask;
+
+uniform usampler2D keys;
+uniform int blockSize; // the size of the runs being merged, ascending and descending in turn
+uniform int stride;
+
+out uvec2 sortedKey;
+
+const float AVOID_RADIUS = 0.4;
+
+uint bucketOf(ivec3 cell) {
+    return (uint(cell.x) * 73856093u ^ uint(cell.y) * 19349663u ^ uint(cell.z) * 83492791u) & bucketMask;
+}
+
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    int width = textureSize(keys, 0).x;
+    int index = texel.y * width + texel.x;
+
+    if (makeKeys) {
+        if (index < fishCount)
+            sortedKey = uvec2(bucketOf(ivec3(floor(texelFetch(fishState, index * 3).xyz / AVOID_RADIUS))), uint(index));
+        else
+            sortedKey = uvec2(0xFFFFFFFFu, uint(index));
+        return;
+    }
+
+    int partner = index ^ stride;
+    uvec2 own = texelFetch(keys, texel, 0).rg;
+    uvec2 other = texelFetch(keys, ivec2(partner % width, partner / width), 0).rg;
+    bool ownFirst = own.r < other.r || (own.r == other.r && own.g < other.g);
+    bool ascending = (index & blockSize) == 0;
+    // the lower index of the pair keeps the smaller key in an ascending run
+    sortedKey = ((index < partner) == ascending) == ownFirst ? own : other;
+}
@@ -0,0 +1,153 @@
+#version 330 core
+
+// one fixed step of every fish, the GPU version of computeNextFishStates(); runs with the
+// rasterizer off and captures the next state with transform feedback. Must follow the CPU
+// steering model (stepFishAoS() and avoidNeighborsGrid() in Finals.cpp) line for line
+
+layout (location = 0) in vec4 positionSpeed; // xyz position, w speed
+layout (location = 1) in vec4 velocity;      // xyz velocity
+layout (location = 2) in vec4 orientation;   // quaternion, xyzw
+
+out vec4 nextPositionSpeed;
+out vec4 nextVelocity;
+out vec4 nextOrientation;
+
+// the state this step reads, as 3 texels per fish, for the neighbors
+uniform samplerBuffer fishState;
+
+// the uniform grid built by Finals-Fish-Sort.fs and Finals-Fish-Cells.vs: sortedKeys holds
+// (bucket, fish) sorted by bucket then fish, cellStart the first entry of each bucket or -1
+uniform usampler2D sortedKeys;
+uniform isampler2D cellStart;
+uniform int fishCount;
+uniform uint bucketMask;
+
+uniform float time;
+uniform vec3 boxMin[2];
+uniform vec3 boxMax[2];
+
+const float TURN_RATE = 0.1;
+const float AVOID_RADIUS = 0.4;
+const float AVOID_WEIGHT = 0.5;
+const float OBSTACLE_WEIGHT = 1.0;
+const float FLOW_WEIGHT = 1.0;
+const float AVOID_DISTANCE = 1.5;
+const float EPSILON = 0.0001;
+const vec3 TANK_MIN = vec3(-20.0, 0.0, -20.0);
+const vec3 TANK_MAX = vec3(20.0);
+
+uint bucketOf(ivec3 cell) {
+    return (uint(cell.x) * 73856093u ^ uint(cell.y) * 19349663u ^ uint(cell.z) * 83492791u) & bucketMask;
+}
+
+ivec2 texelOf(int index, int width) {
+    return ivec2(index % width, index / width);
+}
+
+vec3 avoidNeighbors(vec3 position) {
+    ivec3 cell = ivec3(floor(position / AVOID_RADIUS));
+    int keyWidth = textureSize(sortedKeys, 0).x;
+    int cellWidth = textureSize(cellStart, 0).x;
+
+    // the 27 cells can land in the same bucket, which must only be read once
+    uint buckets[27];
+    int bucketCount = 0;
+    for (int z = -1; z <= 1; z++)
+        for (int y = -1; y <= 1; y++)
+            for (int x = -1; x <= 1; x++) {
+                uint b = bucketOf(cell + ivec3(x, y, z));
+                bool seen = false;
+                for (int k = 0; k < bucketCount; k++)
+                    seen = seen || buckets[k] == b;
+                if (!seen)
+                    buckets[bucketCount++] = b;
+            }
+
+    vec3 avoidance = vec3(0.0);
+    for (int k = 0; k < bucketCount; k++) {
+        for (int e = texelFetch(cellStart, texelOf(int(buckets[k]), cellWidth), 0).r; e >= 0 && e < fishCount; e++) {
+            uvec2 key = texelFetch(sortedKeys, texelOf(e, keyWidth), 0).rg;
+            if (key.r != buckets[k])
+                break;
+            if (int(key.g) == gl_VertexID)
+                continue;
+            vec3 d = position - texelFetch(fishState, int(key.g) * 3).xyz;
+            float dist = length(d);
+            if (dist < AVOID_RADIUS)
+                avoidance += normalize(d) * (AVOID_RADIUS - dist);
+        }
+    }
+    return avoidance;
+}
+
+vec3 avoidWalls(vec3 pos) {
+    vec3 avoidance = vec3(0.0);
+    float margin = 0.5;
+    if (pos.x > TANK_MAX.x - margin) avoidance.x -= 1.0;
+    if (pos.x < TANK_MIN.x + margin) avoidance.x += 1.0;
+    if (pos.y > TANK_MAX.y - margin) avoidance.y -= 1.0;
+    if (pos.y < TANK_MIN.y + margin) avoidance.y += 1.0;
+    if (pos.z > TANK_MAX.z - margin) avoidance.z -= 1.0;
+    if (pos.z < TANK_MIN.z - margin) avoidance.z += 1.0; // sic, as on the CPU
+    return avoidance;
+}
+
+vec3 avoidBoundingBox(vec3 position, vec3 minimum, vec3 maximum) {
+    vec3 toFish = position - clamp(position, minimum, maximum);
+    float distance = length(toFish);
+    if (distance > AVOID_DISTANCE)
+        return vec3(0.0);
+    if (distance < EPSILON)
+        return normalize(position - (minimum + maximum) * 0.5) * AVOID_DISTANCE;
+    return normalize(toFish) * (AVOID_DISTANCE - distance) / AVOID_DISTANCE;
+}
+
+// glm::quat_cast()
+vec4 quatFromBasis(mat3 m) {
+    float fourX = m[0][0] - m[1][1] - m[2][2];
+    float fourY = m[1][1] - m[0][0] - m[2][2];
+    float fourZ = m[2][2] - m[0][0] - m[1][1];
+    float fourW = m[0][0] + m[1][1] + m[2][2];
+
+    int biggestIndex = 0;
+    float biggest = fourW;
+    if (fourX > biggest) { biggest = fourX; biggestIndex = 1; }
+    if (fourY > biggest) { biggest = fourY; biggestIndex = 2; }
+    if (fourZ > biggest) { biggest = fourZ; biggestIndex = 3; }
+
+    float biggestVal = sqrt(biggest + 1.0) * 0.5;
+    float mult = 0.25 / biggestVal;
+    if (biggestIndex == 0)
+        return vec4((m[1][2] - m[2][1]) * mult, (m[2][0] - m[0][2]) * mult, (m[0][1] - m[1][0]) * mult, biggestVal);
+    if (biggestIndex == 1)
+        return vec4(biggestVal, (m[0][1] + m[1][0]) * mult, (m[2][0] + m[0][2]) * mult, (m[1][2] - m[2][1]) * mult);
+    if (biggestIndex == 2)
+        return vec4((m[0][1] + m[1][0]) * mult, biggestVal, (m[1][2] + m[2][1]) * mult, (m[2][0] - m[0][2]) * mult);
+    return vec4((m[2][0] + m[0][2]) * mult, (m[1][2] + m[2][1]) * mult, biggestVal, (m[0][1] - m[1][0]) * mult);
+}
+
+// glm::quatLookAt() with up = +y
+vec4 quatLookAt(vec3 direction) {
+    mat3 basis;
+    basis[2] = -direction;
+    vec3 right = cross(vec3(0.0, 1.0, 0.0), basis[2]);
+    basis[0] = right * inversesqrt(max(0.00001, dot(right, right)));
+    basis[1] = cross(basis[2], basis[0]);
+    return quatFromBasis(basis);
+}
+
+void main() {
+    vec3 position = positionSpeed.xyz;
+    vec3 flow = normalize(vec3(sin(position.z + time), cos(position.x + time * 0.5), cos(position.y + time))) * FLOW_WEIGHT;
+    vec3 wall = avoidWalls(position) * AVOID_WEIGHT;
+    vec3 obstacle = vec3(0.0);
+    for (int i = 0; i < 2; i++)
+        obstacle += avoidBoundingBox(position, boxMin[i], boxMax[i]) * OBSTACLE_WEIGHT;
+
+    vec3 desiredVelocity = normalize(flow + avoidNeighbors(position) * AVOID_WEIGHT + wall + obstacle);
+    vec3 nextVelocityXyz = mix(velocity.xyz, desiredVelocity, TURN_RATE);
+
+    nextPositionSpeed = vec4(position + nextVelocityXyz * positionSpeed.w, positionSpeed.w);
+    nextVelocity = vec4(nextVelocityXyz, 0.0);
+    nextOrientation = quatLookAt(nextVelocityXyz);
+}
@@ -0,0 +1,8 @@
+#version 330 core
+
+in vec4 shaderColor;
+out vec4 fragmentColor;
+
+void main() {
+    fragmentColor = shaderColor;
+}
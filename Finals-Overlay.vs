@@ -0,0 +1,12 @@
+#version 330 core
+
+layout (location = 0) in vec2 position; // in pixels, origin at the top left
+layout (location = 1) in vec4 color;
+uniform vec2 screenSize;
+out vec4 shaderColor;
+
+void main() {
+    shaderColor = color;
+    vec2 ndc = position / screenSize * 2.0 - 1.0;
+    gl_Position = vec4(ndc.x, -ndc.y, 0.0, 1.0);
+}
@@ -11,15 +11,32 @@
 #version 330 core
 
 layout (location = 0) in vec3 vertexPosition;
-layout (location = 4) in mat4 instanceMatrix;
+layout (location = 4) in vec4 instancePositionScale; // as in Finals-Shader.vs
+layout (location = 5) in vec4 instanceOrientation;
 
 uniform mat4 lightTransform;
+uniform mat4 viewTransform; // identity for shadow maps; the camera for the depth prepass
 uniform mat4 modelTransform;
 uniform bool isInstanced;
 
+// the depth prepass only works if this writes exactly the depth Finals-Shader.vs does,
+// so both compute the position the same way and declare it invariant
+invariant gl_Position;
+
+// fishModel() of Finals-Shader.vs
+mat4 fishModel(vec3 position, vec4 q, float scale)
+{
+    mat3 rotation = mat3(1.0f - 2.0f * (q.y * q.y + q.z * q.z), 2.0f * (q.x * q.y + q.w * q.z), 2.0f * (q.x * q.z - q.w * q.y),
+                         2.0f * (q.x * q.y - q.w * q.z), 1.0f - 2.0f * (q.x * q.x + q.z * q.z), 2.0f * (q.y * q.z + q.w * q.x),
+                         2.0f * (q.x * q.z + q.w * q.y), 2.0f * (q.y * q.z - q.w * q.x), 1.0f - 2.0f * (q.x * q.x + q.y * q.y)) * scale;
+    return mat4(vec4(rotation[0], 0.0f), vec4(rotation[1], 0.0f), vec4(rotation[2], 0.0f), vec4(position, 1.0f));
+}
+
 void main()
 {
-    mat4 finalModel = isInstanced ? instanceMatrix : modelTransform;
-    gl_Position = lightTransform * finalModel * vec4(vertexPosition, 1.0f);
+    mat4 finalModel = isInstanced ? fishModel(instancePositionScale.xyz, normalize(instanceOrientation), instancePositionScale.w) : modelTransform;
+    mat4 modelViewTransform = viewTransform * finalModel;
+    vec3 viewPosition = vec3(modelViewTransform * vec4(vertexPosition, 1.0f));
+    gl_Position = lightTransform * vec4(viewPosition, 1.0f);
 }
 
@@ -50,6 +50,7 @@ in vec2 shaderTexCoord;
 in vec4 dirLightSpacePositions[1];
 in vec4 spotLightSpacePositions[2];
 in vec3 worldSpacePosition;
+in vec3 shaderTint;
 
 uniform sampler2D diffuseMap;
 uniform sampler2D normalMap;
@@ -67,10 +68,13 @@ uniform bool isTile;
 uniform bool isAlphaBlended;
 uniform float alphaThreshold;
 
-uniform DirLight dir_lights[1];
-uniform SpotLight spotlights[2];
-uniform PointLight pointLights[MAX_POINT_LIGHTS];
-uniform int numPointLights;
+// filled once per view from the streaming buffer, see uploadLightUniforms()
+layout(std140) uniform Lights {
+    DirLight dir_lights[1];
+    SpotLight spotlights[2];
+    PointLight pointLights[MAX_POINT_LIGHTS];
+    int numPointLights;
+};
 
 // uniform vec2 shadowTexelStep;
 
@@ -87,6 +91,11 @@ uniform samplerCube cubemap[2];
 uniform int cubemapIndex;
 uniform mat3 inverseViewRotation;
 
+// planar mirror, sampled in screen space from the offscreen reflection pass
+uniform bool isMirror;
+uniform sampler2D reflectionTexture;
+uniform vec2 viewportSize;
+
 // bloom stuff
 uniform bool isEmissive;
 uniform vec3 emissiveColor;
@@ -262,6 +271,11 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDirTangent)
 
 
 void main() {
+    if (isMirror) {
+        fragmentColor = vec4(texture(reflectionTexture, gl_FragCoord.xy / viewportSize).rgb, 1.0f);
+        return;
+    }
+
     vec3 viewDir = normalize(-shaderPosition);
     vec3 viewDirTangent = normalize(transpose(shaderTBN) * viewDir);
 
@@ -331,7 +345,7 @@ void main() {
     else if (isAlphaBlended) {
         float alpha = texture(diffuseMap, finalUV).a;
         if (alpha < alphaThreshold) discard;
-        fragmentColor = vec4(result, alpha);
+        fragmentColor = vec4(result * shaderTint, alpha);
     } 
     else if (isReflective) {
         vec3 glassTint = vec3(0.05f, 0.07f, 0.12f); // very dark blue-grey
@@ -347,7 +361,8 @@ void main() {
         vec3 viewDirWorld = normalize(fragWorldPos - cameraWorldPos);
         vec3 normalWorld = normalize(inverseViewRotation * normalDir);
         vec3 reflectDir = reflect(viewDirWorld, normalWorld);
-        vec4 envColor = texture(cubemap[cubemapIndex], reflectDir);
+        // GLSL 3.30 only allows constant indices into sampler arrays (Mesa rejects anything else)
+        vec4 envColor = cubemapIndex == 0 ? texture(cubemap[0], reflectDir) : texture(cubemap[1], reflectDir);
 
         vec3 blended = mix(glassResult, envColor.rgb, reflectivity);
         fragmentColor = vec4(blended, 1.0f);
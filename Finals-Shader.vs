@@ -4,7 +4,14 @@ layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec2 vertexTexCoord;
 layout (location = 2) in vec3 vertexNormal;
 layout (location = 3) in vec3 vertexTangent;
-layout (location = 4) in mat4 instanceMatrix;  
+layout (location = 4) in vec4 instancePositionScale; // fish: xyz position, w uniform scale
+layout (location = 5) in vec4 instanceOrientation;   // xyzw quaternion, from snorm16
+layout (location = 8) in vec4 foliageInstance;  // xyz position on the floor, w rotation about y
+layout (location = 9) in vec4 foliageTintScale; // rgb tint, a scale
+layout (location = 10) in vec4 previousFishPosition;    // --gpu-fish: the last two steps straight from
+layout (location = 11) in vec4 previousFishOrientation; // the state buffers, xyz position and
+layout (location = 12) in vec4 currentFishPosition;     // xyzw quaternion
+layout (location = 13) in vec4 currentFishOrientation;
 
 // uniform int numLights;
 
@@ -13,7 +20,15 @@ uniform mat4 viewTransform;
 uniform mat4 modelTransform;
 // uniform mat4 lightTransforms[MAX_LIGHTS];
 uniform bool isInstanced;
-uniform vec4 clipPlane;
+uniform bool isGpuFish;  // instanced from the GPU simulation instead of the attributes above
+uniform float fishAlpha; // how far between the previous and the current step
+
+// grass instances; the share of a chunk that is drawn falls off with the distance from
+// foliageEye between foliageFade.x and .y, and the tufts shrink away over the last .z of it
+uniform bool isFoliage;
+uniform vec3 foliageEye;
+uniform vec3 foliageFade;
+uniform int foliageChunkCount;
 
 uniform mat4 directionalLightTransforms[1];
 uniform mat4 spotLightTransforms[2];
@@ -24,11 +39,49 @@ out vec2 shaderTexCoord;
 out vec4 dirLightSpacePositions[1];
 out vec4 spotLightSpacePositions[2];
 out vec3 worldSpacePosition;
+out vec3 shaderTint;
+
+// must match the depth prepass in Finals-Shader-Shadow.vs bit for bit
+invariant gl_Position;
+
+// rotates by the unit quaternion q, scales, then moves to position (glm::mat4_cast() of q)
+mat4 fishModel(vec3 position, vec4 q, float scale)
+{
+    mat3 rotation = mat3(1.0f - 2.0f * (q.y * q.y + q.z * q.z), 2.0f * (q.x * q.y + q.w * q.z), 2.0f * (q.x * q.z - q.w * q.y),
+                         2.0f * (q.x * q.y - q.w * q.z), 1.0f - 2.0f * (q.x * q.x + q.z * q.z), 2.0f * (q.y * q.z + q.w * q.x),
+                         2.0f * (q.x * q.z + q.w * q.y), 2.0f * (q.y * q.z - q.w * q.x), 1.0f - 2.0f * (q.x * q.x + q.y * q.y)) * scale;
+    return mat4(vec4(rotation[0], 0.0f), vec4(rotation[1], 0.0f), vec4(rotation[2], 0.0f), vec4(position, 1.0f));
+}
 
 void main()
 {
     // getting final Model
-    mat4 finalModel = isInstanced ? instanceMatrix : modelTransform;
+    mat4 finalModel = modelTransform;
+    shaderTint = vec3(1.0f);
+
+    if (isGpuFish) {
+        // the blend writeFishInstances() does on the CPU, with a normalized lerp for the slerp
+        vec4 current = dot(previousFishOrientation, currentFishOrientation) < 0.0f ? -currentFishOrientation : currentFishOrientation;
+        vec4 q = normalize(mix(previousFishOrientation, current, fishAlpha));
+        vec3 position = mix(previousFishPosition.xyz, currentFishPosition.xyz, fishAlpha);
+        finalModel = modelTransform * fishModel(position, q, 1.0f);
+    }
+    else if (isInstanced) {
+        // snorm16 leaves the quaternion a little off unit length
+        finalModel = modelTransform * fishModel(instancePositionScale.xyz, normalize(instanceOrientation), instancePositionScale.w);
+    }
+
+    if (isFoliage) {
+        float rank = (gl_InstanceID + 0.5f) / float(foliageChunkCount) * (1.0f - foliageFade.z);
+        float density = clamp((foliageFade.y - distance(foliageEye, foliageInstance.xyz)) / (foliageFade.y - foliageFade.x), 0.0f, 1.0f);
+        float scale = foliageTintScale.a * smoothstep(rank, rank + foliageFade.z, density);
+
+        float c = cos(foliageInstance.w) * scale;
+        float s = sin(foliageInstance.w) * scale;
+        finalModel = modelTransform * mat4(vec4(c, 0.0f, -s, 0.0f), vec4(0.0f, scale, 0.0f, 0.0f),
+                                           vec4(s, 0.0f, c, 0.0f), vec4(foliageInstance.xyz, 1.0f));
+        shaderTint = foliageTintScale.rgb;
+    }
 
     // combine the model and view transforms to get the camera space transform
     mat4 modelViewTransform = viewTransform * finalModel;
@@ -62,6 +115,4 @@ void main()
     for (int i = 0; i < 2; i++) {
         spotLightSpacePositions[i] = spotLightTransforms[i] * finalModel * vec4(vertexPosition, 1.0f);
     }
-
-    gl_ClipDistance[0] = dot(worldPos, clipPlane);
 }
@@ -17,13 +17,59 @@
  * Press [ to decrease PCF radius (smaller sampling area = sharper shadows)
  * 
  * Press G to toggle grass and leaves on/off
+ * Press J to start/stop the train (run with --train to start it moving)
  * Press B to toggle bloom on/off
  * Press V to toggle fog on/off
+ * Press M to cycle the mirror reflection resolution (full, 1/2, 1/4)
+ * Press N to toggle dynamic resolution on/off (render scale follows the GPU frame time)
+ * Press H to cycle the depth prepass (auto: only where the measured overdraw pays for it, always, off)
+ * Press I to cycle occlusion culling of the static meshes (GPU queries, CPU rasterizer, off)
+ * Press O to toggle the GPU profiler overlay, K to save the GPU pass timings to Finals-GpuProfile.csv
+ * Press T to save the CPU trace so far to Finals-Trace.json (also saved on exit)
+ * Press C to start/stop recording the camera path to Finals-Path.bin
+ *
+ * Run with --fish N to change the number of fish (16 by default; the first 16 carry lights;
+ * at most about 300k without --gpu-fish, see MAX_STREAMED_FISH),
+ * and with --bench-fish to time and check the fish simulation (see runFishBenchmark());
+ * --threads N sets the number of worker threads (one less than the hardware threads by default);
+ * --gpu-fish moves the fish simulation onto the GPU (try --fish 1000000), and with --bench-fish
+ * it checks the GPU steps against the CPU ones instead; --flow-volume makes the CPU simulation
+ * sample the flow from a baked grid (see prepareFlowVolume()); --sim-budget US steps the fish
+ * far from the camera or out of view less often and more cheaply, keeping the simulation under
+ * US microseconds a frame (see assignFishLod()); add -mavx2 to the g++ line of test or
+ * test.cmd for the 8 wide fish kernel on CPUs with AVX2 (see FISH_LANES)
+ * --serial-frame runs the tasks of a frame one after the other on the render thread instead of
+ * overlapping the culling, light packing and fish instances with the GL calls (see render())
+ *
+ * Run with --replay FILE to fly the camera along a recording or a keyframe file
+ * (e.g. Finals-Path-Stress.txt); combine it with --bench for repeatable perf runs
+ *
+ * Run with --bench for a headless benchmark (no window, vsync off, fixed seed and clock);
+ * see parseArguments() for the options, e.g. --frames 300 --capture out.ppm --golden ref.ppm
  * Press arrow up/down to increase/decrease fog end distance (how far the fog reaches)
  * Press arrow right/left to increase/decrease fog start distance (where the fog starts)
  *****************************************************************************/
 
 #include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <set>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/gtc/type_ptr.hpp>
@@ -35,10 +81,166 @@
 #define WINDOW_TITLE  "GDEV32 Final Project - Gimena, Tan"
 GLFWwindow *pWindow;
 
+/*------------------CPU TRACE--------------------*/
+
+// scoped CPU markers saved to Finals-Trace.json in Chrome's trace event format
+// (open it in ui.perfetto.dev or chrome://tracing); set to 0 to compile every marker out
+#define ENABLE_CPU_TRACE 1
+
+// the time stamp counter where there is one, as it is several times cheaper to read than
+// steady_clock; ticks are converted to time against steady_clock when the trace is written
+inline uint64_t cpuTraceTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#if ENABLE_CPU_TRACE
+#define CPU_TRACE_EVENTS_PER_THREAD (1 << 18) // up to 8 MB per thread that records anything
+#define CPU_TRACE_CHUNK_EVENTS (1 << 12)      // 128 KB, allocated as a thread's events come in
+
+struct CpuTraceEvent {
+    const char* name;
+    const char* detail; // optional, e.g. the file being loaded; must outlive the trace
+    uint64_t start, end; // raw cpuTraceTicks() values
+};
+
+// only the owning thread appends to a buffer, so recording takes no locks; the count
+// is published with release ordering so the exporter always reads complete events (and the
+// chunks they are in). A thread only holds as many chunks as it recorded events for, so the
+// workers that record a few scopes a frame stay small
+struct CpuTraceBuffer {
+    CpuTraceEvent* chunks[CPU_TRACE_EVENTS_PER_THREAD / CPU_TRACE_CHUNK_EVENTS] = {};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> dropped{0}; // events lost after the buffer filled up, read by the exporter
+    int threadId = 0;
+};
+
+uint64_t cpuTraceOriginTicks = cpuTraceTicks();
+std::chrono::steady_clock::time_point cpuTraceOrigin = std::chrono::steady_clock::now();
+std::mutex cpuTraceBuffersMutex; // only taken the first time a thread records something
+std::vector<CpuTraceBuffer*> cpuTraceBuffers;
+thread_local CpuTraceBuffer* cpuTraceBuffer = nullptr;
+
+CpuTraceBuffer* registerCpuTraceThread() {
+    CpuTraceBuffer* buffer = new CpuTraceBuffer; // kept until exit so the exporter can still read it
+    std::lock_guard<std::mutex> lock(cpuTraceBuffersMutex);
+    buffer->threadId = (int)cpuTraceBuffers.size() + 1;
+    cpuTraceBuffers.push_back(buffer);
+    return buffer;
+}
+
+// adds an event to the calling thread's buffer
+void recordCpuTraceEvent(const char* name, const char* detail, uint64_t start, uint64_t end) {
+    if (!cpuTraceBuffer)
+        cpuTraceBuffer = registerCpuTraceThread();
+
+    uint32_t count = cpuTraceBuffer->count.load(std::memory_order_relaxed);
+    if (count == CPU_TRACE_EVENTS_PER_THREAD) {
+        cpuTraceBuffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    CpuTraceEvent*& chunk = cpuTraceBuffer->chunks[count / CPU_TRACE_CHUNK_EVENTS];
+    if (!chunk) {
+        chunk = new CpuTraceEvent[CPU_TRACE_CHUNK_EVENTS];
+        std::memset(chunk, 0, CPU_TRACE_CHUNK_EVENTS * sizeof(CpuTraceEvent)); // fault the pages in once
+    }
+    chunk[count % CPU_TRACE_CHUNK_EVENTS] = { name, detail, start, end };
+    cpuTraceBuffer->count.store(count + 1, std::memory_order_release);
+}
+
+struct CpuTraceScope {
+    const char* name;
+    const char* detail;
+    uint64_t start;
+
+    CpuTraceScope(const char* name, const char* detail = nullptr) : name(name), detail(detail), start(cpuTraceTicks()) {}
+    ~CpuTraceScope() { recordCpuTraceEvent(name, detail, start, cpuTraceTicks()); }
+};
+
+#define CPU_TRACE_CONCAT(a, b) a##b
+#define CPU_TRACE_NAME(line) CPU_TRACE_CONCAT(cpuTraceScope, line)
+#define CPU_SCOPE(...) CpuTraceScope CPU_TRACE_NAME(__LINE__)(__VA_ARGS__)
+#define CPU_TRACE_EVENT(...) recordCpuTraceEvent(__VA_ARGS__) // for spans timed by hand
+#else
+#define CPU_SCOPE(...)
+#define CPU_TRACE_EVENT(...)
+#endif
+
+void writeJsonString(std::ofstream& file, const char* text) {
+    file << '"';
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') file << '\\';
+        file << *c;
+    }
+    file << '"';
+}
+
+// writes every event recorded so far; recording carries on afterwards
+void writeCpuTrace(const char* filename) {
+#if ENABLE_CPU_TRACE
+    std::ofstream file(filename);
+    if (!file) {
+        std::cout << "Cannot write CPU trace to '" << filename << "'\n";
+        return;
+    }
+
+    double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - cpuTraceOrigin).count();
+    double ticksPerUs = (cpuTraceTicks() - cpuTraceOriginTicks) / std::max(elapsedUs, 1.0);
+
+    std::lock_guard<std::mutex> lock(cpuTraceBuffersMutex);
+    size_t total = 0;
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (auto* buffer : cpuTraceBuffers) {
+        std::string threadName = buffer->threadId == 1 ? "main" : "thread " + std::to_string(buffer->threadId);
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+             << ",\"args\":{\"name\":\"" << threadName << "\"}}";
+
+        uint32_t count = buffer->count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            const CpuTraceEvent& e = buffer->chunks[i / CPU_TRACE_CHUNK_EVENTS][i % CPU_TRACE_CHUNK_EVENTS];
+            char times[64];
+            snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f",
+                     (int64_t)(e.start - cpuTraceOriginTicks) / ticksPerUs, (e.end - e.start) / ticksPerUs);
+
+            file << ",\n{\"name\":";
+            writeJsonString(file, e.name);
+            file << ",\"ph\":\"X\"," << times << ",\"pid\":1,\"tid\":" << buffer->threadId;
+            if (e.detail) {
+                file << ",\"args\":{\"detail\":";
+                writeJsonString(file, e.detail);
+                file << "}";
+            }
+            file << "}";
+        }
+        file << (buffer == cpuTraceBuffers.back() ? "\n" : ",\n");
+        total += count;
+
+        uint32_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+        if (dropped > 0)
+            std::cout << "CPU trace buffer of thread " << buffer->threadId << " filled up, "
+                      << dropped << " events dropped\n";
+    }
+    file << "]}\n";
+    std::cout << "CPU trace written to '" << filename << "' (" << total << " events)\n";
+#else
+    std::cout << "CPU tracing is compiled out (ENABLE_CPU_TRACE is 0)\n";
+#endif
+}
+
+// gdev.h's shader loader, with a trace marker
+GLuint loadShader(const char* vertexShaderFile, const char* fragmentShaderFile) {
+    CPU_SCOPE("gdevLoadShader", fragmentShaderFile);
+    return gdevLoadShader(vertexShaderFile, fragmentShaderFile);
+}
+
+/*---------------------------------------------------*/
+
 // models
 std::vector<float> FloorMesh = {};
 std::vector<float> BricksParallax = {};
-std::vector<float> GrassMesh = {};
 std::vector<float> LowerBuilding = {};
 std::vector<float> LowerWindow = {};
 std::vector<float> HigherBuilding = {};
@@ -62,7 +264,6 @@ GLuint vao;
 GLuint vbo;
 GLuint instancedVao;
 GLuint instancedVbo;
-GLuint instancedVboMatrix;
 GLuint shader;
 GLuint texture[28];
 
@@ -156,9 +357,18 @@ GLuint spotShadowFbo;
 GLuint spotShadowArray;
 std::vector<glm::mat4> spotLightTransforms;
 
+// a shadow map is only drawn again once its light moved or the scene graph moved something
+// inside it (see invalidateSceneCaches())
+struct ShadowCache {
+    glm::mat4 lightTransform = glm::mat4(0.0f);
+    bool valid = false;
+};
+std::vector<ShadowCache> directionalShadowCaches, spotShadowCaches;
+
 GLuint shadowMapShader;   // shadow map shader
 
 GLuint offsetTexture; // noise texture for PCF sampling
+std::vector<float> offsetTextureData; // what it was made from, rand() seeded; keys the cubemap cache
 #define PI 3.14159265358979323846f
 
 bool enableShadows = true;
@@ -177,6 +387,11 @@ const float PCF_MAX_RADIUS = 20.0f;
 // grass toggle
 bool showGrassLeaves = true;
 
+// hidden static meshes are skipped using GPU occlusion queries or the CPU occlusion rasterizer
+enum OcclusionMode { OCCLUSION_GPU, OCCLUSION_CPU, OCCLUSION_OFF };
+OcclusionMode occlusionMode = OCCLUSION_GPU;
+const char* occlusionModeNames[] = { "GPU queries", "CPU rasterizer", "off" };
+
 // environment map stuff
 #define CUBEMAP_SIZE 512
 GLuint cubemapTexture[2];
@@ -189,6 +404,34 @@ glm::vec3 cubemapCapturePos[2] = {
 };
 
 bool cubemapNeedsRender = true;
+bool cubemapStale[2] = { false, false }; // something moved in view of the probe since its capture
+
+// baked cubemaps are cached on disk and reused while the scene stays the same
+#define CUBEMAP_CACHE_VERSION 2
+const char* cubemapCacheFiles[2] = {
+    "Finals-Cache-Cubemap0.bin",
+    "Finals-Cache-Cubemap1.bin"
+};
+
+// every data/texture file loaded in setup, used to key the cubemap cache
+std::vector<std::string> sceneAssetFiles;
+
+// planar mirror, taken from Finals-Data-MirrorPlane.txt
+const glm::vec3 mirrorNormal = glm::normalize(glm::vec3(-0.9848f, 0.1736f, 0.0f));
+const glm::vec3 mirrorPoint = glm::vec3(19.272734f, 2.855113f, 5.277397f);
+
+// the mirror's reflection is rendered offscreen at a fraction of the window size
+const float reflectionScales[3] = { 1.0f, 0.5f, 0.25f };
+int reflectionScaleIndex = 1;
+int reflectionWidth, reflectionHeight;
+GLuint reflectionFbo = 0;
+GLuint reflectionTexture = 0;
+GLuint reflectionDepthRbo = 0;
+
+// occlusion query on the mirror surface, read back a frame (or more) later
+GLuint mirrorQuery;
+bool mirrorQueryPending = false;
+bool mirrorVisible = true;
 
 // https://danielsieger.com/blog/2021/03/27/generating-spheres.html
 void generateFireflies(int stacks, int slices, float radius, std::vector<float>& data)
@@ -252,30 +495,61 @@ void generateFireflies(int stacks, int slices, float radius, std::vector<float>&
 }
 
 // bloom stuff
-GLuint bloomThresholdShader;
-GLuint bloomBlurShader;
+GLuint bloomDownsampleShader;
+GLuint bloomUpsampleShader;
 GLuint bloomCompositeShader;
 
-GLuint hdrFbo;
+GLuint hdrFbo = 0;
 GLuint hdrColorTexture;
 GLuint hdrDepthRbo;
 
-GLuint pingFbo, pongFbo;
-GLuint pingTexture, pongTexture;
-
+// bloom mip chain, level 0 is half the window size
+#define BLOOM_MIPS 6
+GLuint bloomMipFbos[BLOOM_MIPS];
+GLuint bloomMipTextures[BLOOM_MIPS];
+int bloomMipWidths[BLOOM_MIPS], bloomMipHeights[BLOOM_MIPS];
 
 GLuint quadVao, quadVbo;
 
 float bloomThreshold = 1.0f;
 float bloomStrength = 1.0f;
 float bloomExposure = 0.5f;
-int bloomPasses = 10;
 
 bool enableBloom = true;
 
+// dynamic resolution: the HDR scene is rendered at renderScale times the window size and
+// upscaled in the composite pass, with the scale following the measured GPU frame time
+bool enableDynamicResolution = true;
+float renderScale = 1.0f;
+const float minRenderScale = 0.5f;
+const float maxRenderScale = 1.0f;
+const float renderScaleStep = 0.1f;
+float frameBudgetMs = 14.0f; // leaves some headroom under a 60 Hz vsync interval
+
+int windowWidth = WINDOW_WIDTH, windowHeight = WINDOW_HEIGHT; // framebuffer size in pixels
+int renderWidth = WINDOW_WIDTH, renderHeight = WINDOW_HEIGHT;
+bool renderTargetsNeedResize = false;
+
+float smoothedFrameMs = 0.0f;
+int framesOverBudget = 0, framesUnderBudget = 0;
+
 // for debugging camera position printouts
 float lastPrintTime = 0.0f; 
 
+// headless benchmark (--bench), see runBenchmark()
+bool benchMode = false;
+int benchFrame = 0;
+
+// camera path replay (--replay), see updateCameraPath()
+bool cameraReplayActive = false;
+double replayStartTime = 0.0; // the scene clock restarts with the replay
+
+// clock for the fish and shader animation; the benchmark swaps the wall clock for
+// a fixed 60 Hz one so that every run renders exactly the same frames
+float sceneTime() {
+    return benchMode ? benchFrame / 60.0f : (float)(glfwGetTime() - replayStartTime);
+}
+
 // fog parameters
 float fogStart = 8.0f;
 float fogEnd = 64.0f;
@@ -287,12 +561,608 @@ bool enableFog = false;
 float heightScale = 0.05f;
 
 
+/*------------------WORKER POOL--------------------*/
+
+// persistent worker threads that share out parallelFor() ranges by work stealing: a range is
+// cut into chunks dealt over the workers' deques, each worker runs its own chunks newest first
+// and steals the oldest chunk of another deque once its own runs dry. The calling thread works
+// too until its range is done, so a job always finishes even with no workers, and several
+// threads (the render thread and the fish simulation) can run jobs at the same time
+#define MAX_WORKER_THREADS 63
+#define CHUNKS_PER_THREAD 4 // more chunks than threads, so a slow chunk is made up for by stealing
+
+struct ParallelJob {
+    const std::function<void(int, int)>* body;
+    std::atomic<int> remaining; // chunks not finished yet
+};
+
+struct WorkChunk {
+    ParallelJob* job;
+    int begin, end;
+};
+
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<WorkChunk> chunks;
+};
+
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::unique_ptr<WorkQueue[]> queues; // one per worker, then one for the threads outside the pool
+    std::atomic<int> active { 0 };       // workers that take part, see setActiveWorkers()
+    std::atomic<int> queued { 0 };       // chunks waiting in the queues
+    std::mutex mutex;                    // for sleeping and waking only
+    std::condition_variable wake, finished;
+    bool quit = false;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+};
+WorkerPool workerPool;
+thread_local int workerIndex = -1; // the worker's own queue, -1 outside the pool
+int workerThreadLimit = -1;        // --threads, -1 for one less than the hardware threads
+
+// the caller's own queue
+int ownWorkQueue() {
+    return workerIndex >= 0 ? workerIndex : (int)workerPool.threads.size();
+}
+
+// takes the newest chunk of the own queue, or else steals the oldest of another one
+bool takeWorkChunk(int own, WorkChunk& chunk) {
+    if (workerPool.queued.load() <= 0)
+        return false;
+    int queueCount = (int)workerPool.threads.size() + 1;
+    for (int k = 0; k < queueCount; k++) {
+        WorkQueue& queue = workerPool.queues[(own + k) % queueCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.chunks.empty())
+            continue;
+        if (k == 0) {
+            chunk = queue.chunks.back();
+            queue.chunks.pop_back();
+        }
+        else {
+            chunk = queue.chunks.front();
+            queue.chunks.pop_front();
+        }
+        workerPool.queued--;
+        return true;
+    }
+    return false;
+}
+
+void runWorkChunk(const WorkChunk& chunk) {
+    (*chunk.job->body)(chunk.begin, chunk.end);
+    if (--chunk.job->remaining == 0) {
+        // the lock makes sure the owner is either waiting already or will see the count
+        std::lock_guard<std::mutex> lock(workerPool.mutex);
+        workerPool.finished.notify_all();
+    }
+}
+
+void workerLoop(int index) {
+    workerIndex = index;
+    for (;;) {
+        WorkChunk chunk;
+        if (index < workerPool.active && takeWorkChunk(index, chunk)) {
+            runWorkChunk(chunk);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(workerPool.mutex);
+        workerPool.wake.wait(lock, [&] { return workerPool.quit || (index < workerPool.active && workerPool.queued.load() > 0); });
+        if (workerPool.quit)
+            return;
+    }
+}
+
+// starts the workers once; later calls do nothing
+void startWorkerPool() {
+    if (workerPool.queues)
+        return;
+    int count = workerThreadLimit >= 0 ? workerThreadLimit : (int)std::thread::hardware_concurrency() - 1;
+    count = glm::clamp(count, 0, MAX_WORKER_THREADS);
+    workerPool.queues.reset(new WorkQueue[count + 1]);
+    workerPool.active = count;
+    for (int i = 0; i < count; i++)
+        workerPool.threads.emplace_back(workerLoop, i);
+}
+
+// lets only the first count workers take new chunks (for the scaling benchmark); only to be
+// changed while no job is running
+void setActiveWorkers(int count) {
+    {
+        std::lock_guard<std::mutex> lock(workerPool.mutex);
+        workerPool.active = glm::clamp(count, 0, (int)workerPool.threads.size());
+    }
+    workerPool.wake.notify_all();
+}
+
+// helps out (with any job's chunks) until the last chunk of job is done
+void finishParallelJob(ParallelJob& job) {
+    int own = ownWorkQueue();
+    WorkChunk chunk;
+    while (job.remaining.load() > 0) {
+        if (takeWorkChunk(own, chunk)) {
+            runWorkChunk(chunk);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(workerPool.mutex);
+        workerPool.finished.wait(lock, [&] { return job.remaining.load() == 0 || workerPool.queued.load() > 0; });
+    }
+}
+
+// calls body(chunkBegin, chunkEnd) over [begin, end) in chunks of at least grain items, and
+// returns once all of them are done; chunks must not depend on each other
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body) {
+    int count = end - begin;
+    int threadCount = workerPool.active + 1;
+    if (count <= 0)
+        return;
+    if (threadCount == 1 || count <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    int chunkSize = std::max(grain, (count + threadCount * CHUNKS_PER_THREAD - 1) / (threadCount * CHUNKS_PER_THREAD));
+    int chunkCount = (count + chunkSize - 1) / chunkSize;
+    ParallelJob job;
+    job.body = &body;
+    job.remaining = chunkCount;
+
+    // dealt out over the active workers and the caller, so stealing only has to even things out
+    int own = ownWorkQueue();
+    for (int c = 0; c < chunkCount; c++) {
+        int queue = c % threadCount == workerPool.active ? own : c % threadCount;
+        WorkQueue& target = workerPool.queues[queue];
+        std::lock_guard<std::mutex> lock(target.mutex);
+        target.chunks.push_back({ &job, begin + c * chunkSize, std::min(end, begin + (c + 1) * chunkSize) });
+    }
+    {
+        std::lock_guard<std::mutex> lock(workerPool.mutex);
+        workerPool.queued += chunkCount;
+    }
+    workerPool.wake.notify_all();
+    finishParallelJob(job);
+}
+
+// job(0) .. job(count - 1), one index per chunk
+void parallelFor(int count, const std::function<void(int)>& job) {
+    parallelFor(0, count, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            job(i);
+    });
+}
+
+/*---------------------------------------------------*/
+
+/*------------------FRAME TASKS--------------------*/
+
+// render() as a graph of tasks with declared dependencies. The CPU tasks (the scene graph,
+// culling each view, packing the lights, writing the fish instances) go to the worker pool
+// as soon as what they depend on is done; the GL thread runs the GL tasks in the order they
+// were added, each once its own dependencies are done, and works on the CPU tasks while it
+// waits. A task can only depend on tasks added before it, so the graph has no cycles and the
+// GL thread never waits on a GL task it has yet to run. What the tasks hand to each other
+// lives in the frame arena (see frameAlloc()); each task shows up in the trace under its
+// name, and the chain that held the frame up under "critical path"
+#define FRAME_ARENA_SIZE (256 << 10) // grows when a frame needs more
+#define FRAME_ARENA_ALIGNMENT 16
+
+struct FrameArena {
+    std::unique_ptr<unsigned char[]> memory;
+    size_t size = 0;
+    std::atomic<size_t> used { 0 }; // can go past size, see frameAlloc()
+    std::mutex overflowMutex;
+    std::vector<std::unique_ptr<unsigned char[]>> overflow; // what did not fit this frame
+};
+FrameArena frameArena;
+
+// memory until the end of the frame, from any thread; nothing is freed on its own, the next
+// resetFrameArena() drops it all at once, so it only holds plain data
+void* frameAlloc(size_t size) {
+    size = (size + FRAME_ARENA_ALIGNMENT - 1) & ~(size_t)(FRAME_ARENA_ALIGNMENT - 1);
+    size_t offset = frameArena.used.fetch_add(size);
+    if (offset + size <= frameArena.size)
+        return frameArena.memory.get() + offset;
+    std::lock_guard<std::mutex> lock(frameArena.overflowMutex);
+    frameArena.overflow.emplace_back(new unsigned char[size]);
+    return frameArena.overflow.back().get();
+}
+
+// only while no task is running; makes room for all of the last frame from now on
+void resetFrameArena() {
+    size_t used = frameArena.used.load();
+    if (used > frameArena.size || !frameArena.memory) {
+        frameArena.size = std::max(frameArena.size * 2, std::max(used, (size_t)FRAME_ARENA_SIZE));
+        frameArena.memory.reset(new unsigned char[frameArena.size]);
+        if (used > 0)
+            std::cout << "Frame arena grown to " << frameArena.size / 1024 << " KB\n";
+    }
+    frameArena.overflow.clear();
+    frameArena.used = 0;
+}
+
+struct FrameTask {
+    const char* name;
+    std::function<void()> run;
+    bool glThread;
+    std::vector<int> dependencies, dependents;
+    std::atomic<int> waitingFor { 0 }; // dependencies not done yet
+    ParallelJob job;                   // a single chunk, remaining is 0 once the task is done
+    uint64_t start, end;               // cpuTraceTicks(), for the critical path
+};
+
+struct FrameGraph {
+    std::vector<std::unique_ptr<FrameTask>> tasks; // kept from frame to frame, count are in use
+    int count = 0;
+    std::function<void(int, int)> body; // what the job chunks run, begin is the task
+    bool serial = false;                // --serial-frame runs every task on the GL thread in order
+    std::set<std::string> criticalPaths; // the trace points at these
+};
+FrameGraph frameGraph;
+
+// dependencies can hold -1 for tasks left out of this frame; returns the task to depend on
+int addFrameTask(const char* name, bool glThread, std::initializer_list<int> dependencies, const std::function<void()>& run) {
+    FrameGraph& g = frameGraph;
+    if (g.count == (int)g.tasks.size())
+        g.tasks.emplace_back(new FrameTask);
+    int index = g.count++;
+    FrameTask& task = *g.tasks[index];
+    task.name = name;
+    task.run = run;
+    task.glThread = glThread;
+    task.dependencies.clear();
+    task.dependents.clear();
+    for (int dependency : dependencies) {
+        if (dependency < 0)
+            continue;
+        task.dependencies.push_back(dependency);
+        g.tasks[dependency]->dependents.push_back(index);
+    }
+    task.waitingFor = (int)task.dependencies.size();
+    task.job.body = &g.body;
+    task.job.remaining = 1;
+    task.start = task.end = 0;
+    return index;
+}
+
+// hands a task whose dependencies are done to the workers
+void queueFrameTask(int index) {
+    WorkQueue& queue = workerPool.queues[ownWorkQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.chunks.push_back({ &frameGraph.tasks[index]->job, index, index + 1 });
+    }
+    {
+        std::lock_guard<std::mutex> lock(workerPool.mutex);
+        workerPool.queued++;
+    }
+    workerPool.wake.notify_all();
+    workerPool.finished.notify_all(); // the GL thread may be waiting with nothing to do
+}
+
+void runFrameTask(int index) {
+    FrameTask& task = *frameGraph.tasks[index];
+    task.start = cpuTraceTicks();
+    {
+        CPU_SCOPE(task.name);
+        task.run();
+    }
+    task.end = cpuTraceTicks();
+    if (frameGraph.serial)
+        return;
+    for (int dependent : task.dependents) {
+        FrameTask& next = *frameGraph.tasks[dependent];
+        if (--next.waitingFor == 0 && !next.glThread)
+            queueFrameTask(dependent);
+    }
+}
+
+void beginFrameGraph() {
+    resetFrameArena();
+    frameGraph.count = 0;
+    frameGraph.body = [](int begin, int) { runFrameTask(begin); };
+}
+
+// walks back from the task that finished last, each time to what it waited on that finished
+// last: one of its dependencies or, for a GL task, the GL task before it
+void traceFrameCriticalPath(uint64_t start, uint64_t end) {
+#if ENABLE_CPU_TRACE
+    FrameGraph& g = frameGraph;
+    int* previousGl = (int*)frameAlloc(g.count * sizeof(int));
+    int last = -1, lastGl = -1;
+    for (int i = 0; i < g.count; i++) {
+        previousGl[i] = g.tasks[i]->glThread ? lastGl : -1;
+        if (g.tasks[i]->glThread)
+            lastGl = i;
+        if (last < 0 || g.tasks[i]->end > g.tasks[last]->end)
+            last = i;
+    }
+
+    std::string path;
+    for (int i = last; i >= 0; ) {
+        path = path.empty() ? g.tasks[i]->name : g.tasks[i]->name + (" > " + path);
+        int waitedOn = previousGl[i];
+        for (int dependency : g.tasks[i]->dependencies)
+            if (waitedOn < 0 || g.tasks[dependency]->end > g.tasks[waitedOn]->end)
+                waitedOn = dependency;
+        i = waitedOn;
+    }
+    CPU_TRACE_EVENT("critical path", g.criticalPaths.insert(path).first->c_str(), start, end);
+#endif
+}
+
+// runs the tasks added since beginFrameGraph() and returns once all of them are done
+void runFrameGraph() {
+    FrameGraph& g = frameGraph;
+    uint64_t start = cpuTraceTicks();
+    if (g.serial) {
+        for (int i = 0; i < g.count; i++)
+            runFrameTask(i);
+    }
+    else {
+        // the tasks without dependencies; the others are queued by the last one they wait on
+        for (int i = 0; i < g.count; i++)
+            if (!g.tasks[i]->glThread && g.tasks[i]->dependencies.empty())
+                queueFrameTask(i);
+
+        for (int i = 0; i < g.count; i++) {
+            FrameTask& task = *g.tasks[i];
+            if (!task.glThread)
+                continue;
+            for (int dependency : task.dependencies)
+                finishParallelJob(g.tasks[dependency]->job);
+            runFrameTask(i);
+            task.job.remaining = 0;
+        }
+
+        // the CPU tasks no GL task waited on
+        for (int i = 0; i < g.count; i++)
+            finishParallelJob(g.tasks[i]->job);
+    }
+    traceFrameCriticalPath(start, cpuTraceTicks());
+}
+
+/*---------------------------------------------------*/
+
+/*------------------SCENE SDF--------------------*/
+
+// signed distance to the static scene meshes, for the fish to steer around what they would
+// otherwise swim through. Baked once at load: a BVH over the triangles answers the closest
+// point queries, and only the bricks of SDF_BRICK^3 cells near a surface keep samples, every
+// other brick reads as far away without any lookup. A brick holds SDF_BRICK + 1 samples a
+// side, sharing its faces with the neighbors, so a trilinear lookup never leaves it. The
+// sign comes from the vertex normals of the closest triangle (negative is inside)
+#define SDF_CELL 0.25f
+#define SDF_BRICK 8
+#define SDF_BRICK_SAMPLES (SDF_BRICK + 1)
+#define SDF_BVH_LEAF 4
+
+struct SdfTriangle {
+    glm::vec3 a, b, c;
+    glm::vec3 normal; // the average of the vertex normals
+};
+
+// count 0 is an inner node with its children at first and first + 1, otherwise a leaf of
+// triangles first .. first + count - 1
+struct BvhNode {
+    glm::vec3 min, max;
+    int first, count;
+};
+
+struct SceneSdf {
+    std::vector<SdfTriangle> triangles;
+    std::vector<BvhNode> nodes;
+    glm::vec3 origin;
+    glm::ivec3 cells, bricks;
+    float band = 0.0f;           // stored distances are clamped to it, further is "far"
+    std::vector<int> brickIndex; // per brick, into samples, or -1 when far
+    std::vector<float> samples;  // SDF_BRICK_SAMPLES^3 per stored brick, x fastest
+    bool ready = false;
+};
+SceneSdf sceneSdf;
+
+// what the fish have to go around: everything standing in the scene but the leaves, the water
+// and the floor (the tank walls keep them off that)
+const int sdfMeshes[] = { 1, 3, 4, 5, 6, 8, 10, 11, 12, 13, 14, 16, 17, 18, 19 };
+
+// fills node index with triangles first .. first + count - 1, split at the median on the
+// longest axis of their centers
+void buildBvh(int index, int first, int count) {
+    glm::vec3 boxMin(FLT_MAX), boxMax(-FLT_MAX), centerMin(FLT_MAX), centerMax(-FLT_MAX);
+    for (int i = first; i < first + count; i++) {
+        const SdfTriangle& t = sceneSdf.triangles[i];
+        boxMin = glm::min(boxMin, glm::min(t.a, glm::min(t.b, t.c)));
+        boxMax = glm::max(boxMax, glm::max(t.a, glm::max(t.b, t.c)));
+        glm::vec3 center = (t.a + t.b + t.c) / 3.0f;
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+    }
+    sceneSdf.nodes[index] = { boxMin, boxMax, first, count };
+    if (count <= SDF_BVH_LEAF)
+        return;
+
+    glm::vec3 extent = centerMax - centerMin;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    auto begin = sceneSdf.triangles.begin() + first;
+    std::nth_element(begin, begin + count / 2, begin + count, [axis](const SdfTriangle& l, const SdfTriangle& r) {
+        return l.a[axis] + l.b[axis] + l.c[axis] < r.a[axis] + r.b[axis] + r.c[axis];
+    });
+
+    int children = (int)sceneSdf.nodes.size();
+    sceneSdf.nodes.resize(children + 2);
+    sceneSdf.nodes[index].first = children;
+    sceneSdf.nodes[index].count = 0;
+    buildBvh(children, first, count / 2);
+    buildBvh(children + 1, first + count / 2, count - count / 2);
+}
+
+// Ericson, Real-Time Collision Detection 5.1.5
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    float denominator = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+// the signed distance to the closest triangle, or maxDistance when none is that close
+float sceneDistance(const glm::vec3& p, float maxDistance) {
+    float best = maxDistance * maxDistance, sign = 1.0f;
+    int stack[64], depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BvhNode& node = sceneSdf.nodes[stack[--depth]];
+        glm::vec3 outside = glm::max(glm::max(node.min - p, p - node.max), 0.0f);
+        if (glm::dot(outside, outside) >= best)
+            continue;
+        if (node.count == 0) {
+            // the nearer child is popped first
+            const BvhNode& left = sceneSdf.nodes[node.first];
+            float toLeft = glm::length(glm::max(glm::max(left.min - p, p - left.max), 0.0f));
+            const BvhNode& right = sceneSdf.nodes[node.first + 1];
+            float toRight = glm::length(glm::max(glm::max(right.min - p, p - right.max), 0.0f));
+            stack[depth++] = toLeft < toRight ? node.first + 1 : node.first;
+            stack[depth++] = toLeft < toRight ? node.first : node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const SdfTriangle& t = sceneSdf.triangles[i];
+            glm::vec3 offset = p - closestPointOnTriangle(p, t.a, t.b, t.c);
+            float distance2 = glm::dot(offset, offset);
+            if (distance2 < best) {
+                best = distance2;
+                sign = glm::dot(offset, t.normal) < 0.0f ? -1.0f : 1.0f;
+            }
+        }
+    }
+    return sign * sqrt(best);
+}
+
+// bakes the distances within band of the meshes over min .. max
+void bakeSceneSdf(const glm::vec3& min, const glm::vec3& max, float band) {
+    CPU_SCOPE("bakeSceneSdf");
+    auto start = std::chrono::steady_clock::now();
+    for (int mesh : sdfMeshes) {
+        const std::vector<float>& data = vertex_data[mesh];
+        for (size_t i = 0; i + 32 < data.size(); i += 33) {
+            SdfTriangle t;
+            t.a = glm::vec3(data[i], data[i + 1], data[i + 2]);
+            t.b = glm::vec3(data[i + 11], data[i + 12], data[i + 13]);
+            t.c = glm::vec3(data[i + 22], data[i + 23], data[i + 24]);
+            t.normal = glm::vec3(data[i + 5], data[i + 6], data[i + 7]) + glm::vec3(data[i + 16], data[i + 17], data[i + 18])
+                     + glm::vec3(data[i + 27], data[i + 28], data[i + 29]);
+            sceneSdf.triangles.push_back(t);
+        }
+    }
+    if (sceneSdf.triangles.empty())
+        return;
+    sceneSdf.nodes.resize(1);
+    buildBvh(0, 0, (int)sceneSdf.triangles.size());
+
+    sceneSdf.origin = min;
+    sceneSdf.band = band;
+    sceneSdf.cells = glm::ivec3(glm::ceil((max - min) / SDF_CELL));
+    sceneSdf.bricks = (sceneSdf.cells + SDF_BRICK - 1) / SDF_BRICK;
+    int brickCount = sceneSdf.bricks.x * sceneSdf.bricks.y * sceneSdf.bricks.z;
+    sceneSdf.brickIndex.assign(brickCount, -1);
+
+    // a brick is kept when a surface comes within band of any point in it
+    const float brickSize = SDF_BRICK * SDF_CELL;
+    const float halfDiagonal = 0.5f * brickSize * sqrt(3.0f);
+    auto brickCorner = [](int brick) {
+        glm::ivec3 b(brick % sceneSdf.bricks.x, brick / sceneSdf.bricks.x % sceneSdf.bricks.y, brick / (sceneSdf.bricks.x * sceneSdf.bricks.y));
+        return sceneSdf.origin + glm::vec3(b) * (SDF_BRICK * SDF_CELL);
+    };
+    std::vector<char> keep(brickCount);
+    parallelFor(0, brickCount, 16, [&](int begin, int end) {
+        for (int b = begin; b < end; b++)
+            keep[b] = fabs(sceneDistance(brickCorner(b) + 0.5f * brickSize, band + halfDiagonal)) < band + halfDiagonal;
+    });
+    int stored = 0;
+    for (int b = 0; b < brickCount; b++)
+        if (keep[b])
+            sceneSdf.brickIndex[b] = stored++;
+
+    const int brickSamples = SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES;
+    sceneSdf.samples.resize((size_t)stored * brickSamples);
+    parallelFor(0, brickCount, 1, [&](int begin, int end) {
+        for (int b = begin; b < end; b++) {
+            if (sceneSdf.brickIndex[b] < 0)
+                continue;
+            float* samples = &sceneSdf.samples[(size_t)sceneSdf.brickIndex[b] * brickSamples];
+            glm::vec3 corner = brickCorner(b);
+            for (int z = 0; z < SDF_BRICK_SAMPLES; z++)
+                for (int y = 0; y < SDF_BRICK_SAMPLES; y++)
+                    for (int x = 0; x < SDF_BRICK_SAMPLES; x++)
+                        *samples++ = sceneDistance(corner + glm::vec3(x, y, z) * SDF_CELL, band);
+        }
+    });
+    sceneSdf.ready = true;
+
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Scene SDF: " << sceneSdf.triangles.size() << " triangles, " << stored << " of " << brickCount << " bricks kept ("
+              << sceneSdf.samples.size() * sizeof(float) / 1024 << " KB), baked in " << (int)ms << " ms\n";
+}
+
+// the trilinear distance at p and its gradient; band with a zero gradient where nothing is near
+float sampleSceneSdf(const glm::vec3& p, glm::vec3& gradient) {
+    gradient = glm::vec3(0.0f);
+    glm::vec3 grid = (p - sceneSdf.origin) / SDF_CELL;
+    if (glm::any(glm::lessThan(grid, glm::vec3(0.0f))) || glm::any(glm::greaterThanEqual(grid, glm::vec3(sceneSdf.cells))))
+        return sceneSdf.band;
+    glm::ivec3 brick = glm::ivec3(grid) / SDF_BRICK;
+    int index = sceneSdf.brickIndex[(brick.z * sceneSdf.bricks.y + brick.y) * sceneSdf.bricks.x + brick.x];
+    if (index < 0)
+        return sceneSdf.band;
+
+    glm::vec3 local = grid - glm::vec3(brick * SDF_BRICK);
+    glm::ivec3 cell = glm::min(glm::ivec3(local), glm::ivec3(SDF_BRICK - 1));
+    glm::vec3 f = local - glm::vec3(cell);
+    const int dy = SDF_BRICK_SAMPLES, dz = SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES;
+    const float* c = &sceneSdf.samples[(size_t)index * dz * SDF_BRICK_SAMPLES + (cell.z * dy + cell.y) * dy + cell.x];
+    float c000 = c[0], c100 = c[1], c010 = c[dy], c110 = c[dy + 1];
+    float c001 = c[dz], c101 = c[dz + 1], c011 = c[dz + dy], c111 = c[dz + dy + 1];
+
+    float x00 = glm::mix(c000, c100, f.x), x10 = glm::mix(c010, c110, f.x);
+    float x01 = glm::mix(c001, c101, f.x), x11 = glm::mix(c011, c111, f.x);
+    float y0 = glm::mix(x00, x10, f.y), y1 = glm::mix(x01, x11, f.y);
+    gradient.x = glm::mix(glm::mix(c100 - c000, c110 - c010, f.y), glm::mix(c101 - c001, c111 - c011, f.y), f.z);
+    gradient.y = glm::mix(x10 - x00, x11 - x01, f.z);
+    gradient.z = y1 - y0;
+    gradient /= SDF_CELL;
+    return glm::mix(y0, y1, f.z);
+}
+
+/*---------------------------------------------------*/
+
 /*------------------FISH--------------------*/
 
 // fish parameters
-const int NUM_FISH = 16;
-const int DT = 16; // milliseconds per frame (~60 FPS)
-const float TURN_RATE = 0.1f; // radians per frame
+int numFish = 16; // --fish N
+const int MAX_FISH_LIGHTS = 16; // the first fish carry the point lights (the shader's MAX_POINT_LIGHTS)
+const float FISH_TICK = 1.0f / 60.0f; // seconds per simulation step, whatever the frame rate
+const int MAX_FISH_TICKS_PER_FRAME = 8; // after a longer stall the fish skip ahead instead of catching up
+const float TURN_RATE = 0.1f; // radians per step
 const int MAX_SPEED = 15;
 const int MIN_SPEED = 10;
 
@@ -365,16 +1235,78 @@ struct Fish {
     Light* light = nullptr;
 };
 
-std::vector<Fish> fishes(NUM_FISH);
-std::vector<glm::mat4> fishMatrices(NUM_FISH);
+struct FishPose {
+    glm::vec3 position;
+    glm::quat orientation;
+};
+
+// simulation level of detail, see assignFishLod()
+enum FishLod { FISH_LOD_NEAR, FISH_LOD_MID, FISH_LOD_FAR };
+
+// the simulation state as structure of arrays, for the SIMD kernel (see stepFishSoA()); the
+// arrays are padded to a multiple of 8 fish so the kernel needs no remainder loop
+struct FishState {
+    int count = 0;
+    std::vector<float> x, y, z;        // position
+    std::vector<float> vx, vy, vz;     // velocity
+    std::vector<float> speed;
+    std::vector<float> qx, qy, qz, qw; // orientation
+    std::vector<float> ax, ay, az;     // neighbor avoidance for the current step
+    std::vector<float> fx, fy, fz;     // the flow for the current step, with --flow-volume
+    std::vector<float> ox, oy, oz;     // obstacle avoidance for the current step, from the scene SDF
+    std::vector<float> step, turn;     // ticks the current step covers (0 to hold the fish) and how far it turns
+    std::vector<unsigned char> lod;    // FishLod of each fish
+};
 
-void initFish() {
+void loadFishState(FishState& s, const std::vector<Fish>& school) {
+    s.count = (int)school.size();
+    size_t padded = (school.size() + 7) / 8 * 8;
+    for (std::vector<float>* array : { &s.x, &s.y, &s.z, &s.vx, &s.vy, &s.vz, &s.speed, &s.qx, &s.qy, &s.qz, &s.qw, &s.ax, &s.ay, &s.az, &s.fx, &s.fy, &s.fz, &s.ox, &s.oy, &s.oz, &s.step, &s.turn })
+        array->assign(padded, 0.0f);
+    s.lod.assign(padded, FISH_LOD_NEAR);
+    for (size_t i = 0; i < school.size(); i++) {
+        const Fish& f = school[i];
+        s.step[i] = 1.0f;
+        s.turn[i] = TURN_RATE;
+        s.x[i] = f.position.x; s.y[i] = f.position.y; s.z[i] = f.position.z;
+        s.vx[i] = f.velocity.x; s.vy[i] = f.velocity.y; s.vz[i] = f.velocity.z;
+        s.speed[i] = f.speed;
+        s.qx[i] = f.orientation.x; s.qy[i] = f.orientation.y; s.qz[i] = f.orientation.z; s.qw[i] = f.orientation.w;
+    }
+}
+
+FishPose fishPose(const FishState& s, int i) {
+    return { glm::vec3(s.x[i], s.y[i], s.z[i]), glm::quat(s.qw[i], s.qx[i], s.qy[i], s.qz[i]) };
+}
+
+// live state, owned by the simulation thread once it runs
+FishState fishState;
+
+// what the fish draw reads per instance, 24 bytes where a matrix took 64; Finals-Shader.vs
+// rebuilds the model matrix from it (see fishModel() there)
+struct FishInstance {
+    glm::vec3 position;
+    float scale;
+    short orientation[4]; // xyzw quaternion as snorm16
+};
+static_assert(sizeof(FishInstance) == 24, "FishInstance has to match the attributes set up in drawScene()");
+
+// render thread side: the snapshot and blend picked once a frame by updateFish(), written
+// straight into the stream buffer by writeFishInstances() and drawn from there in every
+// view; the lights follow fishRenderPositions, one per fish that carries a light
+std::vector<glm::vec3> fishRenderPositions;
+float fishRenderAlpha = 0.0f;
+GLintptr fishInstancesOffset = -1; // -1 when this frame's instances could not be mapped
+
+// scatters count fish around a ring, without lights
+std::vector<Fish> spawnFish(int count) {
+    std::vector<Fish> spawned(count);
     float radius = 10.0f;
     float offset = 5.0f;
 
     int i = 0;
-    for (auto& f : fishes) {
-        float angle = (float)i++ / (float)NUM_FISH * 360.0f;
+    for (auto& f : spawned) {
+        float angle = (float)i++ / (float)count * 360.0f;
         float displacement = (rand() % (int)(2 * offset * 100)) / 100.0f - offset;
         float x = sin(angle) * radius + displacement;
         displacement = (rand() % (int)(2 * offset * 100)) / 100.0f - offset;
@@ -393,9 +1325,20 @@ void initFish() {
         // std::cout << f.speed << std::endl;
         f.radius = 0.15f;
         f.orientation = glm::quatLookAt(f.velocity, glm::vec3(0.0f, 1.0f, 0.0f)); 
+    }
+    return spawned;
+}
+
+void initFish() {
+    std::vector<Fish> school = spawnFish(numFish);
+    loadFishState(fishState, school);
+    fishRenderPositions.resize(std::min(numFish, MAX_FISH_LIGHTS));
+    for (int i = 0; i < (int)fishRenderPositions.size(); i++) {
+        Fish& f = school[i];
+        fishRenderPositions[i] = f.position;
 
         Light* fireflyLight = new Light(Light::POINT);
-        fireflyLight->externalPosition = &f.position;
+        fireflyLight->externalPosition = &fishRenderPositions[i];
         fireflyLight->diffuse = glm::vec3(0.8f, 0.6f, 0.2f); // warm yellow
         fireflyLight->color = glm::vec3(1.0f, 0.9f, 0.5f);
         fireflyLight->constant = 1.0f;
@@ -413,6 +1356,94 @@ glm::vec3 flowField(const glm::vec3& position, float time) {
     return glm::normalize(glm::vec3(flowX, flowY, flowZ));
 }
 
+/*
+ * flowField() baked into a grid over the tank and sampled trilinearly (--flow-volume). The
+ * field moves with time, so the volume keeps key frames FLOW_KEY_TICKS steps apart and blends
+ * the two around the current step; the key frame after them is baked FLOW_SLABS_PER_TICK
+ * slabs of z per step while they are in use, so no step pays for a whole grid. Any field
+ * fits: the volume only ever calls its source, which could as well be authored data or noise
+ */
+#define FLOW_GRID 64 // samples along each axis, TANK_MIN and TANK_MAX included
+#define FLOW_KEY_TICKS 8
+#define FLOW_SLABS_PER_TICK (FLOW_GRID / FLOW_KEY_TICKS)
+
+typedef glm::vec3 (*FlowSource)(const glm::vec3& position, float time);
+
+struct FlowVolume {
+    FlowSource source = flowField;
+    std::vector<glm::vec3> keys[3];             // FLOW_GRID^3 samples each, x fastest
+    long long keyFrame[3] = { -1, -1, -1 };     // key frame k is at step k * FLOW_KEY_TICKS, in slot k % 3
+    int bakedSlabs[3] = {};
+    const glm::vec3* sampling[2] = {};          // the two key frames around the step being sampled
+    float blend = 0.0f;                         // how far between them
+};
+FlowVolume flowVolume;
+bool useFlowVolume = false; // --flow-volume
+
+glm::vec3 flowVolumePosition(int x, int y, int z) {
+    return TANK_MIN + (TANK_MAX - TANK_MIN) * glm::vec3(x, y, z) / (float)(FLOW_GRID - 1);
+}
+
+void bakeFlowSlabs(long long keyFrame, int firstSlab, int endSlab) {
+    CPU_SCOPE("bakeFlowSlabs");
+    int slot = (int)(keyFrame % 3);
+    std::vector<glm::vec3>& key = flowVolume.keys[slot];
+    key.resize(FLOW_GRID * FLOW_GRID * FLOW_GRID);
+    float time = keyFrame * FLOW_KEY_TICKS * FISH_TICK;
+    parallelFor(firstSlab, endSlab, 1, [&](int begin, int end) {
+        for (int z = begin; z < end; z++)
+            for (int y = 0; y < FLOW_GRID; y++)
+                for (int x = 0; x < FLOW_GRID; x++)
+                    key[(z * FLOW_GRID + y) * FLOW_GRID + x] = flowVolume.source(flowVolumePosition(x, y, z), time);
+    });
+    flowVolume.keyFrame[slot] = keyFrame;
+    flowVolume.bakedSlabs[slot] = endSlab;
+}
+
+// gets the key frames around step tick ready, and bakes this step's share of the next one;
+// after a jump in the clock the missing key frames are baked whole
+void prepareFlowVolume(long long tick) {
+    long long key = tick / FLOW_KEY_TICKS;
+    for (long long k = key; k <= key + 1; k++) {
+        int slot = (int)(k % 3);
+        if (flowVolume.keyFrame[slot] != k)
+            flowVolume.bakedSlabs[slot] = 0;
+        if (flowVolume.bakedSlabs[slot] < FLOW_GRID)
+            bakeFlowSlabs(k, flowVolume.bakedSlabs[slot], FLOW_GRID);
+    }
+
+    int slot = (int)((key + 2) % 3);
+    if (flowVolume.keyFrame[slot] != key + 2)
+        flowVolume.bakedSlabs[slot] = 0;
+    int wanted = (int)(tick % FLOW_KEY_TICKS + 1) * FLOW_SLABS_PER_TICK;
+    if (flowVolume.bakedSlabs[slot] < wanted)
+        bakeFlowSlabs(key + 2, flowVolume.bakedSlabs[slot], wanted);
+
+    flowVolume.sampling[0] = flowVolume.keys[key % 3].data();
+    flowVolume.sampling[1] = flowVolume.keys[(key + 1) % 3].data();
+    flowVolume.blend = (float)(tick % FLOW_KEY_TICKS) / FLOW_KEY_TICKS;
+}
+
+// trilinear in space and linear in time, between the key frames of the last prepareFlowVolume();
+// positions outside the tank take the nearest sample on its walls
+glm::vec3 sampleFlowVolume(const glm::vec3& position) {
+    glm::vec3 grid = glm::clamp((position - TANK_MIN) / (TANK_MAX - TANK_MIN), 0.0f, 1.0f) * (float)(FLOW_GRID - 1);
+    glm::ivec3 cell = glm::min(glm::ivec3(grid), glm::ivec3(FLOW_GRID - 2));
+    glm::vec3 f = grid - glm::vec3(cell);
+    int base = (cell.z * FLOW_GRID + cell.y) * FLOW_GRID + cell.x;
+    const int dy = FLOW_GRID, dz = FLOW_GRID * FLOW_GRID;
+
+    glm::vec3 frames[2];
+    for (int k = 0; k < 2; k++) {
+        const glm::vec3* v = flowVolume.sampling[k] + base;
+        glm::vec3 y0 = glm::mix(glm::mix(v[0], v[1], f.x), glm::mix(v[dy], v[dy + 1], f.x), f.y);
+        glm::vec3 y1 = glm::mix(glm::mix(v[dz], v[dz + 1], f.x), glm::mix(v[dz + dy], v[dz + dy + 1], f.x), f.y);
+        frames[k] = glm::mix(y0, y1, f.z);
+    }
+    return glm::normalize(glm::mix(frames[0], frames[1], flowVolume.blend));
+}
+
+// brute force, O(n) per fish; kept as the reference for the grid below (see runFishBenchmark())
 glm::vec3 avoidNeighbors(const Fish& fish, const std::vector<Fish>& fishes) {
     glm::vec3 avoidance(0.0f);
     for (const auto& other : fishes) {
@@ -428,6 +1459,97 @@ glm::vec3 avoidNeighbors(const Fish& fish, const std::vector<Fish>& fishes) {
     return avoidance;
 }
 
+// spatial hash of the fish with AVOID_RADIUS cells, so every neighbor within AVOID_RADIUS is
+// in one of the 27 cells around a fish. Rebuilt every step with a counting sort: cellStart[b]
+// .. cellStart[b + 1] are the fish of bucket b in fishIndex, in ascending order. The hash
+// table has at least twice as many buckets as fish; cells that collide share a bucket and
+// are told apart by the distance test
+struct FishGrid {
+    std::vector<int> cellStart;
+    std::vector<int> fishIndex;
+    std::vector<int> fishBucket;
+    int bucketMask = 0;
+};
+FishGrid fishGrid;
+
+glm::ivec3 fishCell(const glm::vec3& position) {
+    return glm::ivec3(glm::floor(position / AVOID_RADIUS));
+}
+
+int fishBucket(const FishGrid& grid, const glm::ivec3& cell) {
+    uint32_t hash = (uint32_t)cell.x * 73856093u ^ (uint32_t)cell.y * 19349663u ^ (uint32_t)cell.z * 83492791u;
+    return (int)(hash & (uint32_t)grid.bucketMask);
+}
+
+void buildFishGrid(FishGrid& grid, const FishState& s) {
+    int buckets = 1;
+    while (buckets < 2 * s.count)
+        buckets *= 2;
+    grid.bucketMask = buckets - 1;
+    grid.cellStart.assign(buckets + 1, 0);
+    grid.fishIndex.resize(s.count);
+    grid.fishBucket.resize(s.count);
+
+    parallelFor(0, s.count, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            grid.fishBucket[i] = fishBucket(grid, fishCell(glm::vec3(s.x[i], s.y[i], s.z[i])));
+    });
+    for (int i = 0; i < s.count; i++)
+        grid.cellStart[grid.fishBucket[i] + 1]++;
+    for (int b = 0; b < buckets; b++)
+        grid.cellStart[b + 1] += grid.cellStart[b];
+
+    // scatter in index order, which keeps every bucket sorted
+    std::vector<int> next(grid.cellStart.begin(), grid.cellStart.end() - 1);
+    for (int i = 0; i < s.count; i++)
+        grid.fishIndex[next[grid.fishBucket[i]]++] = i;
+}
+
+// same result as avoidNeighbors(), to the bit: the neighbors are summed in index order
+glm::vec3 avoidNeighborsGrid(const FishGrid& grid, const FishState& s, int index) {
+    glm::vec3 position(s.x[index], s.y[index], s.z[index]);
+    glm::ivec3 cell = fishCell(position);
+
+    // the 27 cells can land in the same bucket, which must only be read once
+    int buckets[27], bucketCount = 0;
+    for (int z = -1; z <= 1; z++)
+        for (int y = -1; y <= 1; y++)
+            for (int x = -1; x <= 1; x++) {
+                int b = fishBucket(grid, cell + glm::ivec3(x, y, z));
+                if (std::find(buckets, buckets + bucketCount, b) == buckets + bucketCount)
+                    buckets[bucketCount++] = b;
+            }
+
+    int neighbors[64];
+    std::vector<int> manyNeighbors; // only for unusually crowded spots
+    int count = 0;
+    for (int k = 0; k < bucketCount; k++) {
+        for (int e = grid.cellStart[buckets[k]]; e < grid.cellStart[buckets[k] + 1]; e++) {
+            int other = grid.fishIndex[e];
+            if (other == index || glm::length(position - glm::vec3(s.x[other], s.y[other], s.z[other])) >= AVOID_RADIUS)
+                continue;
+            if (count < 64)
+                neighbors[count] = other;
+            else {
+                if (count == 64)
+                    manyNeighbors.assign(neighbors, neighbors + 64);
+                manyNeighbors.push_back(other);
+            }
+            count++;
+        }
+    }
+    int* sorted = count <= 64 ? neighbors : manyNeighbors.data();
+    std::sort(sorted, sorted + count);
+
+    glm::vec3 avoidance(0.0f);
+    for (int k = 0; k < count; k++) {
+        glm::vec3 d = position - glm::vec3(s.x[sorted[k]], s.y[sorted[k]], s.z[sorted[k]]);
+        float dist = glm::length(d);
+        avoidance += glm::normalize(d) * (AVOID_RADIUS - dist);
+    }
+    return avoidance;
+}
+
 glm::vec3 avoidWalls(const Fish& f) {
     glm::vec3 avoidance(0.0f);
     float margin = 0.5f;
@@ -492,10 +1614,25 @@ glm::vec3 avoidBoundingBox(const Fish& fish, const glm::vec3& boxMin, const glm:
     return glm::normalize(toFish) * strength;
 }
 
-void computeNextFishStates(float time) {
-    for (auto& f : fishes) {
+// avoidBoundingBox() for the whole scene at once, through its SDF: one lookup whatever the
+// scene holds, pushing out along the gradient; inside, it pushes as hard as inside a box
+glm::vec3 avoidScene(const glm::vec3& position) {
+    glm::vec3 gradient;
+    float distance = sampleSceneSdf(position, gradient);
+    float length = glm::length(gradient);
+    if (distance > AVOID_DISTANCE || length < EPSILON)
+        return glm::vec3(0.0f);
+    float strength = glm::min((AVOID_DISTANCE - distance) / AVOID_DISTANCE, AVOID_DISTANCE);
+    return gradient / length * strength * OBSTACLE_WEIGHT;
+}
+
+// the original one fish at a time version of stepFishSoA(), kept as its reference (see
+// runFishBenchmark()); avoid is the neighbor avoidance of every fish
+void stepFishAoS(std::vector<Fish>& school, const std::vector<glm::vec3>& avoid, float time) {
+    CPU_SCOPE("stepFishAoS");
+    for (size_t i = 0; i < school.size(); i++) {
+        Fish& f = school[i];
         glm::vec3 flow = flowField(f.position, time) * FLOW_WEIGHT;
-        glm::vec3 avoid = avoidNeighbors(f, fishes) * AVOID_WEIGHT;
         glm::vec3 wall = avoidWalls(f) * AVOID_WEIGHT;
 
         // get obstacles
@@ -504,40 +1641,1955 @@ void computeNextFishStates(float time) {
             obstacle += avoidBoundingBox(f, box.min, box.max) * OBSTACLE_WEIGHT;
         }
 
-        glm::vec3 desiredVelocity = glm::normalize(flow + avoid + wall + obstacle);
+        glm::vec3 desiredVelocity = glm::normalize(flow + avoid[i] * AVOID_WEIGHT + wall + obstacle);
         f.velocity = glm::mix(f.velocity, desiredVelocity, TURN_RATE); // smooth turning 
-        f.position += f.velocity * f.speed * (DT / 16.0f); // adjust speed based on frame time 
+        f.position += f.velocity * f.speed; // one fixed step
         f.orientation = glm::quatLookAt(f.velocity, glm::vec3(0.0f, 1.0f, 0.0f)); // orient
-
     }
 }
 
+/*
+ * Structure of arrays kernel for the fish, FISH_LANES fish per instruction: 8 with AVX2,
+ * 4 with SSE2 and 1 without either, picked when compiling: the plain build gets 4, adding
+ * -mavx2 to the g++ line gets 8 but needs a CPU with AVX2 to run. The fv* helpers hide the
+ * instruction set so the kernel below is written once
+ */
+#if defined(__AVX2__)
+#define FISH_LANES 8
+typedef __m256 FishRegister;
+#elif defined(__SSE2__)
+#define FISH_LANES 4
+typedef __m128 FishRegister;
+#else
+#define FISH_LANES 1
+typedef float FishRegister;
+#endif
+
+struct FishVec { FishRegister v; };
+struct FishMask { FishRegister v; }; // all bits set in the lanes where the comparison held
+
+#if defined(__AVX2__)
+inline FishVec fvSet(float a) { return { _mm256_set1_ps(a) }; }
+inline FishVec fvLoad(const float* p) { return { _mm256_loadu_ps(p) }; }
+inline void fvStore(float* p, FishVec a) { _mm256_storeu_ps(p, a.v); }
+inline FishVec operator+(FishVec a, FishVec b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline FishVec operator-(FishVec a, FishVec b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline FishVec operator*(FishVec a, FishVec b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline FishVec operator/(FishVec a, FishVec b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline FishVec fvMin(FishVec a, FishVec b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline FishVec fvMax(FishVec a, FishVec b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline FishVec fvSqrt(FishVec a) { return { _mm256_sqrt_ps(a.v) }; }
+inline FishVec fvFloor(FishVec a) { return { _mm256_floor_ps(a.v) }; }
+inline FishMask fvLess(FishVec a, FishVec b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline FishVec fvSelect(FishMask m, FishVec a, FishVec b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+#elif defined(__SSE2__)
+inline FishVec fvSet(float a) { return { _mm_set1_ps(a) }; }
+inline FishVec fvLoad(const float* p) { return { _mm_loadu_ps(p) }; }
+inline void fvStore(float* p, FishVec a) { _mm_storeu_ps(p, a.v); }
+inline FishVec operator+(FishVec a, FishVec b) { return { _mm_add_ps(a.v, b.v) }; }
+inline FishVec operator-(FishVec a, FishVec b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline FishVec operator*(FishVec a, FishVec b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline FishVec operator/(FishVec a, FishVec b) { return { _mm_div_ps(a.v, b.v) }; }
+inline FishVec fvMin(FishVec a, FishVec b) { return { _mm_min_ps(a.v, b.v) }; }
+inline FishVec fvMax(FishVec a, FishVec b) { return { _mm_max_ps(a.v, b.v) }; }
+inline FishVec fvSqrt(FishVec a) { return { _mm_sqrt_ps(a.v) }; }
+inline FishVec fvFloor(FishVec a) {
+    // truncate, then step down where that rounded up (negative numbers); |a| < 2^31
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return { _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f))) };
+}
+inline FishMask fvLess(FishVec a, FishVec b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline FishVec fvSelect(FishMask m, FishVec a, FishVec b) { return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) }; }
+#else
+inline FishVec fvSet(float a) { return { a }; }
+inline FishVec fvLoad(const float* p) { return { *p }; }
+inline void fvStore(float* p, FishVec a) { *p = a.v; }
+inline FishVec operator+(FishVec a, FishVec b) { return { a.v + b.v }; }
+inline FishVec operator-(FishVec a, FishVec b) { return { a.v - b.v }; }
+inline FishVec operator*(FishVec a, FishVec b) { return { a.v * b.v }; }
+inline FishVec operator/(FishVec a, FishVec b) { return { a.v / b.v }; }
+inline FishVec fvMin(FishVec a, FishVec b) { return { std::min(a.v, b.v) }; }
+inline FishVec fvMax(FishVec a, FishVec b) { return { std::max(a.v, b.v) }; }
+inline FishVec fvSqrt(FishVec a) { return { std::sqrt(a.v) }; }
+inline FishVec fvFloor(FishVec a) { return { std::floor(a.v) }; }
+inline FishMask fvLess(FishVec a, FishVec b) { return { a.v < b.v ? 1.0f : 0.0f }; }
+inline FishVec fvSelect(FishMask m, FishVec a, FishVec b) { return m.v != 0.0f ? a : b; }
+#endif
+
+inline FishVec fvClamp(FishVec a, float low, float high) { return fvMin(fvMax(a, fvSet(low)), fvSet(high)); }
+inline FishVec fvDot(FishVec ax, FishVec ay, FishVec az, FishVec bx, FishVec by, FishVec bz) { return ax * bx + ay * by + az * bz; }
+
+inline void fvNormalize(FishVec& x, FishVec& y, FishVec& z) {
+    FishVec inverse = fvSet(1.0f) / fvSqrt(fvDot(x, y, z, x, y, z));
+    x = x * inverse; y = y * inverse; z = z * inverse;
+}
 
-/*------------------------------------------*/
+// odd polynomial on [-pi/2, pi/2] after folding the argument there; about 1e-7 off std::sin
+inline FishVec fvSin(FishVec x) {
+    const float twoPi = 6.28318531f, pi = 3.14159265f, halfPi = 1.57079633f;
+    x = x - fvFloor(x * fvSet(1.0f / twoPi) + fvSet(0.5f)) * fvSet(twoPi); // [-pi, pi]
+    x = fvSelect(fvLess(fvSet(halfPi), x), fvSet(pi) - x, x);
+    x = fvSelect(fvLess(x, fvSet(-halfPi)), fvSet(-pi) - x, x);
+    FishVec x2 = x * x;
+    FishVec p = fvSet(-2.50521084e-8f);
+    p = p * x2 + fvSet(2.75573192e-6f);
+    p = p * x2 + fvSet(-1.98412698e-4f);
+    p = p * x2 + fvSet(8.33333333e-3f);
+    p = p * x2 + fvSet(-1.66666667e-1f);
+    return x + x * x2 * p;
+}
 
-// helper function for reading model data from a file
-void readModelData(std::vector<float> &array, const char* filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        return;
-    }
+inline FishVec fvCos(FishVec x) { return fvSin(x + fvSet(1.57079633f)); }
 
-    std::string line;
-    while (std::getline(file, line)) {
-        std::string value;
-        std::istringstream tokenizer(line);
-        while (std::getline(tokenizer, value, ',')) {
-            try {
-                array.push_back(std::stof(value));
-            } catch (const std::invalid_argument& e) {
-                // skip
-            }
-        }
+// one step for FISH_LANES fish starting at i; the same math as stepFishAoS()
+void stepFishLanes(FishState& s, int i, FishVec time) {
+    FishVec px = fvLoad(&s.x[i]), py = fvLoad(&s.y[i]), pz = fvLoad(&s.z[i]);
+    FishVec zero = fvSet(0.0f), one = fvSet(1.0f);
+
+    // flowField(), or the volume's samples
+    FishVec flowX, flowY, flowZ;
+    if (useFlowVolume) {
+        flowX = fvLoad(&s.fx[i]); flowY = fvLoad(&s.fy[i]); flowZ = fvLoad(&s.fz[i]);
+    }
+    else {
+        flowX = fvSin(pz + time); flowY = fvCos(px + time * fvSet(0.5f)); flowZ = fvCos(py + time);
+        fvNormalize(flowX, flowY, flowZ);
+    }
+
+    // avoidWalls()
+    const float margin = 0.5f;
+    FishVec wallX = fvSelect(fvLess(fvSet(TANK_MAX.x - margin), px), fvSet(-1.0f), zero) + fvSelect(fvLess(px, fvSet(TANK_MIN.x + margin)), one, zero);
+    FishVec wallY = fvSelect(fvLess(fvSet(TANK_MAX.y - margin), py), fvSet(-1.0f), zero) + fvSelect(fvLess(py, fvSet(TANK_MIN.y + margin)), one, zero);
+    FishVec wallZ = fvSelect(fvLess(fvSet(TANK_MAX.z - margin), pz), fvSet(-1.0f), zero) + fvSelect(fvLess(pz, fvSet(TANK_MIN.z - margin)), one, zero);
+
+    // avoidScene() was sampled already when there is a scene SDF; otherwise
+    // avoidBoundingBox(), every lane takes all three branches and keeps one
+    FishVec obstacleX = zero, obstacleY = zero, obstacleZ = zero;
+    if (sceneSdf.ready) {
+        obstacleX = fvLoad(&s.ox[i]); obstacleY = fvLoad(&s.oy[i]); obstacleZ = fvLoad(&s.oz[i]);
+    }
+    else for (const AABB& box : aabbs) {
+        FishVec toX = px - fvClamp(px, box.min.x, box.max.x);
+        FishVec toY = py - fvClamp(py, box.min.y, box.max.y);
+        FishVec toZ = pz - fvClamp(pz, box.min.z, box.max.z);
+        FishVec distance = fvSqrt(fvDot(toX, toY, toZ, toX, toY, toZ));
+
+        glm::vec3 center = (box.min + box.max) * 0.5f;
+        FishVec outX = px - fvSet(center.x), outY = py - fvSet(center.y), outZ = pz - fvSet(center.z);
+        fvNormalize(outX, outY, outZ);
+        FishVec strength = (fvSet(AVOID_DISTANCE) - distance) / fvSet(AVOID_DISTANCE);
+        fvNormalize(toX, toY, toZ);
+
+        FishMask inside = fvLess(distance, fvSet(EPSILON));
+        FishMask far = fvLess(fvSet(AVOID_DISTANCE), distance);
+        FishVec scale = fvSelect(inside, fvSet(AVOID_DISTANCE), strength);
+        FishVec ax = fvSelect(inside, outX, toX) * scale, ay = fvSelect(inside, outY, toY) * scale, az = fvSelect(inside, outZ, toZ) * scale;
+        obstacleX = obstacleX + fvSelect(far, zero, ax) * fvSet(OBSTACLE_WEIGHT);
+        obstacleY = obstacleY + fvSelect(far, zero, ay) * fvSet(OBSTACLE_WEIGHT);
+        obstacleZ = obstacleZ + fvSelect(far, zero, az) * fvSet(OBSTACLE_WEIGHT);
+    }
+
+    FishVec flowWeight = fvSet(FLOW_WEIGHT), avoidWeight = fvSet(AVOID_WEIGHT);
+    FishVec desiredX = flowX * flowWeight + fvLoad(&s.ax[i]) * avoidWeight + wallX * avoidWeight + obstacleX;
+    FishVec desiredY = flowY * flowWeight + fvLoad(&s.ay[i]) * avoidWeight + wallY * avoidWeight + obstacleY;
+    FishVec desiredZ = flowZ * flowWeight + fvLoad(&s.az[i]) * avoidWeight + wallZ * avoidWeight + obstacleZ;
+    fvNormalize(desiredX, desiredY, desiredZ);
+
+    // smooth turning, then one fixed step, or a few at once for the fish on a coarser tier
+    FishVec turn = fvLoad(&s.turn[i]), keep = one - turn;
+    FishVec vx = fvLoad(&s.vx[i]) * keep + desiredX * turn;
+    FishVec vy = fvLoad(&s.vy[i]) * keep + desiredY * turn;
+    FishVec vz = fvLoad(&s.vz[i]) * keep + desiredZ * turn;
+    FishVec speed = fvLoad(&s.speed[i]) * fvLoad(&s.step[i]);
+    fvStore(&s.vx[i], vx); fvStore(&s.vy[i], vy); fvStore(&s.vz[i], vz);
+    fvStore(&s.x[i], px + vx * speed); fvStore(&s.y[i], py + vy * speed); fvStore(&s.z[i], pz + vz * speed);
+
+    // glm::quatLookAt(velocity, up) with up = +y: the basis is right, up', back = -velocity
+    FishVec backX = zero - vx, backY = zero - vy, backZ = zero - vz;
+    FishVec rightScale = one / fvSqrt(fvMax(fvSet(0.00001f), backZ * backZ + backX * backX));
+    FishVec rightX = backZ * rightScale, rightZ = zero - backX * rightScale; // right.y is 0
+    FishVec upX = backY * rightZ, upY = backZ * rightX - backX * rightZ, upZ = zero - backY * rightX;
+
+    // glm::quat_cast() of that basis, again all four branches
+    FishVec fourX = rightX - upY - backZ, fourY = upY - rightX - backZ, fourZ = backZ - rightX - upY, fourW = rightX + upY + backZ;
+    FishMask pickX = fvLess(fourW, fourX);
+    FishVec biggest = fvSelect(pickX, fourX, fourW);
+    FishMask pickY = fvLess(biggest, fourY);
+    biggest = fvSelect(pickY, fourY, biggest);
+    FishMask pickZ = fvLess(biggest, fourZ);
+    biggest = fvSelect(pickZ, fourZ, biggest);
+    FishVec biggestVal = fvSqrt(biggest + one) * fvSet(0.5f);
+    FishVec mult = fvSet(0.25f) / biggestVal;
+
+    // m[1][2] = up.z, m[2][1] = back.y, m[2][0] = back.x, m[0][2] = right.z, m[0][1] = 0, m[1][0] = up.x
+    FishVec yzDiff = (upZ - backY) * mult, zxDiff = (backX - rightZ) * mult, xyDiff = (zero - upX) * mult;
+    FishVec xySum = upX * mult, zxSum = (backX + rightZ) * mult, yzSum = (upZ + backY) * mult;
+
+    // the last pick that beat the running biggest wins, as in glm
+    FishVec qw = fvSelect(pickX, yzDiff, biggestVal), qx = fvSelect(pickX, biggestVal, yzDiff);
+    FishVec qy = fvSelect(pickX, xySum, zxDiff), qz = fvSelect(pickX, zxSum, xyDiff);
+    qw = fvSelect(pickY, zxDiff, qw); qx = fvSelect(pickY, xySum, qx); qy = fvSelect(pickY, biggestVal, qy); qz = fvSelect(pickY, yzSum, qz);
+    qw = fvSelect(pickZ, xyDiff, qw); qx = fvSelect(pickZ, zxSum, qx); qy = fvSelect(pickZ, yzSum, qy); qz = fvSelect(pickZ, biggestVal, qz);
+    fvStore(&s.qw[i], qw); fvStore(&s.qx[i], qx); fvStore(&s.qy[i], qy); fvStore(&s.qz[i], qz);
+}
+
+// fish begin .. end - 1, where begin is a multiple of FISH_LANES
+void stepFishSoA(FishState& s, float time, int begin, int end) {
+    CPU_SCOPE("stepFishSoA");
+    FishVec t = fvSet(time);
+    for (int i = begin; i < end; i += FISH_LANES) {
+        // a held fish turns by 0 and moves by 0 anyway, so whole groups of them can be skipped
+        if (std::all_of(&s.step[i], &s.step[i] + FISH_LANES, [](float step) { return step == 0.0f; }))
+            continue;
+        stepFishLanes(s, i, t);
+    }
+}
+
+void stepFishSoA(FishState& s, float time) {
+    stepFishSoA(s, time, 0, s.count);
+}
+
+/*
+ * Simulation level of detail (--sim-budget US). Whenever a fish is due for a step it is put
+ * on a tier by its distance to the camera and whether it is in view:
+ * - near fish step every tick with everything
+ * - mid fish step every FISH_LOD_MID_STRIDE ticks, covering the ticks in one go, and are
+ *   shown blended from where they were towards where the step took them
+ * - far fish, and the ones out of view, do the same every FISH_LOD_FAR_STRIDE ticks and
+ *   only follow the flow: no neighbor or obstacle checks
+ * The distances scale with fishLodNear, which updateFishLodDistance() moves to keep the
+ * simulation's CPU time per frame under the budget (--bench keeps it fixed). The strided fish are spread over the
+ * ticks by their index, so every tick steps about the same number of them
+ */
+#define FISH_LOD_MID_STRIDE 2
+#define FISH_LOD_FAR_STRIDE 4
+#define FISH_LOD_MID_SCALE 2.0f // mid fish are within this times fishLodNear
+#define FISH_LOD_MIN_NEAR 2.0f
+#define FISH_LOD_MAX_NEAR 70.0f // past the corners of the tank
+
+float fishSimBudgetUs = 0.0f; // --sim-budget, 0 to step every fish fully every tick
+float fishLodNear = 12.0f;
+float smoothedFishSimUs = 0.0f;
+int fishFramesOverBudget = 0, fishFramesUnderBudget = 0;
+
+// what the simulation thread knows of the camera, for the tiers
+struct FishLodView {
+    glm::vec3 eye = glm::vec3(0.0f);
+    glm::mat4 worldToClip = glm::mat4(1.0f);
+};
+
+// the step each fish is on; a fish is shown at from until since, and reaches the state at
+// since + stride
+struct FishStrides {
+    std::vector<int> stride;
+    std::vector<long long> since;
+    std::vector<FishPose> from;
+};
+FishStrides fishStrides;
+
+void resetFishStrides() {
+    fishStrides.stride.assign(fishState.count, 1);
+    fishStrides.since.assign(fishState.count, 0);
+    fishStrides.from.resize(fishState.count);
+    for (int i = 0; i < fishState.count; i++)
+        fishStrides.from[i] = fishPose(fishState, i);
+}
+
+// the pose the render thread gets for fish i at tick
+FishPose shownFishPose(int i, long long tick) {
+    FishPose to = fishPose(fishState, i);
+    int stride = fishStrides.stride[i];
+    if (stride == 1)
+        return to;
+    const FishPose& from = fishStrides.from[i];
+    float t = glm::clamp((float)(tick - fishStrides.since[i]) / stride, 0.0f, 1.0f);
+    return { glm::mix(from.position, to.position, t), glm::slerp(from.orientation, to.orientation, t) };
+}
+
+// puts the fish that are due for a step at tick on their tier and holds the others
+void assignFishLod(long long tick, const FishLodView& view) {
+    CPU_SCOPE("assignFishLod");
+    FishState& s = fishState;
+    // (1 - TURN_RATE)^n of the heading is kept over n steps
+    float turns[FISH_LOD_FAR_STRIDE + 1];
+    for (int n = 0; n <= FISH_LOD_FAR_STRIDE; n++)
+        turns[n] = n == 1 ? TURN_RATE : 1.0f - powf(1.0f - TURN_RATE, (float)n);
+    float nearSquared = fishLodNear * fishLodNear;
+    float midSquared = nearSquared * FISH_LOD_MID_SCALE * FISH_LOD_MID_SCALE;
+
+    parallelFor(0, s.count, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            // also due when the clock went back, as in a restarted replay
+            long long since = fishStrides.since[i];
+            if (tick - since < fishStrides.stride[i] && tick >= since) {
+                s.step[i] = 0.0f;
+                s.turn[i] = 0.0f;
+                continue;
+            }
+
+            glm::vec3 position(s.x[i], s.y[i], s.z[i]);
+            glm::vec4 clip = view.worldToClip * glm::vec4(position, 1.0f);
+            float slack = clip.w * 0.1f + 1.0f; // so fish do not drop a tier right at the edge
+            bool inView = clip.w > 0.0f && fabsf(clip.x) <= clip.w + slack && fabsf(clip.y) <= clip.w + slack;
+            float distanceSquared = glm::dot(position - view.eye, position - view.eye);
+            FishLod lod = !inView || distanceSquared > midSquared ? FISH_LOD_FAR : distanceSquared > nearSquared ? FISH_LOD_MID : FISH_LOD_NEAR;
+
+            // the first strided step is shortened to land the fish on its slot, (tick + i) % stride == 0
+            int stride = lod == FISH_LOD_FAR ? FISH_LOD_FAR_STRIDE : lod == FISH_LOD_MID ? FISH_LOD_MID_STRIDE : 1;
+            stride -= (int)((tick + i) % stride);
+            fishStrides.stride[i] = stride;
+            fishStrides.since[i] = tick;
+            fishStrides.from[i] = fishPose(s, i);
+            s.step[i] = (float)stride;
+            s.turn[i] = turns[stride];
+            s.lod[i] = (unsigned char)lod;
+        }
+    });
+}
+
+// as updateRenderScale() does for the GPU: pulls the tiers in quickly while the simulation
+// takes longer than the budget, and pushes them out again after a sustained stretch under it
+void updateFishLodDistance(float simulationUs) {
+    smoothedFishSimUs = smoothedFishSimUs > 0.0f ? glm::mix(smoothedFishSimUs, simulationUs, 0.1f) : simulationUs;
+    fishFramesOverBudget = smoothedFishSimUs > fishSimBudgetUs ? fishFramesOverBudget + 1 : 0;
+    fishFramesUnderBudget = smoothedFishSimUs < fishSimBudgetUs * 0.75f ? fishFramesUnderBudget + 1 : 0;
+
+    float nearDistance = fishLodNear;
+    if (fishFramesOverBudget >= 10)
+        nearDistance = std::max(FISH_LOD_MIN_NEAR, fishLodNear * 0.8f);
+    else if (fishFramesUnderBudget >= 120)
+        nearDistance = std::min(FISH_LOD_MAX_NEAR, fishLodNear * 1.25f);
+
+    if (nearDistance != fishLodNear) {
+        fishLodNear = nearDistance;
+        std::cout << "Fish LOD: full steering within " << fishLodNear << " m (simulation " << (int)smoothedFishSimUs << " us per frame)\n";
+    }
+    if (fishFramesOverBudget >= 10 || fishFramesUnderBudget >= 120) {
+        fishFramesOverBudget = 0;
+        fishFramesUnderBudget = 0;
+    }
+}
+
+// every fish steers from the positions at the start of the step, then they all move; each
+// phase only reads what the one before wrote and each fish only writes its own slots, so the
+// workers need no locks
+void computeNextFishStates(float time) {
+    CPU_SCOPE("computeNextFishStates");
+    FishState& s = fishState;
+    buildFishGrid(fishGrid, s);
+    if (useFlowVolume)
+        prepareFlowVolume(llround(time / FISH_TICK));
+    parallelFor(0, s.count, 256, [&](int begin, int end) {
+        CPU_SCOPE("avoidNeighbors");
+        for (int i = begin; i < end; i++) {
+            if (s.step[i] == 0.0f)
+                continue;
+            // far fish only follow the flow (and stay inside the tank)
+            bool flowOnly = s.lod[i] == FISH_LOD_FAR;
+            glm::vec3 avoid = flowOnly ? glm::vec3(0.0f) : avoidNeighborsGrid(fishGrid, s, i);
+            s.ax[i] = avoid.x; s.ay[i] = avoid.y; s.az[i] = avoid.z;
+            if (useFlowVolume) {
+                glm::vec3 flow = sampleFlowVolume(glm::vec3(s.x[i], s.y[i], s.z[i]));
+                s.fx[i] = flow.x; s.fy[i] = flow.y; s.fz[i] = flow.z;
+            }
+            if (sceneSdf.ready) {
+                glm::vec3 obstacle = flowOnly ? glm::vec3(0.0f) : avoidScene(glm::vec3(s.x[i], s.y[i], s.z[i]));
+                s.ox[i] = obstacle.x; s.oy[i] = obstacle.y; s.oz[i] = obstacle.z;
+            }
+        }
+    });
+    // in whole groups of lanes, so no two chunks share one
+    int groups = (s.count + FISH_LANES - 1) / FISH_LANES;
+    parallelFor(0, groups, 1024 / FISH_LANES, [&](int begin, int end) {
+        stepFishSoA(s, time, begin * FISH_LANES, std::min(s.count, end * FISH_LANES));
+    });
+}
+
+// the simulation runs on its own thread in whole FISH_TICK steps, chasing the tick the render
+// thread asks for; it stays one step ahead of the clock so the blend lands exactly on it.
+// Every step is published as a snapshot of the last two poses through a lock-free triple
+// buffer: the simulation fills its back slot and swaps it with the published one, the render
+// thread swaps its front slot for the published one when a newer snapshot is waiting
+struct FishSnapshot {
+    long long tick = 0; // the step the current poses are at
+    std::vector<FishPose> previous, current;
+};
+
+#define FISH_SNAPSHOT_NEW 4 // set in fishSimulation.published while the reader has not taken it
+
+struct FishSimulation {
+    FishSnapshot snapshots[3];
+    std::atomic<int> published { 1 };
+    int back = 0, front = 2;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake, stepped;
+    long long targetTick = 0;
+    long long ticks = 0; // steps simulated and published so far
+    FishLodView view;    // as of the frame that asked for targetTick
+    bool quit = false;
+
+    ~FishSimulation() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        if (thread.joinable())
+            thread.join();
+    }
+};
+FishSimulation fishSimulation;
+
+void publishFishSnapshot(long long tick, const std::vector<FishPose>& previous) {
+    FishSnapshot& snapshot = fishSimulation.snapshots[fishSimulation.back];
+    snapshot.tick = tick;
+    snapshot.previous = previous;
+    parallelFor(0, numFish, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            snapshot.current[i] = shownFishPose(i, tick);
+    });
+    fishSimulation.back = fishSimulation.published.exchange(fishSimulation.back | FISH_SNAPSHOT_NEW) & ~FISH_SNAPSHOT_NEW;
+
+    // counted only once published, so a render thread waiting for the tick finds its snapshot
+    {
+        std::lock_guard<std::mutex> lock(fishSimulation.mutex);
+        fishSimulation.ticks = tick;
+    }
+    fishSimulation.stepped.notify_all();
+}
+
+void fishSimulationLoop() {
+    std::vector<FishPose> previous(numFish);
+    for (;;) {
+        long long target, tick;
+        FishLodView view;
+        {
+            std::unique_lock<std::mutex> lock(fishSimulation.mutex);
+            fishSimulation.wake.wait(lock, [] { return fishSimulation.quit || fishSimulation.targetTick != fishSimulation.ticks; });
+            if (fishSimulation.quit)
+                return;
+            target = fishSimulation.targetTick;
+            if (target < fishSimulation.ticks || target - fishSimulation.ticks > MAX_FISH_TICKS_PER_FRAME)
+                fishSimulation.ticks = target - 1; // the clock restarted (replay) or jumped
+            tick = fishSimulation.ticks;
+            view = fishSimulation.view;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (tick < target) {
+            CPU_SCOPE("fish step");
+            parallelFor(0, numFish, 4096, [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                    previous[i] = shownFishPose(i, tick);
+            });
+            if (fishSimBudgetUs > 0.0f)
+                assignFishLod(tick, view);
+            computeNextFishStates(tick * FISH_TICK);
+            publishFishSnapshot(++tick, previous);
+        }
+        // the benchmark keeps the starting distance, so its captures don't depend on timing
+        if (fishSimBudgetUs > 0.0f && !benchMode)
+            updateFishLodDistance(std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+void startFishSimulation() {
+    resetFishStrides();
+    std::vector<FishPose> initial(numFish);
+    for (int i = 0; i < numFish; i++)
+        initial[i] = fishPose(fishState, i);
+    for (FishSnapshot& snapshot : fishSimulation.snapshots)
+        snapshot = { 0, initial, initial };
+    fishSimulation.thread = std::thread(fishSimulationLoop);
+}
+
+// asks for the steps up to the scene clock and takes the newest snapshot for the frame; it
+// only waits for the simulation in the benchmark, which has to show the same frames each run
+void updateFish() {
+    CPU_SCOPE("updateFish");
+    float steps = sceneTime() / FISH_TICK;
+    long long target = (long long)floor(steps + 1e-4f) + 1;
+    FishLodView view;
+    view.eye = active_camera->position;
+    view.worldToClip = glm::perspective(glm::radians(active_camera->fov), (float)windowWidth / windowHeight, 0.1f, 100.0f)
+                     * glm::lookAt(active_camera->position, active_camera->position + active_camera->front, active_camera->up);
+    {
+        std::unique_lock<std::mutex> lock(fishSimulation.mutex);
+        fishSimulation.targetTick = target;
+        fishSimulation.view = view;
+        fishSimulation.wake.notify_one();
+        if (benchMode)
+            fishSimulation.stepped.wait(lock, [&] { return fishSimulation.ticks == target; });
+    }
+
+    if (fishSimulation.published.load() & FISH_SNAPSHOT_NEW)
+        fishSimulation.front = fishSimulation.published.exchange(fishSimulation.front) & ~FISH_SNAPSHOT_NEW;
+    const FishSnapshot& snapshot = fishSimulation.snapshots[fishSimulation.front];
+
+    fishRenderAlpha = glm::clamp(steps - (snapshot.tick - 1), 0.0f, 1.0f);
+    for (int i = 0; i < (int)fishRenderPositions.size(); i++)
+        fishRenderPositions[i] = glm::mix(snapshot.previous[i].position, snapshot.current[i].position, fishRenderAlpha);
+}
+
+// blends the snapshot updateFish() took into the instances the fish draw reads; instances
+// points into mapped buffer memory, so it is only ever written, front to back
+void writeFishInstances(FishInstance* instances) {
+    CPU_SCOPE("writeFishInstances");
+    const FishSnapshot& snapshot = fishSimulation.snapshots[fishSimulation.front];
+    parallelFor(0, numFish, 1024, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const FishPose& previous = snapshot.previous[i];
+            const FishPose& current = snapshot.current[i];
+            glm::quat orientation = glm::slerp(previous.orientation, current.orientation, fishRenderAlpha);
+            FishInstance instance;
+            instance.position = glm::mix(previous.position, current.position, fishRenderAlpha);
+            instance.scale = 1.0f;
+            for (int c = 0; c < 4; c++)
+                instance.orientation[c] = (short)lroundf(glm::clamp(orientation[c], -1.0f, 1.0f) * 32767.0f);
+            instances[i] = instance;
+        }
+    });
+}
+
+/*------------------------------------------*/
+
+/*------------------GPU FISH--------------------*/
+
+// --gpu-fish: the whole school lives on the GPU instead. Every step is one transform feedback
+// pass of Finals-Fish-Step.vs from one state buffer into the other, so the buffer not written
+// last always holds the step before, which the draw blends from as writeFishInstances() does. Before
+// each step the neighbor grid is rebuilt on the GPU: Finals-Fish-Sort.fs makes a (bucket,
+// fish) key per fish in an integer texture and sorts them by bitonic merge, one pass per
+// stage, then Finals-Fish-Cells.vs writes where each bucket starts into a cell table. Only
+// the fish carrying lights come back to the CPU, a few frames late, through small copies
+bool gpuFishMode = false; // --gpu-fish
+#define GPU_FISH_STATE_STRIDE (3 * sizeof(glm::vec4)) // position and speed, velocity, orientation
+#define GPU_FISH_TABLE_WIDTH 1024 // widest row of the key and cell textures
+#define GPU_FISH_READBACK_FRAMES 3
+#define GPU_FISH_STATE_UNIT 13    // texture units the renderer leaves alone
+#define GPU_FISH_KEYS_UNIT 14
+#define GPU_FISH_CELLS_UNIT 15
+
+struct GpuFish {
+    GLuint stepShader = 0, sortShader = 0, cellShader = 0;
+    GLuint stateBuffers[2] = {}, stateTextures[2] = {}; // the textures are views of the buffers
+    GLuint stepVaos[2] = {}; // reading state i
+    GLuint drawVaos[2] = {}; // the mesh, with state 1 - i as the previous step and i as the current
+    GLuint emptyVao = 0;
+    GLuint keyTextures[2] = {}, keyFramebuffers[2] = {};
+    GLuint cellTexture = 0, cellFramebuffer = 0;
+    glm::ivec2 keySize, cellSize;
+    GLuint bucketMask = 0;
+    GLuint readback[GPU_FISH_READBACK_FRAMES] = {};
+    int current = 0; // the state written last
+    int sorted = 0;  // the key texture the last sort ended in
+    long long tick = 0;
+    float alpha = 1.0f;
+    int frame = 0;
+};
+GpuFish gpuFish;
+
+// gdevLoadShader() for a vertex shader whose outputs are captured with transform feedback
+GLuint loadFeedbackShader(const char* vertexShaderFile, const char* const* varyings, int varyingCount) {
+    CPU_SCOPE("loadFeedbackShader", vertexShaderFile);
+    std::string source = gdevLoadFile(vertexShaderFile);
+    if (source.empty())
+        return 0;
+    const char* text = source.c_str();
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &text, NULL);
+    glCompileShader(vertexShader);
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glTransformFeedbackVaryings(program, varyingCount, varyings, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+    glDeleteShader(vertexShader);
+
+    int success, length;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        std::string err(length, ' ');
+        glGetProgramInfoLog(program, length, NULL, err.data());
+        std::cout << "Feedback shader file '" << vertexShaderFile << "' link error:\n" << err;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// a texture of width * height texels, at most GPU_FISH_TABLE_WIDTH wide, for count entries
+glm::ivec2 gpuFishTableSize(int count) {
+    int width = std::min(count, GPU_FISH_TABLE_WIDTH);
+    return glm::ivec2(width, count / width);
+}
+
+bool makeGpuFishTable(GLuint& texture, GLuint& framebuffer, glm::ivec2 size, GLenum internalFormat, GLenum format) {
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size.x, size.y, 0, format, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+// the simulation side for numFish fish, starting from fishState
+bool setupGpuFish() {
+    const char* varyings[] = { "nextPositionSpeed", "nextVelocity", "nextOrientation" };
+    gpuFish.stepShader = loadFeedbackShader("Finals-Fish-Step.vs", varyings, 3);
+    gpuFish.sortShader = loadShader("Finals-Fish-Grid.vs", "Finals-Fish-Sort.fs");
+    gpuFish.cellShader = loadShader("Finals-Fish-Cells.vs", "Finals-Fish-Cells.fs");
+    if (!gpuFish.stepShader || !gpuFish.sortShader || !gpuFish.cellShader)
+        return false;
+
+    std::vector<glm::vec4> state(3 * numFish);
+    for (int i = 0; i < numFish; i++) {
+        state[3 * i] = glm::vec4(fishState.x[i], fishState.y[i], fishState.z[i], fishState.speed[i]);
+        state[3 * i + 1] = glm::vec4(fishState.vx[i], fishState.vy[i], fishState.vz[i], 0.0f);
+        state[3 * i + 2] = glm::vec4(fishState.qx[i], fishState.qy[i], fishState.qz[i], fishState.qw[i]);
+    }
+
+    // both start out as the first step, so the first blend has nothing to blend
+    glGenBuffers(2, gpuFish.stateBuffers);
+    glGenTextures(2, gpuFish.stateTextures);
+    glGenVertexArrays(2, gpuFish.stepVaos);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_ARRAY_BUFFER, gpuFish.stateBuffers[i]);
+        glBufferData(GL_ARRAY_BUFFER, state.size() * sizeof(glm::vec4), state.data(), GL_DYNAMIC_COPY);
+        glBindTexture(GL_TEXTURE_BUFFER, gpuFish.stateTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gpuFish.stateBuffers[i]);
+
+        glBindVertexArray(gpuFish.stepVaos[i]);
+        for (int attribute = 0; attribute < 3; attribute++) {
+            glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE, GPU_FISH_STATE_STRIDE, (void*)(attribute * sizeof(glm::vec4)));
+            glEnableVertexAttribArray(attribute);
+        }
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glGenVertexArrays(1, &gpuFish.emptyVao);
+    glBindVertexArray(0);
+
+    // the keys pad the fish to a power of two for the sort; the cell table has as many
+    // buckets as the CPU grid
+    int keys = 2, buckets = 1;
+    while (keys < numFish)
+        keys *= 2;
+    while (buckets < 2 * numFish)
+        buckets *= 2;
+    gpuFish.keySize = gpuFishTableSize(keys);
+    gpuFish.cellSize = gpuFishTableSize(buckets);
+    gpuFish.bucketMask = buckets - 1;
+    bool complete = makeGpuFishTable(gpuFish.keyTextures[0], gpuFish.keyFramebuffers[0], gpuFish.keySize, GL_RG32UI, GL_RG_INTEGER)
+                 && makeGpuFishTable(gpuFish.keyTextures[1], gpuFish.keyFramebuffers[1], gpuFish.keySize, GL_RG32UI, GL_RG_INTEGER)
+                 && makeGpuFishTable(gpuFish.cellTexture, gpuFish.cellFramebuffer, gpuFish.cellSize, GL_R32I, GL_RED_INTEGER);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!complete) {
+        std::cout << "The GPU fish grid textures cannot be rendered to\n";
+        return false;
+    }
+
+    glGenBuffers(GPU_FISH_READBACK_FRAMES, gpuFish.readback);
+    for (GLuint buffer : gpuFish.readback) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, MAX_FISH_LIGHTS * GPU_FISH_STATE_STRIDE, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    gpuFish.current = 0;
+    gpuFish.tick = 0;
+    gpuFish.frame = 0;
+    return true;
+}
+
+// the draw side: the fish mesh of instancedVbo with each fish's last two steps
+void setupGpuFishDrawing() {
+    glGenVertexArrays(2, gpuFish.drawVaos);
+    for (int i = 0; i < 2; i++) {
+        glBindVertexArray(gpuFish.drawVaos[i]);
+        glBindBuffer(GL_ARRAY_BUFFER, instancedVbo);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(3 * sizeof(float)));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(5 * sizeof(float)));
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(8 * sizeof(float)));
+        for (int attribute = 0; attribute < 4; attribute++)
+            glEnableVertexAttribArray(attribute);
+
+        // 10, 11: previous position and orientation; 12, 13: current ones
+        for (int step = 0; step < 2; step++) {
+            glBindBuffer(GL_ARRAY_BUFFER, gpuFish.stateBuffers[step == 0 ? 1 - i : i]);
+            glVertexAttribPointer(10 + 2 * step, 4, GL_FLOAT, GL_FALSE, GPU_FISH_STATE_STRIDE, (void*)0);
+            glVertexAttribPointer(11 + 2 * step, 4, GL_FLOAT, GL_FALSE, GPU_FISH_STATE_STRIDE, (void*)(2 * sizeof(glm::vec4)));
+        }
+        for (int attribute = 10; attribute < 14; attribute++) {
+            glEnableVertexAttribArray(attribute);
+            glVertexAttribDivisor(attribute, 1);
+        }
+    }
+    glBindVertexArray(0);
+}
+
+void releaseGpuFish() {
+    glDeleteProgram(gpuFish.stepShader);
+    glDeleteProgram(gpuFish.sortShader);
+    glDeleteProgram(gpuFish.cellShader);
+    glDeleteBuffers(2, gpuFish.stateBuffers);
+    glDeleteTextures(2, gpuFish.stateTextures);
+    glDeleteVertexArrays(2, gpuFish.stepVaos);
+    glDeleteVertexArrays(2, gpuFish.drawVaos);
+    glDeleteVertexArrays(1, &gpuFish.emptyVao);
+    glDeleteTextures(2, gpuFish.keyTextures);
+    glDeleteFramebuffers(2, gpuFish.keyFramebuffers);
+    glDeleteTextures(1, &gpuFish.cellTexture);
+    glDeleteFramebuffers(1, &gpuFish.cellFramebuffer);
+    glDeleteBuffers(GPU_FISH_READBACK_FRAMES, gpuFish.readback);
+    gpuFish = GpuFish();
+}
+
+// the grid of the state written last, then one step out of it into the other state buffer
+void stepGpuFish(float time) {
+    CPU_SCOPE("stepGpuFish");
+    int source = gpuFish.current;
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST), blend = glIsEnabled(GL_BLEND), cullFace = glIsEnabled(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_CULL_FACE);
+    glBindVertexArray(gpuFish.emptyVao);
+    glActiveTexture(GL_TEXTURE0 + GPU_FISH_STATE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, gpuFish.stateTextures[source]);
+
+    // the keys, then every stage of the bitonic sort ping-ponging between the key textures
+    GLuint shader = gpuFish.sortShader;
+    glUseProgram(shader);
+    glUniform1i(glGetUniformLocation(shader, "fishState"), GPU_FISH_STATE_UNIT);
+    glUniform1i(glGetUniformLocation(shader, "keys"), GPU_FISH_KEYS_UNIT);
+    glUniform1i(glGetUniformLocation(shader, "fishCount"), numFish);
+    glUniform1ui(glGetUniformLocation(shader, "bucketMask"), gpuFish.bucketMask);
+    glViewport(0, 0, gpuFish.keySize.x, gpuFish.keySize.y);
+    glActiveTexture(GL_TEXTURE0 + GPU_FISH_KEYS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gpuFish.keyTextures[1]);
+    glBindFramebuffer(GL_FRAMEBUFFER, gpuFish.keyFramebuffers[0]);
+    glUniform1i(glGetUniformLocation(shader, "makeKeys"), 1);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glUniform1i(glGetUniformLocation(shader, "makeKeys"), 0);
+
+    int keys = gpuFish.keySize.x * gpuFish.keySize.y;
+    int read = 0;
+    for (int blockSize = 2; blockSize <= keys; blockSize *= 2)
+        for (int stride = blockSize / 2; stride > 0; stride /= 2) {
+            glBindTexture(GL_TEXTURE_2D, gpuFish.keyTextures[read]);
+            glBindFramebuffer(GL_FRAMEBUFFER, gpuFish.keyFramebuffers[1 - read]);
+            glUniform1i(glGetUniformLocation(shader, "blockSize"), blockSize);
+            glUniform1i(glGetUniformLocation(shader, "stride"), stride);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            read = 1 - read;
+        }
+    gpuFish.sorted = read;
+    glBindTexture(GL_TEXTURE_2D, gpuFish.keyTextures[read]);
+
+    // where each bucket starts, -1 for the empty ones
+    shader = gpuFish.cellShader;
+    glUseProgram(shader);
+    glUniform1i(glGetUniformLocation(shader, "sortedKeys"), GPU_FISH_KEYS_UNIT);
+    glUniform2i(glGetUniformLocation(shader, "cellTableSize"), gpuFish.cellSize.x, gpuFish.cellSize.y);
+    glBindFramebuffer(GL_FRAMEBUFFER, gpuFish.cellFramebuffer);
+    glViewport(0, 0, gpuFish.cellSize.x, gpuFish.cellSize.y);
+    const GLint empty[4] = { -1, -1, -1, -1 };
+    glClearBufferiv(GL_COLOR, 0, empty);
+    glDrawArrays(GL_POINTS, 0, numFish);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // the step itself, with nothing rasterized
+    shader = gpuFish.stepShader;
+    glUseProgram(shader);
+    glUniform1i(glGetUniformLocation(shader, "fishState"), GPU_FISH_STATE_UNIT);
+    glUniform1i(glGetUniformLocation(shader, "sortedKeys"), GPU_FISH_KEYS_UNIT);
+    glUniform1i(glGetUniformLocation(shader, "cellStart"), GPU_FISH_CELLS_UNIT);
+    glUniform1i(glGetUniformLocation(shader, "fishCount"), numFish);
+    glUniform1ui(glGetUniformLocation(shader, "bucketMask"), gpuFish.bucketMask);
+    glUniform1f(glGetUniformLocation(shader, "time"), time);
+    for (int i = 0; i < 2; i++) {
+        glUniform3fv(glGetUniformLocation(shader, ("boxMin[" + std::to_string(i) + "]").c_str()), 1, glm::value_ptr(aabbs[i].min));
+        glUniform3fv(glGetUniformLocation(shader, ("boxMax[" + std::to_string(i) + "]").c_str()), 1, glm::value_ptr(aabbs[i].max));
+    }
+    glActiveTexture(GL_TEXTURE0 + GPU_FISH_CELLS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gpuFish.cellTexture);
+    glActiveTexture(GL_TEXTURE0);
+
+    int target = 1 - source;
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(gpuFish.stepVaos[source]);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, gpuFish.stateBuffers[target]);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, numFish);
+    glEndTransformFeedback();
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(0);
+    gpuFish.current = target;
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (blend) glEnable(GL_BLEND);
+    if (cullFace) glEnable(GL_CULL_FACE);
+}
+
+// updateFish() for --gpu-fish: the same clock, stepped on this thread since it only queues
+// GPU work; the lights read the copy made GPU_FISH_READBACK_FRAMES frames ago, which is long
+// done, and the slot then takes this frame's
+void updateGpuFish() {
+    CPU_SCOPE("updateGpuFish");
+    float steps = sceneTime() / FISH_TICK;
+    long long target = (long long)floor(steps + 1e-4f) + 1;
+    if (target < gpuFish.tick || target - gpuFish.tick > MAX_FISH_TICKS_PER_FRAME)
+        gpuFish.tick = target - 1; // the clock restarted (replay) or jumped
+    for (; gpuFish.tick < target; gpuFish.tick++)
+        stepGpuFish(gpuFish.tick * FISH_TICK);
+    gpuFish.alpha = glm::clamp(steps - (gpuFish.tick - 1), 0.0f, 1.0f);
+
+    int lightCount = std::min(numFish, MAX_FISH_LIGHTS);
+    glBindBuffer(GL_COPY_READ_BUFFER, gpuFish.readback[gpuFish.frame % GPU_FISH_READBACK_FRAMES]);
+    if (gpuFish.frame >= GPU_FISH_READBACK_FRAMES) {
+        glm::vec4 copy[3 * MAX_FISH_LIGHTS];
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, lightCount * GPU_FISH_STATE_STRIDE, copy);
+        for (int i = 0; i < lightCount; i++)
+            fishRenderPositions[i] = glm::vec3(copy[3 * i]);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, gpuFish.readback[gpuFish.frame % GPU_FISH_READBACK_FRAMES]);
+    glBindBuffer(GL_COPY_READ_BUFFER, gpuFish.stateBuffers[gpuFish.current]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, lightCount * GPU_FISH_STATE_STRIDE);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    gpuFish.frame++;
+}
+
+/*---------------------------------------------------*/
+
+/*------------------CULLING--------------------*/
+
+// world space bounds of each entry of vertex_data (the meshes are baked in world space)
+AABB meshBounds[20];
+
+struct Frustum {
+    glm::vec4 planes[6]; // xyz = normal pointing inside, w = offset
+};
+
+// extracts the clip planes of a view-projection matrix (Gribb-Hartmann);
+// a point p is inside when dot(plane, vec4(p, 1)) >= 0 for every plane
+Frustum frustumFromMatrix(const glm::mat4& m) {
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    Frustum f;
+    f.planes[0] = row3 + row0; // left
+    f.planes[1] = row3 - row0; // right
+    f.planes[2] = row3 + row1; // bottom
+    f.planes[3] = row3 - row1; // top
+    f.planes[4] = row3 + row2; // near
+    f.planes[5] = row3 - row2; // far
+    return f;
+}
+
+// conservative test: only rejects boxes that lie fully outside one plane
+bool aabbInFrustum(const Frustum& f, const AABB& box) {
+    for (const glm::vec4& plane : f.planes) {
+        // the box corner furthest along the plane normal
+        glm::vec3 p(plane.x >= 0.0f ? box.max.x : box.min.x,
+                    plane.y >= 0.0f ? box.max.y : box.min.y,
+                    plane.z >= 0.0f ? box.max.z : box.min.z);
+        if (glm::dot(glm::vec3(plane), p) + plane.w < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+void computeMeshBounds(int mesh) {
+    const std::vector<float>& data = vertex_data[mesh];
+    AABB box = { glm::vec3(0.0f), glm::vec3(0.0f) };
+    if (!data.empty()) {
+        box.min = box.max = glm::vec3(data[0], data[1], data[2]);
+        for (size_t i = 0; i + 2 < data.size(); i += 11) {
+            glm::vec3 p(data[i], data[i + 1], data[i + 2]);
+            box.min = glm::min(box.min, p);
+            box.max = glm::max(box.max, p);
+        }
+    }
+    meshBounds[mesh] = box;
+}
+
+// opaque static meshes drawn by drawScene(), in draw order;
+// texture slots index into texture[] (-1 = no map)
+struct SceneDrawable {
+    int mesh;
+    int diffuse;
+    int normal = -1;
+    int specular = -1;
+    bool parallax = false;
+    bool emissive = false;
+    glm::vec3 emissiveColor = glm::vec3(0.0f);
+};
+
+std::vector<SceneDrawable> sceneDrawables = {
+    { 0, 0, 1 },                                  // floor mesh
+    { 1, 2, 3, -1, true },                        // bricks with parallax
+    { 3, 5 },                                     // lower building
+    { 5, 5 },                                     // higher building
+    { 8, 9 },                                     // tree bark
+    { 11, 11 },                                   // side station
+    { 12, 12, 13 },                               // office
+    { 13, 14, 15 },                               // bus station
+    { 14, 16, 17 },                               // miscellaneous
+    { 15, 18 },                                   // water
+    { 16, 19, 20, 21 },                           // station
+    { 17, 22, 23, 24 },                           // train carts
+    { 18, 25 },                                   // lamp posts
+    { 19, 26, -1, -1, false, true, glm::vec3(3.0f, 2.5f, 1.5f) }, // lamp bulbs (for bloom)
+};
+
+/*---------------------------------------------*/
+
+/*------------------SCENE GRAPH--------------------*/
+
+// the meshes are exported in world space, so a node's local TRS moves its mesh away from where
+// it was baked: identity everywhere draws the scene as before. The root holds a node per mesh,
+// except the train cart, which hangs under a train node for animateTrain() to move.
+// Nodes are stored parents first, in arrays per field. setNodeTransform() only flags the node;
+// updateSceneGraph() then recomputes the world matrices of the flagged nodes and everything
+// under them in one pass in order, refits their bounds and their ancestors' in one pass in
+// reverse, and hands where each moved mesh was and now is to invalidateSceneCaches()
+#define PROBE_MIN_TEXELS 2.0f   // moves that cover less of a probe face than this are not recaptured
+#define PROBE_REFRESH_FRAMES 8  // frames between two probe recaptures
+#define TRAIN_TRAVEL 8.0f       // metres either way along the platform
+#define TRAIN_PERIOD 20.0f      // seconds for a trip there and back
+
+struct SceneGraph {
+    std::vector<int> parent, firstChild, nextSibling;
+    std::vector<int> mesh;              // entry of vertex_data, -1 for a group
+    std::vector<glm::vec3> translation, scale;
+    std::vector<glm::quat> rotation;
+    std::vector<glm::mat4> world;
+    std::vector<AABB> bounds;           // world space, of the node's mesh and everything under it
+    std::vector<unsigned char> dirty;   // the local TRS changed since world was computed
+    std::vector<unsigned char> moved;   // world is not identity, so the draws set modelTransform
+    std::vector<unsigned char> changed, refit; // scratch for updateSceneGraph()
+    bool anyDirty = false;
+};
+SceneGraph sceneGraph;
+int meshNodes[20];      // node of each entry of vertex_data, -1 for none
+AABB meshLocalBounds[20]; // meshBounds as exported, before any node moved them
+int trainNode = -1;
+bool trainRunning = false; // --train, J
+int probeRefreshCooldown = 0;
+int probeRefreshLast = 1; // the probe recaptured last
+
+const AABB EMPTY_AABB = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+
+int addSceneNode(int parent, int mesh) {
+    SceneGraph& g = sceneGraph;
+    int node = (int)g.parent.size();
+    g.parent.push_back(parent);
+    g.firstChild.push_back(-1);
+    g.nextSibling.push_back(parent >= 0 ? g.firstChild[parent] : -1);
+    if (parent >= 0)
+        g.firstChild[parent] = node;
+    g.mesh.push_back(mesh);
+    g.translation.push_back(glm::vec3(0.0f));
+    g.scale.push_back(glm::vec3(1.0f));
+    g.rotation.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+    g.world.push_back(glm::mat4(1.0f));
+    g.bounds.push_back(EMPTY_AABB);
+    g.dirty.push_back(1);
+    g.moved.push_back(0);
+    g.changed.push_back(0);
+    g.refit.push_back(0);
+    g.anyDirty = true;
+    if (mesh >= 0) {
+        meshNodes[mesh] = node;
+        meshLocalBounds[mesh] = meshBounds[mesh];
+    }
+    return node;
+}
+
+void setNodeTransform(int node, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale) {
+    SceneGraph& g = sceneGraph;
+    g.translation[node] = translation;
+    g.rotation[node] = rotation;
+    g.scale[node] = scale;
+    g.dirty[node] = 1;
+    g.anyDirty = true;
+}
+
+// the box around the transformed box (Arvo)
+AABB transformAABB(const AABB& box, const glm::mat4& m) {
+    glm::vec3 center = glm::vec3(m * glm::vec4((box.min + box.max) * 0.5f, 1.0f));
+    glm::vec3 half = (box.max - box.min) * 0.5f;
+    glm::vec3 extent = glm::abs(glm::vec3(m[0])) * half.x + glm::abs(glm::vec3(m[1])) * half.y + glm::abs(glm::vec3(m[2])) * half.z;
+    return { center - extent, center + extent };
+}
+
+// drops the shadow maps whose light sees box, and flags the probes it covers enough of
+void invalidateSceneCaches(const AABB& box) {
+    for (std::vector<ShadowCache>* caches : { &directionalShadowCaches, &spotShadowCaches })
+        for (ShadowCache& cache : *caches)
+            if (cache.valid && aabbInFrustum(frustumFromMatrix(cache.lightTransform), box))
+                cache.valid = false;
+
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    float radius = glm::length(box.max - box.min) * 0.5f;
+    for (int c = 0; c < 2; c++) {
+        float distance = glm::length(center - cubemapCapturePos[c]);
+        float angle = distance > radius ? 2.0f * asinf(radius / distance) : PI;
+        if (angle / (0.5f * PI) * CUBEMAP_SIZE >= PROBE_MIN_TEXELS)
+            cubemapStale[c] = true;
+    }
+}
+
+void updateSceneGraph() {
+    SceneGraph& g = sceneGraph;
+    if (!g.anyDirty)
+        return;
+    CPU_SCOPE("updateSceneGraph");
+    g.anyDirty = false;
+
+    int count = (int)g.parent.size();
+    std::vector<AABB> movedBoxes;
+    for (int i = 0; i < count; i++) {
+        int parent = g.parent[i];
+        g.changed[i] = g.dirty[i] || (parent >= 0 && g.changed[parent]);
+        if (!g.changed[i])
+            continue;
+        g.dirty[i] = 0;
+
+        glm::mat4 local = glm::translate(glm::mat4(1.0f), g.translation[i]) * glm::mat4_cast(g.rotation[i]) * glm::scale(glm::mat4(1.0f), g.scale[i]);
+        g.world[i] = parent >= 0 ? g.world[parent] * local : local;
+        g.moved[i] = g.world[i] != glm::mat4(1.0f);
+        int mesh = g.mesh[i];
+        if (mesh >= 0) {
+            AABB box = g.moved[i] ? transformAABB(meshLocalBounds[mesh], g.world[i]) : meshLocalBounds[mesh];
+            if (box.min != meshBounds[mesh].min || box.max != meshBounds[mesh].max) {
+                movedBoxes.push_back(meshBounds[mesh]);
+                movedBoxes.push_back(box);
+            }
+            meshBounds[mesh] = box;
+        }
+        // up to the first ancestor that already has to be refit
+        for (int node = i; node >= 0 && !g.refit[node]; node = g.parent[node])
+            g.refit[node] = 1;
+    }
+
+    // children come after their parent, so they are final by the time it is reached
+    for (int i = count - 1; i >= 0; i--) {
+        if (!g.refit[i])
+            continue;
+        g.refit[i] = 0;
+        g.changed[i] = 0;
+        AABB box = g.mesh[i] >= 0 ? meshBounds[g.mesh[i]] : EMPTY_AABB;
+        for (int child = g.firstChild[i]; child >= 0; child = g.nextSibling[child]) {
+            box.min = glm::min(box.min, g.bounds[child].min);
+            box.max = glm::max(box.max, g.bounds[child].max);
+        }
+        g.bounds[i] = box;
+    }
+
+    for (const AABB& box : movedBoxes)
+        invalidateSceneCaches(box);
+}
+
+void buildSceneGraph() {
+    std::fill(std::begin(meshNodes), std::end(meshNodes), -1);
+    int root = addSceneNode(-1, -1);
+    for (int mesh : { 0, 1, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, 15, 16, 18, 19 })
+        addSceneNode(root, mesh);
+    trainNode = addSceneNode(root, -1);
+    addSceneNode(trainNode, 17);
+    updateSceneGraph();
+}
+
+// back and forth along the platform, on the scene clock
+void animateTrain() {
+    if (!trainRunning)
+        return;
+    float offset = TRAIN_TRAVEL * sinf(sceneTime() * 2.0f * PI / TRAIN_PERIOD);
+    setNodeTransform(trainNode, glm::vec3(offset, 0.0f, 0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f));
+}
+
+// draws a mesh with its node's world transform on top of base, which is what modelLocation
+// holds otherwise (identity, or the mirror); only the nodes that moved touch the uniform
+void drawSceneMesh(GLint modelLocation, const glm::mat4& base, int mesh) {
+    int node = meshNodes[mesh];
+    bool moved = node >= 0 && sceneGraph.moved[node];
+    if (moved)
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(base * sceneGraph.world[node]));
+    glBindVertexArray(vaos[mesh]);
+    glDrawArrays(GL_TRIANGLES, 0, vertex_data[mesh].size() / 11);
+    if (moved)
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(base));
+}
+
+/*---------------------------------------------------*/
+
+/*------------------FOLIAGE--------------------*/
+
+// the grass is a single tuft drawn once per instance; the instances are scattered over the
+// upward facing floor triangles following Tex-Grass-Density.png, whose white stands for
+// GRASS_DENSITY tufts per square meter (the image spans the floor, top row towards -z)
+#define GRASS_DENSITY 40.0f
+#define GRASS_CHUNK_SIZE 4.0f
+#define FLOOR_EXTENT 20.0f
+
+struct GrassInstance {
+    glm::vec3 position;
+    float rotation; // about the y axis, in radians
+    glm::vec3 tint;
+    float scale;
+};
+
+// instances are grouped per chunk of the floor and shuffled within it, so drawing only the
+// first few of a chunk still gives an even (thinner) cover
+struct GrassChunk {
+    AABB bounds;
+    int first, count;
+};
+
+std::vector<float> GrassTuft; // same 11 float vertex layout as the models
+std::vector<GrassInstance> grassInstances;
+std::vector<GrassChunk> grassChunks;
+GLuint grassVao, grassVbo, grassInstanceVbo;
+
+// the share of each chunk that is drawn drops from all of it to none between these distances;
+// the vertex shader shrinks the tufts within the last fade band so they do not pop
+float foliageFadeStart = 12.0f;
+float foliageFadeEnd = 35.0f;
+#define FOLIAGE_FADE_BAND 0.15f
+
+// three quads crossed at 60 degrees, one unit wide and tall, standing on the origin
+void makeGrassTuft() {
+    const glm::vec2 uvs[4] = { {0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 1.0f} };
+    const int corners[6] = {0, 1, 2, 0, 2, 3};
+    for (int q = 0; q < 3; q++) {
+        float angle = glm::radians(60.0f * q);
+        glm::vec3 side = glm::vec3(cos(angle), 0.0f, sin(angle)) * 0.5f;
+        glm::vec3 positions[4] = { -side, side, side + glm::vec3(0.0f, 1.0f, 0.0f), -side + glm::vec3(0.0f, 1.0f, 0.0f) };
+        for (int c : corners) {
+            // lit like the ground it grows from rather than like a vertical card
+            GrassTuft.insert(GrassTuft.end(), { positions[c].x, positions[c].y, positions[c].z, uvs[c].x, uvs[c].y,
+                                                0.0f, 1.0f, 0.0f, side.x * 2.0f, 0.0f, side.z * 2.0f });
+        }
+    }
+}
+
+bool generateGrassInstances(const char* densityMapFilename) {
+    int width, height, channels;
+    stbi_set_flip_vertically_on_load(false);
+    unsigned char* density = stbi_load(densityMapFilename, &width, &height, &channels, 1);
+    if (!density) {
+        std::cout << "Cannot read density map '" << densityMapFilename << "'\n";
+        return false;
+    }
+    auto densityAt = [&](float x, float z) {
+        int u = glm::clamp((int)((x + FLOOR_EXTENT) / (2.0f * FLOOR_EXTENT) * width), 0, width - 1);
+        int v = glm::clamp((int)((z + FLOOR_EXTENT) / (2.0f * FLOOR_EXTENT) * height), 0, height - 1);
+        return density[v * width + u] / 255.0f;
+    };
+
+    // fixed seed, so the grass is the same on every run
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> random(0.0f, 1.0f);
+
+    int chunksPerSide = (int)ceil(2.0f * FLOOR_EXTENT / GRASS_CHUNK_SIZE);
+    std::vector<std::vector<GrassInstance>> buckets(chunksPerSide * chunksPerSide);
+
+    for (size_t i = 0; i + 32 < FloorMesh.size(); i += 33) {
+        glm::vec3 a(FloorMesh[i], FloorMesh[i + 1], FloorMesh[i + 2]);
+        glm::vec3 b(FloorMesh[i + 11], FloorMesh[i + 12], FloorMesh[i + 13]);
+        glm::vec3 c(FloorMesh[i + 22], FloorMesh[i + 23], FloorMesh[i + 24]);
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        float area = 0.5f * glm::length(normal);
+        if (area <= 0.0f || fabs(normal.y) < 0.8f * glm::length(normal))
+            continue; // walls and steep slopes stay bare
+
+        // as many candidates as full density would give, each kept with the local density
+        float expected = area * GRASS_DENSITY;
+        int candidates = (int)expected + (random(rng) < expected - floor(expected));
+        for (int n = 0; n < candidates; n++) {
+            float r1 = sqrt(random(rng)), r2 = random(rng);
+            glm::vec3 p = a * (1.0f - r1) + b * (r1 * (1.0f - r2)) + c * (r1 * r2);
+            if (random(rng) >= densityAt(p.x, p.z))
+                continue;
+
+            GrassInstance grass;
+            grass.position = p;
+            grass.rotation = random(rng) * glm::two_pi<float>();
+            grass.tint = glm::mix(glm::vec3(0.75f, 0.9f, 0.7f), glm::vec3(1.1f, 1.05f, 0.9f), random(rng));
+            grass.scale = 0.4f + 0.6f * random(rng);
+
+            int cx = glm::clamp((int)((p.x + FLOOR_EXTENT) / GRASS_CHUNK_SIZE), 0, chunksPerSide - 1);
+            int cz = glm::clamp((int)((p.z + FLOOR_EXTENT) / GRASS_CHUNK_SIZE), 0, chunksPerSide - 1);
+            buckets[cz * chunksPerSide + cx].push_back(grass);
+        }
+    }
+    stbi_image_free(density);
+
+    grassInstances.clear();
+    grassChunks.clear();
+    for (auto& bucket : buckets) {
+        if (bucket.empty())
+            continue;
+        std::shuffle(bucket.begin(), bucket.end(), rng);
+
+        GrassChunk chunk = { { bucket[0].position, bucket[0].position }, (int)grassInstances.size(), (int)bucket.size() };
+        for (const GrassInstance& grass : bucket) {
+            glm::vec3 reach(0.5f * grass.scale, 0.0f, 0.5f * grass.scale);
+            chunk.bounds.min = glm::min(chunk.bounds.min, grass.position - reach);
+            chunk.bounds.max = glm::max(chunk.bounds.max, grass.position + reach + glm::vec3(0.0f, grass.scale, 0.0f));
+        }
+        grassChunks.push_back(chunk);
+        grassInstances.insert(grassInstances.end(), bucket.begin(), bucket.end());
+    }
+    return true;
+}
+
+bool setupFoliage() {
+    makeGrassTuft();
+    if (!generateGrassInstances("Tex-Grass-Density.png"))
+        return false;
+
+    glGenVertexArrays(1, &grassVao);
+    glGenBuffers(1, &grassVbo);
+    glGenBuffers(1, &grassInstanceVbo);
+    glBindVertexArray(grassVao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, grassVbo);
+    glBufferData(GL_ARRAY_BUFFER, GrassTuft.size() * sizeof(float), GrassTuft.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*) 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*) (3 * sizeof(float)));
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*) (5 * sizeof(float)));
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*) (8 * sizeof(float)));
+    for (int i = 0; i < 4; i++)
+        glEnableVertexAttribArray(i);
+
+    // the instance attribute pointers are set per chunk in drawGrass(), since GL 3.3 has no base instance
+    glBindBuffer(GL_ARRAY_BUFFER, grassInstanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, grassInstances.size() * sizeof(GrassInstance), grassInstances.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(8);
+    glEnableVertexAttribArray(9);
+    glVertexAttribDivisor(8, 1);
+    glVertexAttribDivisor(9, 1);
+
+    glBindVertexArray(0);
+    return true;
+}
+
+// a chunk in view and how many of its tufts to draw
+struct GrassDraw {
+    int chunk, count;
+};
+
+// fills draws (room for every chunk) and returns how many there are
+int cullGrass(const Frustum& frustum, const glm::vec3& eye, GrassDraw* draws) {
+    int drawCount = 0;
+    for (int i = 0; i < (int)grassChunks.size(); i++) {
+        const GrassChunk& chunk = grassChunks[i];
+        if (!aabbInFrustum(frustum, chunk.bounds))
+            continue;
+
+        // the nearest point of the chunk has the highest density, so this many always suffice
+        glm::vec3 outside = glm::max(glm::max(chunk.bounds.min - eye, eye - chunk.bounds.max), glm::vec3(0.0f));
+        float density = glm::clamp((foliageFadeEnd - glm::length(outside)) / (foliageFadeEnd - foliageFadeStart), 0.0f, 1.0f);
+        int count = std::min(chunk.count, (int)ceil(chunk.count * density / (1.0f - FOLIAGE_FADE_BAND)));
+        if (count > 0)
+            draws[drawCount++] = { i, count };
+    }
+    return drawCount;
+}
+
+// draws the grass chunks cullGrass() kept; eye is the camera position in the (unmirrored)
+// space of the chunks, which is where the distance for the density falloff is measured from
+void drawGrass(const GrassDraw* draws, int drawCount, const glm::vec3& eye) {
+    glUniform1i(glGetUniformLocation(shader, "isFoliage"), 1);
+    glUniform3f(glGetUniformLocation(shader, "foliageFade"), foliageFadeStart, foliageFadeEnd, FOLIAGE_FADE_BAND);
+    glUniform3fv(glGetUniformLocation(shader, "foliageEye"), 1, glm::value_ptr(eye));
+    GLint chunkCountLocation = glGetUniformLocation(shader, "foliageChunkCount");
+
+    glBindVertexArray(grassVao);
+    glBindBuffer(GL_ARRAY_BUFFER, grassInstanceVbo);
+    for (int i = 0; i < drawCount; i++) {
+        const GrassChunk& chunk = grassChunks[draws[i].chunk];
+        size_t offset = chunk.first * sizeof(GrassInstance);
+        glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, sizeof(GrassInstance), (void*) offset);
+        glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, sizeof(GrassInstance), (void*) (offset + 4 * sizeof(float)));
+        glUniform1i(chunkCountLocation, chunk.count);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, GrassTuft.size() / 11, draws[i].count);
+    }
+    glUniform1i(glGetUniformLocation(shader, "isFoliage"), 0);
+}
+
+/*---------------------------------------------*/
+
+/*------------------STREAMING BUFFER--------------------*/
+
+// one big buffer for everything rewritten every frame (fish instances, light blocks, overlay
+// vertices), split into STREAM_FRAMES regions used round robin. A region is only written
+// again once the fence of the frame that used it has passed, so the unsynchronized maps
+// never stall; if the GPU is further behind than that (or a frame outgrows its region) the
+// buffer is orphaned instead, and the driver hands out fresh storage
+#define STREAM_FRAMES 3
+#define STREAM_FRAME_SIZE (8 << 20) // room for the instances of 300k fish
+#define STREAM_RESERVED_SIZE (1 << 20) // kept for the light blocks and overlay vertices
+#define MAX_STREAMED_FISH ((STREAM_FRAME_SIZE - STREAM_RESERVED_SIZE) / (int)sizeof(FishInstance)) // --fish on the CPU
+
+struct StreamBuffer {
+    GLuint buffer = 0;
+    GLsync fences[STREAM_FRAMES] = {};
+    int frame = 0;
+    GLintptr offset = 0; // next free byte, inside the current frame's region
+    int orphans = 0;     // times the fallback was taken, for the console
+    GLint uniformAlignment = 256;
+};
+StreamBuffer streamBuffer;
+
+void orphanStreamBuffer() {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, streamBuffer.buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, STREAM_FRAMES * STREAM_FRAME_SIZE, NULL, GL_STREAM_DRAW);
+    for (GLsync& fence : streamBuffer.fences) {
+        if (fence) glDeleteSync(fence);
+        fence = 0;
+    }
+    if (streamBuffer.orphans++ == 0)
+        std::cout << "Streaming buffer: GPU fell behind, orphaning instead of waiting\n";
+}
+
+void setupStreamBuffer() {
+    glGenBuffers(1, &streamBuffer.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, streamBuffer.buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, STREAM_FRAMES * STREAM_FRAME_SIZE, NULL, GL_STREAM_DRAW);
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &streamBuffer.uniformAlignment);
+}
+
+void streamBeginFrame() {
+    streamBuffer.frame = (streamBuffer.frame + 1) % STREAM_FRAMES;
+    streamBuffer.offset = (GLintptr)streamBuffer.frame * STREAM_FRAME_SIZE;
+
+    GLsync& fence = streamBuffer.fences[streamBuffer.frame];
+    if (fence) {
+        // polled, never waited on
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+            orphanStreamBuffer();
+        else {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+}
+
+void streamEndFrame() {
+    GLsync& fence = streamBuffer.fences[streamBuffer.frame];
+    if (fence) glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// maps size bytes of this frame's region for writing and sets offset to where they start in
+// streamBuffer.buffer; null when they do not fit. Write them, without reading them back, and
+// streamUnmap() before the next GL call that touches GL_COPY_WRITE_BUFFER. Uniform blocks need
+// streamBuffer.uniformAlignment, 16 does for vertex data
+void* streamMap(GLsizeiptr size, GLintptr alignment, GLintptr& offset) {
+    GLintptr regionEnd = (GLintptr)(streamBuffer.frame + 1) * STREAM_FRAME_SIZE;
+    offset = (streamBuffer.offset + alignment - 1) / alignment * alignment;
+    if (offset + size > regionEnd) {
+        if (size > STREAM_FRAME_SIZE) {
+            std::cout << "Streaming buffer: " << size << " bytes do not fit in a frame\n";
+            offset = 0;
+            return nullptr;
+        }
+        orphanStreamBuffer();
+        offset = (GLintptr)streamBuffer.frame * STREAM_FRAME_SIZE;
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, streamBuffer.buffer);
+    void* mapped = glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size,
+                                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    streamBuffer.offset = offset + size;
+    return mapped;
+}
+
+void streamUnmap() {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, streamBuffer.buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
+
+// copies size bytes into this frame's region and returns their offset in streamBuffer.buffer
+GLintptr streamUpload(const void* data, GLsizeiptr size, GLintptr alignment = 16) {
+    GLintptr offset;
+    void* mapped = streamMap(size, alignment, offset);
+    if (mapped) {
+        memcpy(mapped, data, size);
+        streamUnmap();
+    }
+    return offset;
+}
+
+/*---------------------------------------------------*/
+
+/*------------------GPU PROFILER--------------------*/
+
+// per-pass GPU timings from GL_TIMESTAMP queries (these nest, unlike GL_TIME_ELAPSED);
+// each frame writes into its own slot of a small ring, and a slot is only read back
+// when the ring comes around to it again, so reading never stalls the pipeline
+#define GPU_PROFILER_FRAMES 4
+#define GPU_PROFILER_MAX_SCOPES 64
+#define GPU_PROFILER_HISTORY 120 // frames kept for the rolling average and percentiles
+
+struct GpuScopeRecord {
+    std::string name;
+    int depth;
+};
+
+struct GpuProfilerFrame {
+    GLuint queries[GPU_PROFILER_MAX_SCOPES * 2]; // begin/end timestamp per scope
+    GpuScopeRecord scopes[GPU_PROFILER_MAX_SCOPES];
+    int scopeCount = 0;
+    int lastQuery = -1; // the most recently issued query, done means all of them are
+};
+
+// rolling history of one named pass, kept in the order the passes were first seen
+struct GpuPassStats {
+    std::string name;
+    int depth = 0;
+    float history[GPU_PROFILER_HISTORY] = {};
+    int samples = 0;
+    int lastFrame = -1; // gpuProfilerResolvedFrames when it was last recorded
+};
+
+GpuProfilerFrame gpuProfilerFrames[GPU_PROFILER_FRAMES];
+int gpuProfilerFrame = 0;
+int gpuProfilerDepth = 0;
+int gpuProfilerResolvedFrames = 0;
+std::vector<GpuPassStats> gpuPassStats;
+
+bool showGpuProfiler = false;
+GLuint overlayShader;
+GLuint overlayVao;
+
+bool setupGpuProfiler() {
+    for (auto& frame : gpuProfilerFrames)
+        glGenQueries(GPU_PROFILER_MAX_SCOPES * 2, frame.queries);
+
+    // overlay vertices are 2D pixel positions with an RGBA color, streamed every frame
+    // (the attributes are pointed at them in drawGpuProfilerOverlay())
+    glGenVertexArrays(1, &overlayVao);
+    glBindVertexArray(overlayVao);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+
+    overlayShader = loadShader("Finals-Overlay.vs", "Finals-Overlay.fs");
+    return overlayShader != 0;
+}
+
+// a pass that runs more than once in a frame (one per shadow layer, say) is summed
+void recordGpuSample(const std::string& name, int depth, float milliseconds) {
+    GpuPassStats* stats = nullptr;
+    for (auto& s : gpuPassStats) {
+        if (s.name == name) { stats = &s; break; }
+    }
+    if (!stats) {
+        gpuPassStats.push_back(GpuPassStats());
+        stats = &gpuPassStats.back();
+        stats->name = name;
+    }
+    stats->depth = depth;
+
+    if (stats->lastFrame == gpuProfilerResolvedFrames) {
+        stats->history[(stats->samples - 1) % GPU_PROFILER_HISTORY] += milliseconds;
+    } else {
+        stats->history[stats->samples % GPU_PROFILER_HISTORY] = milliseconds;
+        stats->samples++;
+        stats->lastFrame = gpuProfilerResolvedFrames;
+    }
+}
+
+// call at the start of every frame: folds the slot about to be reused into the history
+void gpuProfilerBeginFrame() {
+    GpuProfilerFrame& frame = gpuProfilerFrames[gpuProfilerFrame];
+    if (frame.lastQuery >= 0) {
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) { // otherwise the frame is dropped rather than waited on
+            gpuProfilerResolvedFrames++;
+            for (int i = 0; i < frame.scopeCount; i++) {
+                GLuint64 start, end;
+                glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &start);
+                glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+                recordGpuSample(frame.scopes[i].name, frame.scopes[i].depth, (end - start) / 1.0e6f);
+            }
+        }
+    }
+    frame.scopeCount = 0;
+    frame.lastQuery = -1;
+    gpuProfilerDepth = 0;
+}
+
+void gpuProfilerEndFrame() {
+    gpuProfilerFrame = (gpuProfilerFrame + 1) % GPU_PROFILER_FRAMES;
+}
+
+int gpuProfilerBegin(const std::string& name) {
+    GpuProfilerFrame& frame = gpuProfilerFrames[gpuProfilerFrame];
+    int depth = gpuProfilerDepth++;
+    if (frame.scopeCount == GPU_PROFILER_MAX_SCOPES)
+        return -1; // out of queries, the scope is simply not timed
+
+    int scope = frame.scopeCount++;
+    frame.scopes[scope].name = name;
+    frame.scopes[scope].depth = depth;
+    glQueryCounter(frame.queries[scope * 2], GL_TIMESTAMP);
+    frame.lastQuery = scope * 2;
+    return scope;
+}
+
+void gpuProfilerEnd(int scope) {
+    gpuProfilerDepth--;
+    if (scope < 0)
+        return;
+
+    GpuProfilerFrame& frame = gpuProfilerFrames[gpuProfilerFrame];
+    glQueryCounter(frame.queries[scope * 2 + 1], GL_TIMESTAMP);
+    frame.lastQuery = scope * 2 + 1;
+}
+
+// times everything issued until the end of the enclosing block
+struct GpuScope {
+    int scope;
+    GpuScope(const std::string& name) : scope(gpuProfilerBegin(name)) {}
+    ~GpuScope() { gpuProfilerEnd(scope); }
+};
+#define GPU_SCOPE_CONCAT(a, b) a##b
+#define GPU_SCOPE_NAME(line) GPU_SCOPE_CONCAT(gpuScope, line)
+#define GPU_SCOPE(name) GpuScope GPU_SCOPE_NAME(__LINE__)(name)
+
+int gpuPassSampleCount(const GpuPassStats& stats) {
+    return std::min(stats.samples, GPU_PROFILER_HISTORY);
+}
+
+float gpuPassAverage(const GpuPassStats& stats) {
+    int count = gpuPassSampleCount(stats);
+    float total = 0.0f;
+    for (int i = 0; i < count; i++)
+        total += stats.history[i];
+    return count > 0 ? total / count : 0.0f;
+}
+
+// percentile in [0, 1] over the rolling history
+float gpuPassPercentile(const GpuPassStats& stats, float percentile) {
+    int count = gpuPassSampleCount(stats);
+    if (count == 0)
+        return 0.0f;
+    std::vector<float> sorted(stats.history, stats.history + count);
+    int index = std::min(count - 1, (int)(percentile * count));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+}
+
+// the time of a pass in the frame that was just read back, or -1 if it has none
+float gpuPassLatest(const std::string& name) {
+    for (auto& s : gpuPassStats) {
+        if (s.name == name && s.lastFrame == gpuProfilerResolvedFrames && s.samples > 0)
+            return s.history[(s.samples - 1) % GPU_PROFILER_HISTORY];
+    }
+    return -1.0f;
+}
+
+void dumpGpuProfilerCsv(const char* filename) {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cout << "Cannot write GPU profile to '" << filename << "'\n";
+        return;
+    }
+
+    file << "pass,depth,avg_ms,p50_ms,p95_ms,p99_ms,max_ms,samples\n";
+    for (auto& s : gpuPassStats) {
+        file << s.name << "," << s.depth << ","
+             << gpuPassAverage(s) << ","
+             << gpuPassPercentile(s, 0.5f) << ","
+             << gpuPassPercentile(s, 0.95f) << ","
+             << gpuPassPercentile(s, 0.99f) << ","
+             << gpuPassPercentile(s, 1.0f) << ","
+             << gpuPassSampleCount(s) << "\n";
+    }
+    std::cout << "GPU profile written to '" << filename << "'\n";
+}
+
+// 3x5 pixel font for the overlay, one bit per pixel, top row first
+const char overlayFontChars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:-+/()%_";
+const unsigned short overlayFontBits[] = {
+    0b111'101'101'101'111, 0b010'110'010'010'111, 0b111'001'111'100'111, 0b111'001'111'001'111,
+    0b101'101'111'001'001, 0b111'100'111'001'111, 0b111'100'111'101'111, 0b111'001'001'001'001,
+    0b111'101'111'101'111, 0b111'101'111'001'111, // 0-9
+    0b010'101'111'101'101, 0b110'101'110'101'110, 0b011'100'100'100'011, 0b110'101'101'101'110,
+    0b111'100'110'100'111, 0b111'100'110'100'100, 0b011'100'101'101'011, 0b101'101'111'101'101,
+    0b111'010'010'010'111, 0b001'001'001'101'010, 0b101'101'110'101'101, 0b100'100'100'100'111,
+    0b101'111'111'101'101, 0b110'101'101'101'101, 0b010'101'101'101'010, 0b110'101'110'100'100,
+    0b010'101'101'110'011, 0b110'101'110'101'101, 0b011'100'010'001'110, 0b111'010'010'010'010,
+    0b101'101'101'101'111, 0b101'101'101'101'010, 0b101'101'111'111'101, 0b101'101'010'101'101,
+    0b101'101'010'010'010, 0b111'001'010'100'111, // A-Z
+    0b000'000'000'000'010, 0b000'010'000'010'000, 0b000'000'111'000'000, 0b000'010'111'010'000,
+    0b001'001'010'100'100, 0b010'100'100'100'010, 0b010'001'001'001'010, 0b101'001'010'100'101,
+    0b000'000'000'000'111, // punctuation
+};
+
+// appends one solid rectangle (two triangles, position + color per vertex) in pixels
+void addOverlayRect(std::vector<float>& vertices, float x, float y, float w, float h, const glm::vec4& color) {
+    float corners[6][2] = { {x, y}, {x + w, y}, {x + w, y + h}, {x, y}, {x + w, y + h}, {x, y + h} };
+    for (auto& c : corners) {
+        vertices.insert(vertices.end(), { c[0], c[1], color.r, color.g, color.b, color.a });
+    }
+}
+
+void addOverlayText(std::vector<float>& vertices, float x, float y, const std::string& text, float pixel, const glm::vec4& color) {
+    for (char ch : text) {
+        const char* found = strchr(overlayFontChars, toupper(ch));
+        if (ch != ' ' && found && *found) {
+            unsigned short bits = overlayFontBits[found - overlayFontChars];
+            for (int row = 0; row < 5; row++) {
+                for (int col = 0; col < 3; col++) {
+                    if (bits & (1 << (14 - row * 3 - col)))
+                        addOverlayRect(vertices, x + col * pixel, y + row * pixel, pixel, pixel, color);
+                }
+            }
+        }
+        x += 4 * pixel;
+    }
+}
+
+// draws the pass table with a bar per pass (full width = frame budget) on top of the final image
+void drawGpuProfilerOverlay() {
+    const float pixel = 2.0f, lineHeight = 7 * pixel, margin = 8.0f;
+    const float barX = margin + 45 * 4 * pixel, barWidth = 200.0f;
+    const glm::vec4 textColor(1.0f, 1.0f, 1.0f, 1.0f);
+    const glm::vec4 barColor(0.3f, 0.8f, 0.4f, 0.9f);
+    const glm::vec4 overBudgetColor(0.9f, 0.3f, 0.2f, 0.9f);
+
+    std::vector<float> vertices;
+    float y = margin;
+    addOverlayText(vertices, margin, y, "GPU PASS MS              AVG     P50     P95", pixel, textColor);
+    y += lineHeight;
+
+    int lines = 0;
+    for (auto& s : gpuPassStats) {
+        // passes that stopped running (e.g. the one-off cubemap bake) drop off the table
+        if (gpuProfilerResolvedFrames - s.lastFrame > GPU_PROFILER_HISTORY)
+            continue;
+
+        float average = gpuPassAverage(s);
+        char numbers[32];
+        snprintf(numbers, sizeof(numbers), "%8.2f%8.2f%8.2f", average, gpuPassPercentile(s, 0.5f), gpuPassPercentile(s, 0.95f));
+        std::string label = std::string(s.depth * 2, ' ') + s.name;
+        label.resize(20, ' ');
+        addOverlayText(vertices, margin, y, label + numbers, pixel, textColor);
+
+        float fraction = average / frameBudgetMs;
+        addOverlayRect(vertices, barX, y, barWidth * std::min(fraction, 1.0f), 5 * pixel,
+                       fraction > 1.0f ? overBudgetColor : barColor);
+        y += lineHeight;
+        lines++;
+    }
+
+    // dark panel behind everything, drawn first
+    std::vector<float> panel;
+    addOverlayRect(panel, margin / 2, margin / 2, barX + barWidth, (lines + 1) * lineHeight + margin, glm::vec4(0.0f, 0.0f, 0.0f, 0.6f));
+    vertices.insert(vertices.begin(), panel.begin(), panel.end());
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE); // the y flip to pixel coordinates turns the winding around
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(overlayShader);
+    glUniform2f(glGetUniformLocation(overlayShader, "screenSize"), (float)windowWidth, (float)windowHeight);
+    GLintptr offset = streamUpload(vertices.data(), vertices.size() * sizeof(float));
+    glBindVertexArray(overlayVao);
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer.buffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)offset);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(offset + 2 * sizeof(float)));
+    glDrawArrays(GL_TRIANGLES, 0, vertices.size() / 6);
+    glDisable(GL_BLEND);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+}
+
+/*---------------------------------------------------*/
+
+/*------------------SOFTWARE OCCLUSION--------------------*/
+
+// a small CPU depth buffer of the big occluders (buildings, their windows and the stations),
+// rasterized 4 pixels at a time with SSE, one band of tiles per job; meshes are then tested
+// against it with their bounding boxes, with no GPU round trip. Depth is 1/w, which is linear
+// in screen space and works for the oblique mirror projection too (bigger is nearer, 0 = empty).
+// A pixel only takes a triangle that covers all of it, at the triangle's farthest depth over
+// the pixel, so the buffer never claims more than the real occluders hide
+#define SW_OCCLUSION_WIDTH 256
+#define SW_OCCLUSION_HEIGHT 128
+#define SW_TILE_WIDTH 32
+#define SW_TILE_HEIGHT 8
+#define SW_TILES_X (SW_OCCLUSION_WIDTH / SW_TILE_WIDTH)
+#define SW_TILES_Y (SW_OCCLUSION_HEIGHT / SW_TILE_HEIGHT)
+#define SW_NEAR 0.05f               // occluders are clipped to w >= SW_NEAR
+#define SW_OCCLUDER_MIN_AREA 0.25f  // smaller triangles are trim and detail, left out of the occluders
+
+struct SoftwareOcclusionBuffer {
+    alignas(16) float depth[SW_OCCLUSION_HEIGHT][SW_OCCLUSION_WIDTH];
+    float tileFarthest[SW_TILES_Y][SW_TILES_X]; // smallest 1/w in each tile
+};
+SoftwareOcclusionBuffer swOcclusion;
+
+// only ever a subset of the real triangles, so the occluders never hide more than the meshes do
+std::vector<glm::vec3> occluderTriangles;
+
+struct ScreenTriangle {
+    glm::vec2 v[3]; // pixels
+    float invW[3];
+    int minY, maxY;
+};
+std::vector<ScreenTriangle> screenTriangles;
+
+void setupSoftwareOcclusion() {
+    for (int mesh : { 3, 4, 5, 6, 11, 12, 16 }) {
+        const std::vector<float>& data = vertex_data[mesh];
+        for (size_t i = 0; i + 32 < data.size(); i += 33) {
+            glm::vec3 a(data[i], data[i + 1], data[i + 2]);
+            glm::vec3 b(data[i + 11], data[i + 12], data[i + 13]);
+            glm::vec3 c(data[i + 22], data[i + 23], data[i + 24]);
+            if (0.5f * glm::length(glm::cross(b - a, c - a)) >= SW_OCCLUDER_MIN_AREA)
+                occluderTriangles.insert(occluderTriangles.end(), { a, b, c });
+        }
+    }
+    std::cout << "Software occlusion: " << occluderTriangles.size() / 3 << " occluder triangles, "
+              << workerPool.threads.size() << " worker threads\n";
+}
+
+void addScreenTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
+    ScreenTriangle tri;
+    const glm::vec4* clip[3] = { &a, &b, &c };
+    float minY = 1e30f, maxY = -1e30f;
+    for (int k = 0; k < 3; k++) {
+        tri.invW[k] = 1.0f / clip[k]->w;
+        tri.v[k] = glm::vec2((clip[k]->x * tri.invW[k] * 0.5f + 0.5f) * SW_OCCLUSION_WIDTH,
+                             (clip[k]->y * tri.invW[k] * 0.5f + 0.5f) * SW_OCCLUSION_HEIGHT);
+        minY = std::min(minY, tri.v[k].y);
+        maxY = std::max(maxY, tri.v[k].y);
+    }
+    tri.minY = std::max(0, (int)floor(minY));
+    tri.maxY = std::min(SW_OCCLUSION_HEIGHT - 1, (int)ceil(maxY));
+    if (tri.minY <= tri.maxY)
+        screenTriangles.push_back(tri);
+}
+
+void rasterizeBand(int band) {
+    CPU_SCOPE("rasterize band");
+    int bandMinY = band * SW_TILE_HEIGHT, bandMaxY = bandMinY + SW_TILE_HEIGHT - 1;
+    for (int y = bandMinY; y <= bandMaxY; y++)
+        std::fill_n(swOcclusion.depth[y], SW_OCCLUSION_WIDTH, 0.0f);
+
+    for (const ScreenTriangle& tri : screenTriangles) {
+        if (tri.maxY < bandMinY || tri.minY > bandMaxY)
+            continue;
+
+        // edge functions, positive inside whatever the winding
+        const glm::vec2* v = tri.v;
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (fabs(area) < 1e-6f)
+            continue;
+        float sign = area > 0.0f ? 1.0f : -1.0f;
+        float edgeA[3], edgeB[3], edgeC[3];
+        for (int k = 0; k < 3; k++) {
+            const glm::vec2& p = v[k];
+            const glm::vec2& q = v[(k + 1) % 3];
+            edgeA[k] = sign * (p.y - q.y);
+            edgeB[k] = sign * (q.x - p.x);
+            edgeC[k] = sign * (p.x * q.y - p.y * q.x);
+            // tested at the pixel centres, but moved in by half a pixel, so only the pixels
+            // the triangle covers entirely pass
+            edgeC[k] -= 0.5f * (fabs(edgeA[k]) + fabs(edgeB[k]));
+        }
+
+        // 1/w as a plane over the screen, taken at the farthest corner of each pixel
+        float invArea = 1.0f / area;
+        float dzdx = ((tri.invW[1] - tri.invW[0]) * (v[2].y - v[0].y) - (tri.invW[2] - tri.invW[0]) * (v[1].y - v[0].y)) * invArea;
+        float dzdy = ((tri.invW[2] - tri.invW[0]) * (v[1].x - v[0].x) - (tri.invW[1] - tri.invW[0]) * (v[2].x - v[0].x)) * invArea;
+        float z0 = tri.invW[0] - dzdx * v[0].x - dzdy * v[0].y - 0.5f * (fabs(dzdx) + fabs(dzdy));
+
+        int minX = std::max(0, (int)floor(std::min({ v[0].x, v[1].x, v[2].x }))) & ~3;
+        int maxX = std::min(SW_OCCLUSION_WIDTH - 1, (int)ceil(std::max({ v[0].x, v[1].x, v[2].x })));
+        int minY = std::max(tri.minY, bandMinY), maxY = std::min(tri.maxY, bandMaxY);
+
+        for (int y = minY; y <= maxY; y++) {
+            float py = y + 0.5f;
+            float* row = swOcclusion.depth[y];
+#if defined(__SSE2__)
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)minX), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+            __m128 e[3], stepE[3];
+            for (int k = 0; k < 3; k++) {
+                e[k] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeA[k]), px), _mm_set1_ps(edgeB[k] * py + edgeC[k]));
+                stepE[k] = _mm_set1_ps(edgeA[k] * 4.0f);
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), px), _mm_set1_ps(dzdy * py + z0));
+            __m128 stepZ = _mm_set1_ps(dzdx * 4.0f);
+            __m128 zero = _mm_setzero_ps();
+            for (int x = minX; x <= maxX; x += 4) {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+                if (_mm_movemask_ps(inside)) {
+                    __m128 depth = _mm_load_ps(row + x);
+                    __m128 nearer = _mm_max_ps(depth, z);
+                    _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, depth)));
+                }
+                for (int k = 0; k < 3; k++)
+                    e[k] = _mm_add_ps(e[k], stepE[k]);
+                z = _mm_add_ps(z, stepZ);
+            }
+#else
+            for (int x = minX; x <= maxX; x++) {
+                float px = x + 0.5f;
+                bool inside = true;
+                for (int k = 0; k < 3; k++)
+                    inside = inside && edgeA[k] * px + edgeB[k] * py + edgeC[k] >= 0.0f;
+                if (inside)
+                    row[x] = std::max(row[x], dzdx * px + dzdy * py + z0);
+            }
+#endif
+        }
+    }
+
+    // the coarse level the box tests look at first
+    for (int tileX = 0; tileX < SW_TILES_X; tileX++) {
+        float farthest = 1e30f;
+        for (int y = bandMinY; y <= bandMaxY; y++)
+            for (int x = tileX * SW_TILE_WIDTH; x < (tileX + 1) * SW_TILE_WIDTH; x++)
+                farthest = std::min(farthest, swOcclusion.depth[y][x]);
+        swOcclusion.tileFarthest[band][tileX] = farthest;
+    }
+}
+
+// worldToClip may include the mirror reflection; the occluders stay in world space
+void rasterizeOccluders(const glm::mat4& worldToClip) {
+    CPU_SCOPE("rasterizeOccluders");
+    screenTriangles.clear();
+    for (size_t i = 0; i + 2 < occluderTriangles.size(); i += 3) {
+        glm::vec4 polygon[5];
+        int count = 3;
+        for (int k = 0; k < 3; k++)
+            polygon[k] = worldToClip * glm::vec4(occluderTriangles[i + k], 1.0f);
+
+        // clip against w >= SW_NEAR, then against the projection's own near plane (z >= -w),
+        // which for the mirror is the oblique one on the mirror: what lies behind it must not
+        // end up in the buffer, reflected in front of the camera
+        for (int plane = 0; plane < 2 && count > 0; plane++) {
+            auto distance = [plane](const glm::vec4& p) { return plane == 0 ? p.w - SW_NEAR : p.z + p.w; };
+            glm::vec4 clipped[5];
+            int clippedCount = 0;
+            for (int k = 0; k < count; k++) {
+                const glm::vec4& p = polygon[k];
+                const glm::vec4& q = polygon[(k + 1) % count];
+                float dp = distance(p), dq = distance(q);
+                if (dp >= 0.0f)
+                    clipped[clippedCount++] = p;
+                if ((dp >= 0.0f) != (dq >= 0.0f))
+                    clipped[clippedCount++] = glm::mix(p, q, dp / (dp - dq));
+            }
+            std::copy(clipped, clipped + clippedCount, polygon);
+            count = clippedCount;
+        }
+        for (int k = 2; k < count; k++)
+            addScreenTriangle(polygon[0], polygon[k - 1], polygon[k]);
+    }
+
+    static const std::function<void(int)> band = rasterizeBand;
+    parallelFor(SW_TILES_Y, band);
+}
+
+// false only if the whole box is behind the rasterized occluders
+bool aabbVisibleToOccluders(const AABB& box, const glm::mat4& worldToClip) {
+    glm::vec2 rectMin(1e30f), rectMax(-1e30f);
+    float nearest = 0.0f;
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 p((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y, (corner & 4) ? box.max.z : box.min.z);
+        glm::vec4 clip = worldToClip * glm::vec4(p, 1.0f);
+        if (clip.w < SW_NEAR)
+            return true; // reaches past the near plane
+        glm::vec2 pixel((clip.x / clip.w * 0.5f + 0.5f) * SW_OCCLUSION_WIDTH, (clip.y / clip.w * 0.5f + 0.5f) * SW_OCCLUSION_HEIGHT);
+        rectMin = glm::min(rectMin, pixel);
+        rectMax = glm::max(rectMax, pixel);
+        nearest = std::max(nearest, 1.0f / clip.w);
+    }
+
+    int x0 = std::max(0, (int)floor(rectMin.x)), x1 = std::min(SW_OCCLUSION_WIDTH - 1, (int)ceil(rectMax.x));
+    int y0 = std::max(0, (int)floor(rectMin.y)), y1 = std::min(SW_OCCLUSION_HEIGHT - 1, (int)ceil(rectMax.y));
+    if (x0 > x1 || y0 > y1)
+        return false; // off-screen
+
+    // a little slack so a mesh lying on its own box is never hidden by itself
+    float threshold = nearest * 1.001f;
+    for (int tileY = y0 / SW_TILE_HEIGHT; tileY <= y1 / SW_TILE_HEIGHT; tileY++) {
+        for (int tileX = x0 / SW_TILE_WIDTH; tileX <= x1 / SW_TILE_WIDTH; tileX++) {
+            if (swOcclusion.tileFarthest[tileY][tileX] > threshold)
+                continue; // everything in this tile is nearer than the box
+
+            int ty0 = std::max(y0, tileY * SW_TILE_HEIGHT), ty1 = std::min(y1, (tileY + 1) * SW_TILE_HEIGHT - 1);
+            int tx0 = std::max(x0, tileX * SW_TILE_WIDTH), tx1 = std::min(x1, (tileX + 1) * SW_TILE_WIDTH - 1);
+            for (int y = ty0; y <= ty1; y++)
+                for (int x = tx0; x <= tx1; x++)
+                    if (swOcclusion.depth[y][x] <= threshold)
+                        return true;
+        }
+    }
+    return false;
+}
+
+/*---------------------------------------------------*/
+
+// helper function for reading model data from a file
+void readModelData(std::vector<float> &array, const char* filename) {
+    CPU_SCOPE("readModelData", filename);
+    sceneAssetFiles.push_back(filename);
+
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::string value;
+        std::istringstream tokenizer(line);
+        while (std::getline(tokenizer, value, ',')) {
+            try {
+                array.push_back(std::stof(value));
+            } catch (const std::invalid_argument& e) {
+                // skip
+            }
+        }
     }
     
 }
 
+// loads a texture through gdev.h and remembers the file for the cubemap cache key
+GLuint loadSceneTexture(const char* filename, int wrapMode, bool filter, bool generateMipmaps) {
+    CPU_SCOPE("gdevLoadTexture", filename);
+    sceneAssetFiles.push_back(filename);
+    return gdevLoadTexture(filename, wrapMode, filter, generateMipmaps);
+}
+
 void setupLights() {
     for (const auto &light : lights) {
         switch (light->type) {
@@ -566,6 +3618,8 @@ bool setupShadowMaps()
 
     directionalLightTransforms.resize(numDir);
     spotLightTransforms.resize(numSpot);
+    directionalShadowCaches.assign(numDir, ShadowCache());
+    spotShadowCaches.assign(numSpot, ShadowCache());
 
     // directional shadow array 
     glGenFramebuffers(1, &directionalShadowFbo);
@@ -618,121 +3672,59 @@ bool setupShadowMaps()
         return false;
     }
 
-    shadowMapShader = gdevLoadShader("Finals-Shader-Shadow.vs", "Finals-Shader-Shadow.fs");
+    shadowMapShader = loadShader("Finals-Shader-Shadow.vs", "Finals-Shader-Shadow.fs");
     if (!shadowMapShader)
         return false;
 
+    // only the depth prepass moves this away from identity
+    glUseProgram(shadowMapShader);
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(glm::mat4(1.0f)));
+
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     return true;
 }
 
+// everything that casts shadows, for the shadow map passes (modelTransform is identity)
 void drawSceneGeometry() {
-    // Floor Mesh
-    glBindVertexArray(vaos[0]);
-    glDrawArrays(GL_TRIANGLES, 0, FloorMesh.size() / 11);
-    
-    // Bricks Parallax
-    glBindVertexArray(vaos[1]);
-    glDrawArrays(GL_TRIANGLES, 0, BricksParallax.size() / 11);
-
-    // Lower Building
-    glBindVertexArray(vaos[3]);
-    glDrawArrays(GL_TRIANGLES, 0, LowerBuilding.size() / 11);
-
-    // Lower Window
-    glBindVertexArray(vaos[4]);
-    glDrawArrays(GL_TRIANGLES, 0, LowerWindow.size() / 11);
-
-    // Higher Building
-    glBindVertexArray(vaos[5]);
-    glDrawArrays(GL_TRIANGLES, 0, HigherBuilding.size() / 11);
-
-    // Higher Window
-    glBindVertexArray(vaos[6]);
-    glDrawArrays(GL_TRIANGLES, 0, HigherWindow.size() / 11);
-
-    glBindVertexArray(vaos[8]);
-    glDrawArrays(GL_TRIANGLES, 0, TreeBark.size() / 11);
-
-    glBindVertexArray(vaos[10]);
-    glDrawArrays(GL_TRIANGLES, 0, MirrorPlane.size() / 11);
-
-    glBindVertexArray(vaos[11]);
-    glDrawArrays(GL_TRIANGLES, 0, SideStation.size() / 11);
-
-    glBindVertexArray(vaos[12]);
-    glDrawArrays(GL_TRIANGLES, 0, Office.size() / 11);
-
-    glBindVertexArray(vaos[13]);
-    glDrawArrays(GL_TRIANGLES, 0, BusStation.size() / 11);
-
-    glBindVertexArray(vaos[14]);
-    glDrawArrays(GL_TRIANGLES, 0, Miscellaneous.size() / 11);
-
-    glBindVertexArray(vaos[15]);
-    glDrawArrays(GL_TRIANGLES, 0, Water.size() / 11);
-
-    glBindVertexArray(vaos[16]);
-    glDrawArrays(GL_TRIANGLES, 0, TrainStation.size() / 11);
-
-    glBindVertexArray(vaos[17]);
-    glDrawArrays(GL_TRIANGLES, 0, TrainCart.size() / 11);
-
-    glBindVertexArray(vaos[18]);
-    glDrawArrays(GL_TRIANGLES, 0, LampPost.size() / 11);
-
-    glBindVertexArray(vaos[19]);
-    glDrawArrays(GL_TRIANGLES, 0, LampBulb.size() / 11);
+    GLint modelLocation = glGetUniformLocation(shadowMapShader, "modelTransform");
+    for (int mesh : { 0, 1, 3, 4, 5, 6, 8, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 })
+        drawSceneMesh(modelLocation, glm::mat4(1.0f), mesh);
 }
 
-void renderDirectionalShadows(int index, Light& light) {
-    // use the shadow framebuffer for drawing the shadow map
-    glBindFramebuffer(GL_FRAMEBUFFER, directionalShadowFbo);
-
-    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                              directionalShadowArray, 0, index);
-
-    // the viewport should be the size of the shadow map
-    glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
-
-    // clear the shadow map
-    // (we don't have a color buffer attachment, so no need to clear that)
-    glClear(GL_DEPTH_BUFFER_BIT);
-
-    // using the shadow map shader...
-    glUseProgram(shadowMapShader);
-
-    // ... set up the light space matrix... FOR DIRECTIONAL LIGHTS
+// the light space matrix of a directional light
+glm::mat4 directionalLightTransform(Light& light) {
     float bounds = 45.0f;
+    return glm::ortho(-bounds, bounds, -bounds, bounds, 0.1f, 100.0f) * 
+           glm::lookAt(light.getPosition(),           // light position
+                       glm::vec3(0.0f, 0.0f, 0.0f),   // scene center
+                       glm::vec3(0.0f, 1.0f, 0.0f));  // up vector
+}
+
+// the light space matrix of a spotlight
+glm::mat4 spotLightTransform(Light& light) {
     glm::mat4 lightTransform;
-    lightTransform = glm::ortho(-bounds, bounds, -bounds, bounds, 0.1f, 100.0f) * 
-                    glm::lookAt(light.getPosition(),           // light position
-                                glm::vec3(0.0f, 0.0f, 0.0f),   // scene center
+    lightTransform = glm::perspective(glm::radians(light.outer_cutoff * 2.0f),       // fov
+                                1.0f,                      // aspect ratio
+                                0.1f,                      // near plane
+                                100.0f);                   // far plane
+    lightTransform *= glm::lookAt(light.getPosition(),                 // eye position
+                                light.getPosition() + light.getDirection(),   // center position
                                 glm::vec3(0.0f, 1.0f, 0.0f));  // up vector
-
-    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "lightTransform"),
-                       1, GL_FALSE, glm::value_ptr(lightTransform));
-
-    // ... set up the model matrix... (just identity for this demo)
-    glm::mat4 modelTransform = glm::mat4(1.0f);
-    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "modelTransform"),
-                       1, GL_FALSE, glm::value_ptr(modelTransform));
-
-    drawSceneGeometry();
-
-    // set the framebuffer back to the default onscreen buffer
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    directionalLightTransforms[index] = lightTransform;
-
+    return lightTransform;
 }
 
-void renderSpotShadows(int index, Light& light) {
+// draws the shadow map of layer index of fbo/array from lightTransform, unless the layer
+// still holds exactly that (see ShadowCache)
+void renderShadowLayer(GLuint fbo, GLuint array, int index, const glm::mat4& lightTransform, ShadowCache& cache) {
+    if (cache.valid && cache.lightTransform == lightTransform)
+        return;
+    cache.lightTransform = lightTransform;
+    cache.valid = true;
+
     // use the shadow framebuffer for drawing the shadow map
-    glBindFramebuffer(GL_FRAMEBUFFER, spotShadowFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 
-    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                              spotShadowArray, 0, index);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, array, 0, index);
 
     // the viewport should be the size of the shadow map
     glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
@@ -744,20 +3736,11 @@ void renderSpotShadows(int index, Light& light) {
     // using the shadow map shader...
     glUseProgram(shadowMapShader);
 
-    // ... set up the light space matrix... FOR SPOTLIGHTS
-    glm::mat4 lightTransform;
-    lightTransform = glm::perspective(glm::radians(light.outer_cutoff * 2.0f),       // fov
-                                1.0f,                      // aspect ratio
-                                0.1f,                      // near plane
-                                100.0f);                   // far plane
-    lightTransform *= glm::lookAt(light.getPosition(),                 // eye position
-                                light.getPosition() + light.getDirection(),   // center position
-                                glm::vec3(0.0f, 1.0f, 0.0f));  // up vector
-
+    // ... set up the light space matrix...
     glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "lightTransform"),
                        1, GL_FALSE, glm::value_ptr(lightTransform));
 
-    // ... set up the model matrix... (just identity for this demo)
+    // ... set up the model matrix... (identity; the scene graph sets it for the nodes that moved)
     glm::mat4 modelTransform = glm::mat4(1.0f);
     glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "modelTransform"),
                        1, GL_FALSE, glm::value_ptr(modelTransform));
@@ -766,8 +3749,16 @@ void renderSpotShadows(int index, Light& light) {
 
     // set the framebuffer back to the default onscreen buffer
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void renderDirectionalShadows(int index, Light& light) {
+    directionalLightTransforms[index] = directionalLightTransform(light);
+    renderShadowLayer(directionalShadowFbo, directionalShadowArray, index, directionalLightTransforms[index], directionalShadowCaches[index]);
+}
 
-    spotLightTransforms[index] = lightTransform;
+void renderSpotShadows(int index, Light& light) {
+    spotLightTransforms[index] = spotLightTransform(light);
+    renderShadowLayer(spotShadowFbo, spotShadowArray, index, spotLightTransforms[index], spotShadowCaches[index]);
 }
 
 float randomFloat(float min, float max) {
@@ -826,7 +3817,7 @@ void createTexture(int windowSize, int filterSize, const std::vector<float>& dat
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glBindTexture(GL_TEXTURE_3D, 0);
-
+    offsetTextureData = data;
 }
 
 void setupPCF() {
@@ -883,96 +3874,155 @@ bool setupCubemap() {
             return false;
         }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    return true;
+    
+}
+
+// the Lights uniform block of Finals-Shader.fs in std140 layout: every vec3 starts a new
+// 16 bytes, which a following float can share, and struct sizes round up to 16
+#define LIGHT_BLOCK_BINDING 0
+#define MAX_POINT_LIGHTS 16
+
+struct DirLightStd140 {
+    glm::vec3 direction; float pad0;
+    glm::vec3 ambient;   float pad1;
+    glm::vec3 diffuse;   float pad2;
+    glm::vec3 specular;  float pad3;
+    glm::vec3 color;     float specular_exponent;
+};
+
+struct SpotLightStd140 {
+    glm::vec3 position;  float pad0;
+    glm::vec3 direction; float innerCutoff;
+    float outerCutoff, constant, linear, quadratic;
+    glm::vec3 ambient;   float pad1;
+    glm::vec3 diffuse;   float pad2;
+    glm::vec3 specular;  float pad3;
+    glm::vec3 color;     float specular_exponent;
+};
+
+struct PointLightStd140 {
+    glm::vec3 position;  float pad0;
+    glm::vec3 ambient;   float pad1;
+    glm::vec3 diffuse;   float pad2;
+    glm::vec3 specular;  float pad3;
+    glm::vec3 color;     float specular_exponent;
+    float constant, linear, quadratic, pad4;
+};
+
+struct LightBlock {
+    DirLightStd140 dir_lights[1];
+    SpotLightStd140 spotlights[2];
+    PointLightStd140 pointLights[MAX_POINT_LIGHTS];
+    int numPointLights;
+    int pad[3]; // the block rounds up to 16 too, and the bound range has to cover all of it
+};
+static_assert(sizeof(DirLightStd140) == 80 && sizeof(SpotLightStd140) == 112 && sizeof(PointLightStd140) == 96,
+              "light structs must match std140");
+static_assert(sizeof(LightBlock) % 16 == 0, "LightBlock must be padded to 16 like the std140 block");
+
+bool setupLightBlock() {
+    GLuint index = glGetUniformBlockIndex(shader, "Lights");
+    GLint size = 0;
+    if (index != GL_INVALID_INDEX)
+        glGetActiveUniformBlockiv(shader, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+    if (size != (GLint)sizeof(LightBlock)) {
+        std::cout << "Lights uniform block does not match LightBlock (" << size << " bytes)\n";
+        return false;
     }
+    glUniformBlockBinding(shader, index, LIGHT_BLOCK_BINDING);
     return true;
-    
 }
 
-void uploadLightUniforms(const glm::mat4& viewMatrix) {
+// lights go to the shader in view space, so there is one block per view
+void packLightBlock(const glm::mat4& viewMatrix, LightBlock& block) {
+    block = {};
     int spotlightCount = 0;
     int pointLightCount = 0;
     for (const auto& light : lights) {
         switch (light->type) {
             case Light::DIRECTIONAL: {
-                glm::vec3 viewDir = glm::mat3(viewMatrix) * light->getDirection();
-                glUniform3fv(glGetUniformLocation(shader, "dir_lights[0].direction"),
-                             1, glm::value_ptr(viewDir));
-                glUniform3fv(glGetUniformLocation(shader, "dir_lights[0].ambient"),
-                             1, glm::value_ptr(light->ambient));
-                glUniform3fv(glGetUniformLocation(shader, "dir_lights[0].diffuse"),
-                             1, glm::value_ptr(light->diffuse));
-                glUniform3fv(glGetUniformLocation(shader, "dir_lights[0].specular"),
-                             1, glm::value_ptr(light->specular));
-                glUniform3fv(glGetUniformLocation(shader, "dir_lights[0].color"),
-                             1, glm::value_ptr(light->color));
-                glUniform1f(glGetUniformLocation(shader, "dir_lights[0].specular_exponent"),
-                            light->specular_exponent);
+                DirLightStd140& l = block.dir_lights[0];
+                l.direction = glm::mat3(viewMatrix) * light->getDirection();
+                l.ambient = light->ambient;
+                l.diffuse = light->diffuse;
+                l.specular = light->specular;
+                l.color = light->color;
+                l.specular_exponent = light->specular_exponent;
                 break;
             }
             case Light::SPOTLIGHT: {
-                std::string base = "spotlights[" + std::to_string(spotlightCount) + "].";
-                spotlightCount++;
-
-                glm::vec3 posView = glm::vec3(viewMatrix * glm::vec4(light->getPosition(), 1.0f));
-                glUniform3fv(glGetUniformLocation(shader, (base + "position").c_str()),
-                             1, glm::value_ptr(posView));
-
-                glm::vec3 dirView = glm::mat3(viewMatrix) * light->getDirection();
-                glUniform3fv(glGetUniformLocation(shader, (base + "direction").c_str()),
-                             1, glm::value_ptr(dirView));
-
-                glUniform1f(glGetUniformLocation(shader, (base + "innerCutoff").c_str()),
-                            glm::cos(glm::radians(light->inner_cutoff)));
-                glUniform1f(glGetUniformLocation(shader, (base + "outerCutoff").c_str()),
-                            glm::cos(glm::radians(light->outer_cutoff)));
-                glUniform1f(glGetUniformLocation(shader, (base + "constant").c_str()),  light->constant);
-                glUniform1f(glGetUniformLocation(shader, (base + "linear").c_str()),    light->linear);
-                glUniform1f(glGetUniformLocation(shader, (base + "quadratic").c_str()), light->quadratic);
-                glUniform3fv(glGetUniformLocation(shader, (base + "ambient").c_str()),
-                             1, glm::value_ptr(light->ambient));
-                glUniform3fv(glGetUniformLocation(shader, (base + "diffuse").c_str()),
-                             1, glm::value_ptr(light->diffuse));
-                glUniform3fv(glGetUniformLocation(shader, (base + "specular").c_str()),
-                             1, glm::value_ptr(light->specular));
-                glUniform3fv(glGetUniformLocation(shader, (base + "color").c_str()),
-                             1, glm::value_ptr(light->color));
-                glUniform1f(glGetUniformLocation(shader, (base + "specular_exponent").c_str()),
-                            light->specular_exponent);
+                SpotLightStd140& l = block.spotlights[spotlightCount++];
+                l.position = glm::vec3(viewMatrix * glm::vec4(light->getPosition(), 1.0f));
+                l.direction = glm::mat3(viewMatrix) * light->getDirection();
+                l.innerCutoff = glm::cos(glm::radians(light->inner_cutoff));
+                l.outerCutoff = glm::cos(glm::radians(light->outer_cutoff));
+                l.constant = light->constant;
+                l.linear = light->linear;
+                l.quadratic = light->quadratic;
+                l.ambient = light->ambient;
+                l.diffuse = light->diffuse;
+                l.specular = light->specular;
+                l.color = light->color;
+                l.specular_exponent = light->specular_exponent;
                 break;
             }
             case Light::POINT: {
-                std::string base = "pointLights[" + std::to_string(pointLightCount) + "].";
-
-                glm::vec3 posView = glm::vec3(viewMatrix * glm::vec4(light->getPosition(), 1.0f));
-                glUniform3fv(glGetUniformLocation(shader, (base + "position").c_str()),
-                            1, glm::value_ptr(posView));
-                glUniform3fv(glGetUniformLocation(shader, (base + "ambient").c_str()),
-                            1, glm::value_ptr(light->ambient));
-                glUniform3fv(glGetUniformLocation(shader, (base + "diffuse").c_str()),
-                            1, glm::value_ptr(light->diffuse));
-                glUniform3fv(glGetUniformLocation(shader, (base + "specular").c_str()),
-                            1, glm::value_ptr(light->specular));
-                glUniform3fv(glGetUniformLocation(shader, (base + "color").c_str()),
-                            1, glm::value_ptr(light->color));
-                glUniform1f(glGetUniformLocation(shader, (base + "specular_exponent").c_str()),
-                            light->specular_exponent);
-                glUniform1f(glGetUniformLocation(shader, (base + "constant").c_str()),
-                            light->constant);
-                glUniform1f(glGetUniformLocation(shader, (base + "linear").c_str()),
-                            light->linear);
-                glUniform1f(glGetUniformLocation(shader, (base + "quadratic").c_str()),
-                            light->quadratic);
-
-                pointLightCount++;
+                if (pointLightCount == MAX_POINT_LIGHTS) break;
+                PointLightStd140& l = block.pointLights[pointLightCount++];
+                l.position = glm::vec3(viewMatrix * glm::vec4(light->getPosition(), 1.0f));
+                l.ambient = light->ambient;
+                l.diffuse = light->diffuse;
+                l.specular = light->specular;
+                l.color = light->color;
+                l.specular_exponent = light->specular_exponent;
+                l.constant = light->constant;
+                l.linear = light->linear;
+                l.quadratic = light->quadratic;
                 break;
             }
             default: break;
         }
     }
-    glUniform1i(glGetUniformLocation(shader, "numPointLights"), pointLightCount); // for point lights
+    block.numPointLights = pointLightCount; // for point lights
+}
+
+void uploadLightBlock(const LightBlock& block) {
+    GLintptr offset = streamUpload(&block, sizeof(block), streamBuffer.uniformAlignment);
+    glBindBufferRange(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, streamBuffer.buffer, offset, sizeof(block));
+}
+
+void uploadLightUniforms(const glm::mat4& viewMatrix) {
+    CPU_SCOPE("uploadLightUniforms");
+    LightBlock block;
+    packLightBlock(viewMatrix, block);
+    uploadLightBlock(block);
 }
 
+// what the probes see: everything static except the tree leaves
+struct CubemapDrawable { int mesh, texture; };
+const CubemapDrawable cubemapDrawables[] = {
+    { 0, 0 },   // floor
+    { 1, 2 },   // bricks
+    { 3, 5 },   // lower building
+    { 8, 9 },   // tree bark
+    { 10, 6 },  // mirror (temp/black pic)
+    { 11, 11 }, // side station
+    { 12, 12 }, // office
+    { 13, 14 }, // bus station
+    { 14, 16 }, // miscellaneous
+    { 15, 18 }, // water
+    { 16, 19 }, // train station
+    { 17, 22 }, // train cart
+    { 18, 25 }, // lamp post
+    { 19, 26 }, // lamp bulb
+    { 5, 5 },   // higher building
+    { 4, 6 },   // lower windows (window diffuse)
+    { 6, 6 },   // higher windows
+};
+
 void renderCubemap(int cubemapIndex) {
     glEnable(GL_DEPTH_TEST);
     glDisable(GL_CULL_FACE); // needed so floor renders from below
@@ -1033,6 +4083,7 @@ void renderCubemap(int cubemapIndex) {
     }
 
     for (int i = 0; i < 6; i++) {
+        GPU_SCOPE("cubemap " + std::to_string(cubemapIndex) + " face " + std::to_string(i));
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
                                cubemapTexture[cubemapIndex], 0);
@@ -1046,113 +4097,269 @@ void renderCubemap(int cubemapIndex) {
                            1, GL_FALSE, glm::value_ptr(faceView));
 
         glm::mat4 identityModel = glm::mat4(1.0f);
-        glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
-                           1, GL_FALSE, glm::value_ptr(identityModel));
-
-        uploadLightUniforms(faceView);
+        GLint modelLocation = glGetUniformLocation(shader, "modelTransform");
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(identityModel));
+
+        // the fireflies move, so the probes only see the static lights
+        LightBlock block;
+        packLightBlock(faceView, block);
+        block.numPointLights = 0;
+        uploadLightBlock(block);
+
+        // hidden meshes are left out when occlusion culling is on; the probes sit in the
+        // open, so the buildings hide most of the far side of the scene from them
+        glm::mat4 faceToClip = captureProjection * faceView;
+        bool softwareOcclusion = occlusionMode != OCCLUSION_OFF;
+        if (softwareOcclusion)
+            rasterizeOccluders(faceToClip);
 
-        // Floor
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[0]);
-        glBindVertexArray(vaos[0]);
-        glDrawArrays(GL_TRIANGLES, 0, FloorMesh.size() / 11);
-
-        // Bricks
-        glBindTexture(GL_TEXTURE_2D, texture[2]);
-        glBindVertexArray(vaos[1]);
-        glDrawArrays(GL_TRIANGLES, 0, BricksParallax.size() / 11);
-
-        // Lower Building
-        glBindTexture(GL_TEXTURE_2D, texture[5]);
-        glBindVertexArray(vaos[3]);
-        glDrawArrays(GL_TRIANGLES, 0, LowerBuilding.size() / 11);
-
-        // Tree Bark
-        glBindTexture(GL_TEXTURE_2D, texture[9]);
-        glBindVertexArray(vaos[8]);
-        glDrawArrays(GL_TRIANGLES, 0, TreeBark.size() / 11);
-
-        // Mirror
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[6]); // Temp/black Pic
-        glBindVertexArray(vaos[10]);
-        glDrawArrays(GL_TRIANGLES, 0, MirrorPlane.size() / 11);
+        for (const CubemapDrawable& drawable : cubemapDrawables) {
+            if (softwareOcclusion && !aabbVisibleToOccluders(meshBounds[drawable.mesh], faceToClip))
+                continue;
+            glBindTexture(GL_TEXTURE_2D, texture[drawable.texture]);
+            drawSceneMesh(modelLocation, identityModel, drawable.mesh);
+        }
+    }
 
-        // Side Station
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[11]);
-        glBindVertexArray(vaos[11]);
-        glDrawArrays(GL_TRIANGLES, 0, SideStation.size() / 11);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glEnable(GL_CULL_FACE); // restore
+}
 
-        // Office
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[12]);
-        glBindVertexArray(vaos[12]);
-        glDrawArrays(GL_TRIANGLES, 0, Office.size() / 11);
+/*------------------CUBEMAP CACHE--------------------*/
 
-        // Bus Station
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[14]);
-        glBindVertexArray(vaos[13]);
-        glDrawArrays(GL_TRIANGLES, 0, BusStation.size() / 11);
+struct CubemapCacheHeader {
+    char magic[8];          // "GDEVCUBE"
+    uint32_t version;
+    uint32_t size;          // edge length of mip 0
+    uint32_t levels;
+    uint32_t reserved;
+    uint64_t hash;          // scene + probe key, see cubemapCacheKey()
+};
 
-        // Miscellaneous
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[16]);
-        glBindVertexArray(vaos[14]);
-        glDrawArrays(GL_TRIANGLES, 0, Miscellaneous.size() / 11);
+int cubemapMipLevels() {
+    int levels = 1;
+    for (int s = CUBEMAP_SIZE; s > 1; s /= 2) levels++;
+    return levels;
+}
 
-        // Water
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[18]);
-        glBindVertexArray(vaos[15]);
-        glDrawArrays(GL_TRIANGLES, 0, Water.size() / 11);
+// FNV-1a, good enough for change detection
+void hashBytes(uint64_t& hash, const void* bytes, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(bytes);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+}
 
-        // Train Station
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[19]);
-        glBindVertexArray(vaos[16]);
-        glDrawArrays(GL_TRIANGLES, 0, TrainStation.size() / 11);
+template <typename T>
+void hashValue(uint64_t& hash, const T& value) {
+    hashBytes(hash, &value, sizeof(T));
+}
 
-        // Train Cart
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[22]);
-        glBindVertexArray(vaos[17]);
-        glDrawArrays(GL_TRIANGLES, 0, TrainCart.size() / 11);
+// hashes a file by name, size and modification time (re-reading the contents
+// of every asset would cost about as much as the capture we are trying to skip)
+void hashFileStamp(uint64_t& hash, const std::string& filename) {
+    hashBytes(hash, filename.data(), filename.size());
 
-        // Lamp Post
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[25]);
-        glBindVertexArray(vaos[18]);
-        glDrawArrays(GL_TRIANGLES, 0, LampPost.size() / 11);
+    std::error_code ec;
+    uintmax_t size = std::filesystem::file_size(filename, ec);
+    if (ec) size = 0;
+    hashValue(hash, size);
 
-        // Lamp Bulb
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[26]);
-        glBindVertexArray(vaos[19]);
-        glDrawArrays(GL_TRIANGLES, 0, LampBulb.size() / 11);
+    auto stamp = std::filesystem::last_write_time(filename, ec);
+    long long ticks = ec ? 0 : (long long)stamp.time_since_epoch().count();
+    hashValue(hash, ticks);
+}
 
-        // Higher Building
-        glBindTexture(GL_TEXTURE_2D, texture[5]);
-        glBindVertexArray(vaos[5]);
-        glDrawArrays(GL_TRIANGLES, 0, HigherBuilding.size() / 11);
+// the captures only depend on static geometry, textures, shaders, the static
+// lights, the PCF offsets and the probe itself; renderCubemap() leaves the fireflies out
+uint64_t cubemapCacheKey(int cubemapIndex) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    int version = CUBEMAP_CACHE_VERSION;
+    int size = CUBEMAP_SIZE;
+    hashValue(hash, version);
+    hashValue(hash, size);
+    hashValue(hash, cubemapCapturePos[cubemapIndex]);
+
+    for (const std::string& file : sceneAssetFiles)
+        hashFileStamp(hash, file);
+    hashFileStamp(hash, "Finals-Shader.vs");
+    hashFileStamp(hash, "Finals-Shader.fs");
+
+    for (const auto* light : lights) {
+        if (light->type == Light::POINT) continue;
+        hashValue(hash, light->type);
+        hashValue(hash, light->cam.position);
+        hashValue(hash, light->cam.front);
+        hashValue(hash, light->ambient);
+        hashValue(hash, light->diffuse);
+        hashValue(hash, light->specular);
+        hashValue(hash, light->color);
+        hashValue(hash, light->specular_exponent);
+        hashValue(hash, light->inner_cutoff);
+        hashValue(hash, light->outer_cutoff);
+    }
 
-        // lower windows
-        glBindTexture(GL_TEXTURE_2D, texture[6]); // window diffuse lol
-        glBindVertexArray(vaos[4]);
-        glDrawArrays(GL_TRIANGLES, 0, LowerWindow.size() / 11);
+    hashValue(hash, enableShadows);
+    hashValue(hash, pcfRadius);
+    hashValue(hash, pcfFilterSize);
+    hashBytes(hash, offsetTextureData.data(), offsetTextureData.size() * sizeof(float));
+    return hash;
+}
 
-        // higher windows
-        glBindVertexArray(vaos[6]);
-        glDrawArrays(GL_TRIANGLES, 0, HigherWindow.size() / 11);
+// uploads a previously saved cubemap; returns false if the file is missing or stale
+bool loadCubemapCache(int cubemapIndex, uint64_t key) {
+    std::ifstream file(cubemapCacheFiles[cubemapIndex], std::ios::binary);
+    if (!file) return false;
+
+    CubemapCacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (std::string(header.magic, 8) != "GDEVCUBE" || header.version != CUBEMAP_CACHE_VERSION
+        || header.size != CUBEMAP_SIZE || header.levels != (uint32_t)cubemapMipLevels()
+        || header.hash != key)
+        return false;
+
+    // read everything first so a truncated file leaves the texture untouched
+    size_t total = 0;
+    for (int level = 0; level < (int)header.levels; level++) {
+        size_t s = CUBEMAP_SIZE >> level;
+        total += 6 * s * s * 3;
+    }
+    std::vector<unsigned char> pixels(total);
+    if (!file.read(reinterpret_cast<char*>(pixels.data()), total)) return false;
+
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[cubemapIndex]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    size_t offset = 0;
+    for (int level = 0; level < (int)header.levels; level++) {
+        int s = CUBEMAP_SIZE >> level;
+        for (int face = 0; face < 6; face++) {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB,
+                         s, s, 0, GL_RGB, GL_UNSIGNED_BYTE, &pixels[offset]);
+            offset += (size_t)s * s * 3;
+        }
+    }
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, header.levels - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    return true;
+}
+
+// builds the mip chain of a freshly captured cubemap
+void buildCubemapMips(int cubemapIndex) {
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[cubemapIndex]);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, cubemapMipLevels() - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+}
+
+// builds the mip chain of a freshly captured cubemap, reads every face back
+// through a pixel pack buffer and writes it to disk
+void saveCubemapCache(int cubemapIndex, uint64_t key) {
+    int levels = cubemapMipLevels();
+    buildCubemapMips(cubemapIndex);
+
+    size_t total = 0;
+    for (int level = 0; level < levels; level++) {
+        size_t s = CUBEMAP_SIZE >> level;
+        total += 6 * s * s * 3;
     }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glEnable(GL_CULL_FACE); // restore
+    // queue every face/level into one PBO, then map it once
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, total, NULL, GL_STREAM_READ);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    size_t offset = 0;
+    for (int level = 0; level < levels; level++) {
+        int s = CUBEMAP_SIZE >> level;
+        for (int face = 0; face < 6; face++) {
+            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB,
+                          GL_UNSIGNED_BYTE, (void*)offset);
+            offset += (size_t)s * s * 3;
+        }
+    }
+
+    const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, total, GL_MAP_READ_BIT);
+    if (pixels) {
+        std::ofstream file(cubemapCacheFiles[cubemapIndex], std::ios::binary);
+        CubemapCacheHeader header = { {'G','D','E','V','C','U','B','E'}, CUBEMAP_CACHE_VERSION,
+                                      CUBEMAP_SIZE, (uint32_t)levels, 0, key };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(static_cast<const char*>(pixels), total);
+        if (!file)
+            std::cout << "Could not write cubemap cache '" << cubemapCacheFiles[cubemapIndex] << "'\n";
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteBuffers(1, &pbo);
 }
 
-bool setupBloom() {
-    int w = WINDOW_WIDTH, h = WINDOW_HEIGHT;
+// loads both environment maps from disk, only capturing the ones that are stale
+void bakeCubemaps() {
+    bool shadowsReady = false;
+    for (int c = 0; c < 2; c++) {
+        uint64_t key = cubemapCacheKey(c);
+        if (loadCubemapCache(c, key)) {
+            std::cout << "Loaded cubemap " << c << " from '" << cubemapCacheFiles[c] << "'\n";
+            continue;
+        }
+
+        // live capture fallback; the captures sample the shadow maps
+        if (!shadowsReady) {
+            int dirIdx = 0, spotIdx = 0;
+            for (auto* light : lights) {
+                if (light->type == Light::DIRECTIONAL) renderDirectionalShadows(dirIdx++, *light);
+                else if (light->type == Light::SPOTLIGHT) renderSpotShadows(spotIdx++, *light);
+            }
+            shadowsReady = true;
+        }
+        renderCubemap(c);
+        saveCubemapCache(c, key);
+        std::cout << "Captured cubemap " << c << " and saved it to '" << cubemapCacheFiles[c] << "'\n";
+    }
+}
+
+// recaptures a probe the scene graph flagged (see invalidateSceneCaches()), one every
+// PROBE_REFRESH_FRAMES frames at most, from the shadow maps of the frame before; these stay
+// off the disk cache, which holds the scene as exported
+void refreshStaleCubemaps() {
+    if (probeRefreshCooldown > 0) {
+        probeRefreshCooldown--;
+        return;
+    }
+    // round robin, so one probe that keeps going stale does not starve the other
+    for (int i = 1; i <= 2; i++) {
+        int c = (probeRefreshLast + i) % 2;
+        if (!cubemapStale[c])
+            continue;
+        GPU_SCOPE("probe refresh");
+        renderCubemap(c);
+        buildCubemapMips(c);
+        cubemapStale[c] = false;
+        probeRefreshCooldown = PROBE_REFRESH_FRAMES;
+        probeRefreshLast = c;
+        return;
+    }
+}
+
+/*---------------------------------------------------*/
+
+// (re)creates the HDR scene target and the bloom mip chain at the current render resolution
+bool setupRenderTargets() {
+    if (hdrFbo) {
+        glDeleteFramebuffers(1, &hdrFbo);
+        glDeleteTextures(1, &hdrColorTexture);
+        glDeleteRenderbuffers(1, &hdrDepthRbo);
+        glDeleteFramebuffers(BLOOM_MIPS, bloomMipFbos);
+        glDeleteTextures(BLOOM_MIPS, bloomMipTextures);
+    }
+
+    int w = renderWidth, h = renderHeight;
 
     glGenFramebuffers(1, &hdrFbo);
     glBindFramebuffer(GL_FRAMEBUFFER, hdrFbo);
@@ -1179,31 +4386,39 @@ bool setupBloom() {
         return false;
     }
 
-    // ping-pong framebuffers for blur
-    GLuint pingpongFbos[2] = {pingFbo, pongFbo};
-    GLuint pingpongTextures[2] = {pingTexture, pongTexture};
-    glGenFramebuffers(2, pingpongFbos);
-    glGenTextures(2, pingpongTextures);
-    pingFbo = pingpongFbos[0]; pongFbo = pingpongFbos[1];
-    pingTexture = pingpongTextures[0]; pongTexture = pingpongTextures[1];
+    // bloom mip chain, each level half the size of the one above it
+    w /= 2; h /= 2;
+    glGenFramebuffers(BLOOM_MIPS, bloomMipFbos);
+    glGenTextures(BLOOM_MIPS, bloomMipTextures);
+    for (int i = 0; i < BLOOM_MIPS; i++) {
+        bloomMipWidths[i] = w = std::max(w, 1);
+        bloomMipHeights[i] = h = std::max(h, 1);
 
-    for (int i = 0; i < 2; i++) {
-        glBindFramebuffer(GL_FRAMEBUFFER, pingpongFbos[i]);
-        glBindTexture(GL_TEXTURE_2D, pingpongTextures[i]);
+        glBindFramebuffer(GL_FRAMEBUFFER, bloomMipFbos[i]);
+        glBindTexture(GL_TEXTURE_2D, bloomMipTextures[i]);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, w, h, 0, GL_RGB, GL_FLOAT, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                               GL_TEXTURE_2D, pingpongTextures[i], 0);
+                               GL_TEXTURE_2D, bloomMipTextures[i], 0);
 
         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-            std::cout << "Ping-pong framebuffer " << i << " incomplete.\n";
+            std::cout << "Bloom mip framebuffer " << i << " incomplete.\n";
             return false;
         }
+        w /= 2; h /= 2;
     }
 
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return true;
+}
+
+bool setupBloom() {
+    if (!setupRenderTargets())
+        return false;
+
     float quadVertices[] = {
         -1.0f,  1.0f,  0.0f, 1.0f,
         -1.0f, -1.0f,  0.0f, 0.0f,
@@ -1224,18 +4439,18 @@ bool setupBloom() {
     glEnableVertexAttribArray(1);
     glBindVertexArray(0);
 
-    bloomThresholdShader = gdevLoadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Threshold.fs");
-    bloomBlurShader = gdevLoadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Blur.fs");
-    bloomCompositeShader = gdevLoadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Composite.fs");
+    bloomDownsampleShader = loadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Downsample.fs");
+    bloomUpsampleShader = loadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Upsample.fs");
+    bloomCompositeShader = loadShader("Finals-Bloom-Shader.vs", "Finals-Bloom-Composite.fs");
 
-    if (!bloomThresholdShader || !bloomBlurShader || !bloomCompositeShader)
+    if (!bloomDownsampleShader || !bloomUpsampleShader || !bloomCompositeShader)
         return false;
 
-    glUseProgram(bloomThresholdShader);
-    glUniform1i(glGetUniformLocation(bloomThresholdShader, "hdrScene"), 0);
+    glUseProgram(bloomDownsampleShader);
+    glUniform1i(glGetUniformLocation(bloomDownsampleShader, "image"), 0);
 
-    glUseProgram(bloomBlurShader);
-    glUniform1i(glGetUniformLocation(bloomBlurShader, "image"), 0);
+    glUseProgram(bloomUpsampleShader);
+    glUniform1i(glGetUniformLocation(bloomUpsampleShader, "image"), 0);
 
     glUseProgram(bloomCompositeShader);
     glUniform1i(glGetUniformLocation(bloomCompositeShader, "hdrScene"),  0);
@@ -1245,17 +4460,354 @@ bool setupBloom() {
     return true;
 }
 
+// (re)creates the offscreen reflection target at the current reflection scale
+bool setupReflection() {
+    if (reflectionFbo) {
+        glDeleteFramebuffers(1, &reflectionFbo);
+        glDeleteTextures(1, &reflectionTexture);
+        glDeleteRenderbuffers(1, &reflectionDepthRbo);
+    }
+
+    float scale = reflectionScales[reflectionScaleIndex];
+    reflectionWidth = std::max(1, (int)(renderWidth * scale));
+    reflectionHeight = std::max(1, (int)(renderHeight * scale));
+
+    glGenFramebuffers(1, &reflectionFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, reflectionFbo);
+
+    glGenTextures(1, &reflectionTexture);
+    glBindTexture(GL_TEXTURE_2D, reflectionTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, reflectionWidth, reflectionHeight, 0, GL_RGB, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, reflectionTexture, 0);
+
+    glGenRenderbuffers(1, &reflectionDepthRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, reflectionDepthRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, reflectionWidth, reflectionHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, reflectionDepthRbo);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "Reflection framebuffer incomplete.\n";
+        return false;
+    }
+
+    // clear once so a skipped first pass does not show garbage
+    glClearColor(0.04f, 0.05f, 0.08f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (!mirrorQuery)
+        glGenQueries(1, &mirrorQuery);
+    return true;
+}
+
+/*------------------OCCLUSION CULLING--------------------*/
+
+// in the main view, every static mesh in the frustum has an occlusion query on its bounding
+// box, tested against the depth of the meshes drawn this frame and read back a frame or more
+// later without waiting. Until a result is back the mesh is drawn under conditional render,
+// so the GPU still skips it if the box was hidden; hidden meshes are queried every frame to
+// reappear quickly, and meshes that keep being visible are queried less and less often
+#define OCCLUSION_MAX_REQUERY_FRAMES 15
+#define OCCLUSION_BOX_MARGIN 0.05f // keeps the box in front of walls lying on its faces
+
+enum OcclusionDecision { OCCLUSION_DRAW, OCCLUSION_SKIP, OCCLUSION_CONDITIONAL };
+
+struct OcclusionState {
+    GLuint query = 0;
+    bool pending = false;      // issued, result not read back yet
+    bool visible = true;       // last result read back
+    bool queryThisFrame = false;
+    int stableResults = 0;     // visible results in a row
+    int nextQueryFrame = 0;
+};
+
+std::vector<OcclusionState> occlusionStates; // one per sceneDrawables entry
+int occlusionFrame = 0;
+GLuint occlusionBoxVao, occlusionBoxVbo;
+
+bool setupOcclusionCulling() {
+    // unit cube, positions only
+    std::vector<float> cube;
+    const int faces[6][4] = { {0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5} };
+    for (const auto& face : faces) {
+        for (int corner : { face[0], face[1], face[2], face[0], face[2], face[3] }) {
+            cube.push_back((float)((corner >> 0) & 1));
+            cube.push_back((float)((corner >> 1) & 1));
+            cube.push_back((float)((corner >> 2) & 1));
+        }
+    }
+
+    glGenVertexArrays(1, &occlusionBoxVao);
+    glGenBuffers(1, &occlusionBoxVbo);
+    glBindVertexArray(occlusionBoxVao);
+    glBindBuffer(GL_ARRAY_BUFFER, occlusionBoxVbo);
+    glBufferData(GL_ARRAY_BUFFER, cube.size() * sizeof(float), cube.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*) 0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+
+    occlusionStates.resize(sceneDrawables.size());
+    for (OcclusionState& state : occlusionStates)
+        glGenQueries(1, &state.query);
+    return true;
+}
+
+// what drawScene() needs of a view, worked out on a worker before the GL thread draws it
+struct ViewPacket {
+    glm::mat4 projection, view, mirror;  // mirror is identity for the main view
+    Frustum frustum;                     // in unmirrored world space
+    glm::vec3 eye;                       // the camera, for the occlusion queries
+    bool mainView;
+    bool visible;                        // false leaves the view out (the mirror)
+    int scissor[4];                      // pixels the mirror covers in its target
+    OcclusionDecision* decisions;        // per sceneDrawables entry, in the frame arena
+    GrassDraw* grassDraws;               // likewise, grassDrawCount of them
+    int grassDrawCount;
+};
+ViewPacket viewPackets[2]; // main view, mirror
+
+// picks up the query results without waiting for the GPU; the GL half of culling the main view
+void readOcclusionResults() {
+    occlusionFrame++;
+    for (size_t i = 0; i < occlusionStates.size(); i++) {
+        OcclusionState& state = occlusionStates[i];
+        if (!state.pending)
+            continue;
+        GLuint available = 0;
+        glGetQueryObjectuiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint anySamples = 0;
+            glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &anySamples);
+            state.stableResults = anySamples && state.visible ? state.stableResults + 1 : 0;
+            state.visible = anySamples != 0;
+            state.pending = false;
+            state.nextQueryFrame = occlusionFrame;
+            if (state.visible) // staggered so the requeries of stable meshes spread over frames
+                state.nextQueryFrame += std::min(1 + 2 * state.stableResults, OCCLUSION_MAX_REQUERY_FRAMES) + (int)(i % 4);
+        }
+    }
+}
+
+// decides for every static mesh whether drawScene() draws it, skips it or leaves it to the
+// GPU, and which grass chunks it draws; the queries only cover the main view (after
+// readOcclusionResults()), the CPU rasterizer any view, one view at a time
+void cullView(ViewPacket& packet) {
+    packet.decisions = (OcclusionDecision*)frameAlloc(sceneDrawables.size() * sizeof(OcclusionDecision));
+    packet.grassDraws = (GrassDraw*)frameAlloc(grassChunks.size() * sizeof(GrassDraw));
+    glm::vec3 grassEye = glm::vec3(packet.mirror * glm::inverse(packet.view)[3]);
+    packet.grassDrawCount = showGrassLeaves ? cullGrass(packet.frustum, grassEye, packet.grassDraws) : 0;
+
+    bool mainView = packet.mainView;
+    glm::mat4 worldToClip = packet.projection * packet.view * packet.mirror;
+    bool softwareOcclusion = occlusionMode == OCCLUSION_CPU;
+    if (softwareOcclusion)
+        rasterizeOccluders(worldToClip);
+
+    for (size_t i = 0; i < sceneDrawables.size(); i++) {
+        OcclusionState& state = occlusionStates[i];
+        OcclusionDecision& decision = packet.decisions[i];
+        const AABB& box = meshBounds[sceneDrawables[i].mesh];
+        if (mainView)
+            state.queryThisFrame = false;
+
+        if (!aabbInFrustum(packet.frustum, box)) {
+            decision = OCCLUSION_SKIP;
+            if (mainView && !state.pending)
+                state.visible = true; // no telling what it looks like when it comes back into view
+            continue;
+        }
+
+        if (softwareOcclusion) {
+            decision = aabbVisibleToOccluders(box, worldToClip) ? OCCLUSION_DRAW : OCCLUSION_SKIP;
+            continue;
+        }
+
+        // the box cannot be tested from inside (its near faces would be clipped away)
+        glm::vec3 margin(0.5f);
+        bool eyeInside = glm::all(glm::greaterThan(packet.eye, box.min - margin)) && glm::all(glm::lessThan(packet.eye, box.max + margin));
+        if (!mainView || occlusionMode != OCCLUSION_GPU || eyeInside) {
+            decision = OCCLUSION_DRAW;
+            continue;
+        }
+
+        if (state.pending)
+            decision = OCCLUSION_CONDITIONAL;
+        else
+            decision = state.visible ? OCCLUSION_DRAW : OCCLUSION_SKIP;
+        state.queryThisFrame = !state.pending && occlusionFrame >= state.nextQueryFrame;
+    }
+}
+
+// wrap the draw of a static mesh; false means leave it out
+bool beginOccludable(const ViewPacket& packet, size_t i) {
+    OcclusionDecision decision = packet.decisions[i];
+    if (decision == OCCLUSION_CONDITIONAL)
+        glBeginConditionalRender(occlusionStates[i].query, GL_QUERY_NO_WAIT);
+    return decision != OCCLUSION_SKIP;
+}
+
+void endOccludable(const ViewPacket& packet, size_t i) {
+    if (packet.decisions[i] == OCCLUSION_CONDITIONAL)
+        glEndConditionalRender();
+}
+
+// tests the boxes of the meshes due for a query against the depth drawn so far
+void issueOcclusionQueries(const glm::mat4& projectionTransform, const glm::mat4& viewTransform) {
+    GPU_SCOPE("occlusion queries");
+    glUseProgram(shadowMapShader);
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "lightTransform"), 1, GL_FALSE, glm::value_ptr(projectionTransform));
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(viewTransform));
+    glUniform1i(glGetUniformLocation(shadowMapShader, "isInstanced"), 0);
+    GLint modelLocation = glGetUniformLocation(shadowMapShader, "modelTransform");
+
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
+    glDisable(GL_CULL_FACE);
+    glBindVertexArray(occlusionBoxVao);
+
+    for (size_t i = 0; i < occlusionStates.size(); i++) {
+        OcclusionState& state = occlusionStates[i];
+        if (!state.queryThisFrame)
+            continue;
+
+        const AABB& box = meshBounds[sceneDrawables[i].mesh];
+        glm::vec3 margin(OCCLUSION_BOX_MARGIN);
+        glm::mat4 boxTransform = glm::translate(glm::mat4(1.0f), box.min - margin) * glm::scale(glm::mat4(1.0f), box.max - box.min + 2.0f * margin);
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(boxTransform));
+
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, state.query);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        state.pending = true;
+    }
+
+    glEnable(GL_CULL_FACE);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(glm::mat4(1.0f)));
+    glUseProgram(shader);
+}
+
+/*---------------------------------------------------*/
+
+/*------------------DEPTH PREPASS--------------------*/
+
+// the opaque meshes can be laid down depth-only first (with the position-only shadow map
+// shader), so that the main pass shades each pixel once with GL_EQUAL; fish (animated
+// inside drawScene) and alpha tested foliage are left out and depth test as usual
+enum DepthPrepassMode { PREPASS_AUTO, PREPASS_ALWAYS, PREPASS_OFF };
+DepthPrepassMode depthPrepassMode = PREPASS_AUTO;
+const char* depthPrepassModeNames[] = { "auto", "always", "off" };
+
+// overdraw is the number of depth test passes of the static meshes per pixel of the view;
+// without the prepass these are the fragments the main pass shades, with it the prepass
+// sees the very same ones. The gap between the two keeps a view from flipping every frame
+#define PREPASS_ENABLE_OVERDRAW 1.5f
+#define PREPASS_DISABLE_OVERDRAW 1.2f
+
+struct DepthPrepassView {
+    GLuint query = 0;
+    bool queryPending = false;
+    int queryPixels = 0;   // size of the view when the query was issued
+    float overdraw = 0.0f; // last measured
+    bool worthIt = false;  // the auto decision
+};
+DepthPrepassView depthPrepassViews[2]; // main view, mirror
+
+// picks up the last overdraw measurement without waiting for the GPU, then tells
+// whether this view gets a prepass
+bool useDepthPrepass(DepthPrepassView& view) {
+    if (view.queryPending) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(view.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint samples = 0;
+            glGetQueryObjectuiv(view.query, GL_QUERY_RESULT, &samples);
+            view.overdraw = (float)samples / std::max(view.queryPixels, 1);
+            view.queryPending = false;
+
+            if (view.worthIt && view.overdraw < PREPASS_DISABLE_OVERDRAW)
+                view.worthIt = false;
+            else if (!view.worthIt && view.overdraw > PREPASS_ENABLE_OVERDRAW)
+                view.worthIt = true;
+        }
+    }
+    return depthPrepassMode == PREPASS_ALWAYS || (depthPrepassMode == PREPASS_AUTO && view.worthIt);
+}
+
+// starts counting the samples of the static meshes, unless the last count is still in flight
+bool beginOverdrawQuery(DepthPrepassView& view) {
+    if (view.queryPending)
+        return false;
+
+    GLint box[4];
+    glGetIntegerv(glIsEnabled(GL_SCISSOR_TEST) ? GL_SCISSOR_BOX : GL_VIEWPORT, box);
+    view.queryPixels = box[2] * box[3];
+    glBeginQuery(GL_SAMPLES_PASSED, view.query);
+    return true;
+}
+
+void endOverdrawQuery(DepthPrepassView& view) {
+    glEndQuery(GL_SAMPLES_PASSED);
+    view.queryPending = true;
+}
+
+// same meshes and culling as drawScene() (see cullView()), so the main pass finds exactly
+// this depth
+void drawDepthPrepass(const ViewPacket& packet, DepthPrepassView& view) {
+    GPU_SCOPE("depth prepass");
+    const glm::mat4& projectionTransform = packet.projection;
+    const glm::mat4& viewTransform = packet.view;
+    const glm::mat4& mirrorMat = packet.mirror;
+    glUseProgram(shadowMapShader);
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "lightTransform"), 1, GL_FALSE, glm::value_ptr(projectionTransform));
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(viewTransform));
+    GLint modelLocation = glGetUniformLocation(shadowMapShader, "modelTransform");
+    glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(mirrorMat));
+    glUniform1i(glGetUniformLocation(shadowMapShader, "isInstanced"), 0);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+    bool measuring = beginOverdrawQuery(view);
+    for (size_t i = 0; i < sceneDrawables.size(); i++) {
+        if (!beginOccludable(packet, i))
+            continue;
+        drawSceneMesh(modelLocation, mirrorMat, sceneDrawables[i].mesh);
+        endOccludable(packet, i);
+    }
+    if (measuring)
+        endOverdrawQuery(view);
+
+    // the windows, and the mirror when seen directly
+    for (int mesh : { 4, 6, 10 }) {
+        if ((mesh == 10 && !packet.mainView) || !aabbInFrustum(packet.frustum, meshBounds[mesh]))
+            continue;
+        drawSceneMesh(modelLocation, mirrorMat, mesh);
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(glm::mat4(1.0f)));
+    glUseProgram(shader);
+}
+
+/*---------------------------------------------------*/
+
 // called by the main function to do initial setup, such as uploading vertex
 // arrays, shader programs, etc.; returns true if successful, false otherwise
 bool setup()
 {
+    CPU_SCOPE("setup");
     readModelData(FloorMesh, "Finals-Data-FloorMesh.txt");
     readModelData(BricksParallax, "Finals-Data-Parallax.txt");
     readModelData(LowerBuilding, "Finals-Data-LowerBuilding.txt");
     readModelData(LowerWindow, "Finals-Data-LowerWindow.txt");
     readModelData(HigherBuilding, "Finals-Data-HigherBuilding.txt");
     readModelData(HigherWindow, "Finals-Data-HigherWindow.txt");
-    readModelData(GrassMesh, "Finals-Data-Grass.txt");
     readModelData(TreeBark, "Finals-Data-Tree.txt");
     readModelData(TreeLeaves, "Finals-Data-Leaves.txt");
     readModelData(MirrorPlane, "Finals-Data-MirrorPlane.txt");
@@ -1272,7 +4824,7 @@ bool setup()
 
     vertex_data[0] = FloorMesh;
     vertex_data[1] = BricksParallax;
-    vertex_data[2] = GrassMesh;
+    // 2 was the baked grass, now instanced (see FOLIAGE)
     vertex_data[3] = LowerBuilding;
     vertex_data[4] = LowerWindow;
     vertex_data[5] = HigherBuilding;
@@ -1292,7 +4844,16 @@ bool setup()
     vertex_data[19] = LampBulb;
     // vertex_data[4] = std::vector<float>(std::begin(tankVertices), std::end(tankVertices));
 
+    for (int i = 0; i < vertex_data_num; ++i)
+        computeMeshBounds(i);
+    buildSceneGraph();
+
     initFish(); // since fireflies have lights lol
+    // only the CPU simulation reads the scene SDF, the transform feedback step keeps to the boxes
+    if (!gpuFishMode) {
+        bakeSceneSdf(TANK_MIN, TANK_MAX, AVOID_DISTANCE);
+        startFishSimulation();
+    }
     setupLights();
 
     // upload the model to the GPU (explanations omitted for brevity)
@@ -1316,9 +4877,12 @@ bool setup()
     }
 
     // load our shader program
-    shader = gdevLoadShader("Finals-Shader.vs", "Finals-Shader.fs");
+    shader = loadShader("Finals-Shader.vs", "Finals-Shader.fs");
     if (!shader) return false;
 
+    setupStreamBuffer();
+    if (!setupLightBlock()) return false;
+
     // since we now use multiple textures, we need to set the texture channel for each texture
     glUseProgram(shader);
     glUniform1i(glGetUniformLocation(shader, "diffuseMap"), 0);
@@ -1343,6 +4907,7 @@ bool setup()
     // 7 - cubemap envi map 1
     // 8 - cubemap envi map 2
     // 9 - height map for parallax
+    // 10 - planar mirror reflection
     // 6 - transparent texture (for grass)
     // 12 - offset texture for pcf
 
@@ -1352,66 +4917,66 @@ bool setup()
 
     // load our textures
     // Floor Mesh:
-    texture[0] = gdevLoadTexture("Tex-FloorMesh-Diffuse.png", GL_REPEAT, true, true);
-    texture[1] = gdevLoadTexture("Tex-FloorMesh-Normals.png", GL_REPEAT, true, true);
+    texture[0] = loadSceneTexture("Tex-FloorMesh-Diffuse.png", GL_REPEAT, true, true);
+    texture[1] = loadSceneTexture("Tex-FloorMesh-Normals.png", GL_REPEAT, true, true);
 
     // Brick Elevation:
-    texture[2] = gdevLoadTexture("Tex-Parallax-Diffuse.jpg", GL_REPEAT, true, true);
-    texture[3] = gdevLoadTexture("Tex-Parallax-Normals.jpg", GL_REPEAT, true, true);
+    texture[2] = loadSceneTexture("Tex-Parallax-Diffuse.jpg", GL_REPEAT, true, true);
+    texture[3] = loadSceneTexture("Tex-Parallax-Normals.jpg", GL_REPEAT, true, true);
 
     // Transparent Grass:
-    texture[4] = gdevLoadTexture("Tex-Grass-Diffuse.png", GL_CLAMP_TO_EDGE, true, true);
+    texture[4] = loadSceneTexture("Tex-Grass-Diffuse.png", GL_CLAMP_TO_EDGE, true, true);
 
     // Lower Building:
-    texture[5] = gdevLoadTexture("Tex-LowerBuilding-Diffuse.png", GL_REPEAT, true, true);
-    texture[6] = gdevLoadTexture("Tex-Windows.jpg", GL_REPEAT, true, true); // window diffuse
+    texture[5] = loadSceneTexture("Tex-LowerBuilding-Diffuse.png", GL_REPEAT, true, true);
+    texture[6] = loadSceneTexture("Tex-Windows.jpg", GL_REPEAT, true, true); // window diffuse
 
     // Higher Building:
-    texture[7] = gdevLoadTexture("Tex-HigherBuilding-Diffuse.png", GL_REPEAT, true, true);
+    texture[7] = loadSceneTexture("Tex-HigherBuilding-Diffuse.png", GL_REPEAT, true, true);
 
     // Instanced Model:
-    texture[8] = gdevLoadTexture("Tex-Firefly-Diffuse.png", GL_REPEAT, true, true); // temporary fish
+    texture[8] = loadSceneTexture("Tex-Firefly-Diffuse.png", GL_REPEAT, true, true); // temporary fish
 
     // Tree Bark:
-    texture[9] = gdevLoadTexture("Tex-TreeBark-Diffuse.png", GL_REPEAT, true, true);
+    texture[9] = loadSceneTexture("Tex-TreeBark-Diffuse.png", GL_REPEAT, true, true);
 
     // Tree Leaves:
-    texture[10] = gdevLoadTexture("Tex-TreeLeaves-Diffuse.png", GL_REPEAT, true, true);
+    texture[10] = loadSceneTexture("Tex-TreeLeaves-Diffuse.png", GL_REPEAT, true, true);
 
     // Side Station:
-    texture[11] = gdevLoadTexture("Tex-SideStation-Diffuse.png", GL_REPEAT, true, true);
+    texture[11] = loadSceneTexture("Tex-SideStation-Diffuse.png", GL_REPEAT, true, true);
 
     // Office:
-    texture[12] = gdevLoadTexture("Tex-Office-Diffuse.png", GL_REPEAT, true, true);
-    texture[13] = gdevLoadTexture("Tex-Office-Normals.png", GL_REPEAT, true, true);
+    texture[12] = loadSceneTexture("Tex-Office-Diffuse.png", GL_REPEAT, true, true);
+    texture[13] = loadSceneTexture("Tex-Office-Normals.png", GL_REPEAT, true, true);
 
     // Bus Station:
-    texture[14] = gdevLoadTexture("Tex-BusSta-Diffuse.png", GL_REPEAT, true, true);
-    texture[15] = gdevLoadTexture("Tex-BusSta-Normals.png", GL_REPEAT, true, true);
+    texture[14] = loadSceneTexture("Tex-BusSta-Diffuse.png", GL_REPEAT, true, true);
+    texture[15] = loadSceneTexture("Tex-BusSta-Normals.png", GL_REPEAT, true, true);
 
     // Miscelleanous:
-    texture[16] = gdevLoadTexture("Tex-Misc-Diffuse.png", GL_REPEAT, true, true);
-    texture[17] = gdevLoadTexture("Tex-Misc-Normals.png", GL_REPEAT, true, true);
+    texture[16] = loadSceneTexture("Tex-Misc-Diffuse.png", GL_REPEAT, true, true);
+    texture[17] = loadSceneTexture("Tex-Misc-Normals.png", GL_REPEAT, true, true);
 
     // Water:
-    texture[18] = gdevLoadTexture("Tex-Water-Diffuse.png", GL_REPEAT, true, true);
+    texture[18] = loadSceneTexture("Tex-Water-Diffuse.png", GL_REPEAT, true, true);
 
     // Station:
-    texture[19] = gdevLoadTexture("Tex-Station-Diffuse.png", GL_REPEAT, true, true);
-    texture[20] = gdevLoadTexture("Tex-Station-Normals.png", GL_REPEAT, true, true);
-    texture[21] = gdevLoadTexture("Tex-Station-Specular.png", GL_REPEAT, true, true);
+    texture[19] = loadSceneTexture("Tex-Station-Diffuse.png", GL_REPEAT, true, true);
+    texture[20] = loadSceneTexture("Tex-Station-Normals.png", GL_REPEAT, true, true);
+    texture[21] = loadSceneTexture("Tex-Station-Specular.png", GL_REPEAT, true, true);
 
     // Station:
-    texture[22] = gdevLoadTexture("Tex-Train-Diffuse.png", GL_REPEAT, true, true);
-    texture[23] = gdevLoadTexture("Tex-Train-Normals.png", GL_REPEAT, true, true);
-    texture[24] = gdevLoadTexture("Tex-Train-Specular.png", GL_REPEAT, true, true);
+    texture[22] = loadSceneTexture("Tex-Train-Diffuse.png", GL_REPEAT, true, true);
+    texture[23] = loadSceneTexture("Tex-Train-Normals.png", GL_REPEAT, true, true);
+    texture[24] = loadSceneTexture("Tex-Train-Specular.png", GL_REPEAT, true, true);
 
     // LampPost
-    texture[25] = gdevLoadTexture("Tex-LampPost-Diffuse.png", GL_REPEAT, true, true);
-    texture[26] = gdevLoadTexture("Tex-LampBulb-Diffuse.png", GL_REPEAT, true, true);
+    texture[25] = loadSceneTexture("Tex-LampPost-Diffuse.png", GL_REPEAT, true, true);
+    texture[26] = loadSceneTexture("Tex-LampBulb-Diffuse.png", GL_REPEAT, true, true);
 
     // Brick Height Map:
-    texture[27] = gdevLoadTexture("Tex-Parallax-Height.jpg", GL_REPEAT, true, true);
+    texture[27] = loadSceneTexture("Tex-Parallax-Height.jpg", GL_REPEAT, true, true);
 
     if (! texture[0] || ! texture[1] || ! texture[2]
         || ! texture[3] || ! texture[4] || ! texture[5]
@@ -1429,7 +4994,6 @@ bool setup()
 
     glGenVertexArrays(1, &instancedVao);
     glGenBuffers(1, &instancedVbo);      
-    glGenBuffers(1, &instancedVboMatrix); 
 
     glBindVertexArray(instancedVao);
 
@@ -1446,28 +5010,25 @@ bool setup()
     glEnableVertexAttribArray(2);
     glEnableVertexAttribArray(3);
 
-    glBindBuffer(GL_ARRAY_BUFFER, instancedVboMatrix);
-    glBindBuffer(GL_ARRAY_BUFFER, instancedVboMatrix);
-    glBufferData(GL_ARRAY_BUFFER, fishMatrices.size() * sizeof(glm::mat4), fishMatrices.data(), GL_STATIC_DRAW);
-    
-    GLuint instancedVaoMatrix = instancedVao;
-    glBindVertexArray(instancedVaoMatrix);
+    // the instances are streamed, drawScene() points these at each frame's copy: position
+    // and scale, then the snorm16 quaternion (see FishInstance)
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer.buffer);
 
-    std::size_t vec4Size = sizeof(glm::vec4);
     glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 4 * vec4Size, (void*)0);
+    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(FishInstance), (void*)offsetof(FishInstance, position));
     glEnableVertexAttribArray(5);
-    glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, 4 * vec4Size, (void*)(1 * vec4Size));
-    glEnableVertexAttribArray(6);
-    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, 4 * vec4Size, (void*)(2 * vec4Size));
-    glEnableVertexAttribArray(7);
-    glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, 4 * vec4Size, (void*)(3 * vec4Size));
+    glVertexAttribPointer(5, 4, GL_SHORT, GL_TRUE, sizeof(FishInstance), (void*)offsetof(FishInstance, orientation));
     glVertexAttribDivisor(4, 1);
     glVertexAttribDivisor(5, 1);
-    glVertexAttribDivisor(6, 1);
-    glVertexAttribDivisor(7, 1);
 
     glBindVertexArray(0);
+
+    if (gpuFishMode) {
+        if (!setupGpuFish())
+            return false;
+        setupGpuFishDrawing();
+        std::cout << "Simulating " << numFish << " fish on the GPU\n";
+    }
     /*--------------------------------------------------*/
 
     glEnable(GL_DEPTH_TEST);
@@ -1479,17 +5040,31 @@ bool setup()
     // for pcf with random sampling
     setupPCF();
 
+    // before the cubemaps, whose captures use it
+    setupSoftwareOcclusion();
+
     if ( !setupCubemap()) 
         return false;
     
     if (!setupBloom()) return false;
 
+    if (!setupReflection()) return false;
+    if (!setupGpuProfiler()) return false;
+    if (!setupFoliage()) return false;
+    if (!setupOcclusionCulling()) return false;
+
+    // overdraw measurements for the depth prepass
+    for (DepthPrepassView& view : depthPrepassViews)
+        glGenQueries(1, &view.query);
+
     // bind cubemaps to unit 7 and 8
     glUseProgram(shader);
     glUniform1i(glGetUniformLocation(shader, "cubemap[0]"), 7);
     glUniform1i(glGetUniformLocation(shader, "cubemap[1]"), 8);
     glUniform1i(glGetUniformLocation(shader, "isReflective"), 0);
     glUniform1f(glGetUniformLocation(shader, "reflectivity"), 0.5f); 
+    glUniform1i(glGetUniformLocation(shader, "reflectionTexture"), 10);
+    glUniform1i(glGetUniformLocation(shader, "isMirror"), 0);
     glActiveTexture(GL_TEXTURE7);
     glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[0]);
     glActiveTexture(GL_TEXTURE8);
@@ -1523,171 +5098,135 @@ glm::mat4 buildReflectionMatrix(glm::vec3 n, float d)
     return M;
 }
 
-void drawScene(glm::mat4 projectionTransform, glm::mat4 viewTransform, glm::mat4 mirrorMat = glm::mat4(1.0f)) {
+// replaces the near plane of a perspective projection with an arbitrary view space
+// plane (Lengyel, "Oblique View Frustum Depth Projection and Clipping"); points with
+// dot(clipPlane, p) >= 0 are kept, and the camera must lie on the negative side
+glm::mat4 obliqueProjection(glm::mat4 projection, const glm::vec4& clipPlane)
+{
+    glm::vec4 q;
+    q.x = (glm::sign(clipPlane.x) + projection[2][0]) / projection[0][0];
+    q.y = (glm::sign(clipPlane.y) + projection[2][1]) / projection[1][1];
+    q.z = -1.0f;
+    q.w = (1.0f + projection[2][2]) / projection[3][2];
+
+    glm::vec4 c = clipPlane * (2.0f / glm::dot(clipPlane, q));
+    projection[0][2] = c.x;
+    projection[1][2] = c.y;
+    projection[2][2] = c.z + 1.0f;
+    projection[3][2] = c.w;
+    return projection;
+}
+
+// draws a view culled by cullView()
+void drawScene(const ViewPacket& packet) {
+    const glm::mat4& projectionTransform = packet.projection;
+    const glm::mat4& viewTransform = packet.view;
+    const glm::mat4& mirrorMat = packet.mirror;
+    const Frustum& frustum = packet.frustum;
+    bool mainView = packet.mainView;
+
+    DepthPrepassView& prepassView = depthPrepassViews[mainView ? 0 : 1];
+    bool prepass = useDepthPrepass(prepassView);
+    if (prepass)
+        drawDepthPrepass(packet, prepassView);
+
+    // what the prepass drew only needs shading where it ended up in front
+    auto depthEqual = [prepass](bool equal) {
+        if (!prepass) return;
+        glDepthFunc(equal ? GL_EQUAL : GL_LESS);
+        glDepthMask(equal ? GL_FALSE : GL_TRUE);
+    };
 
     glUniformMatrix4fv(glGetUniformLocation(shader, "projectionTransform"), 1, GL_FALSE, glm::value_ptr(projectionTransform));
     glUniformMatrix4fv(glGetUniformLocation(shader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(viewTransform));
-    glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
-                    1, GL_FALSE, glm::value_ptr(mirrorMat));
-
-    // Renders:
-    // 1) Floor Mesh: hasNormal, No for the rest
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 1); 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[0]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[1]);
-    glBindVertexArray(vaos[0]);
-    glDrawArrays(GL_TRIANGLES, 0, FloorMesh.size() / 11);
-
-    // 2) Bricks With Parallax: hasNormal, No for the rest
-    // No need to set hasNormal, use from previous draw
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[2]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[3]);
-    glBindVertexArray(vaos[1]);
-
-    glUniform1i(glGetUniformLocation(shader, "useParallax"), 1);
-    glUniform1f(glGetUniformLocation(shader, "heightScale"), heightScale);
+    GLint modelLocation = glGetUniformLocation(shader, "modelTransform");
+    glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(mirrorMat));
 
-    glActiveTexture(GL_TEXTURE9);
-    glBindTexture(GL_TEXTURE_2D, texture[27]); // height map for parallax
+    // static meshes, skipping anything outside the view (frustum is in unmirrored world space)
+    depthEqual(true);
+    bool measuring = !prepass && beginOverdrawQuery(prepassView);
+    for (size_t i = 0; i < sceneDrawables.size(); i++) {
+        const SceneDrawable& d = sceneDrawables[i];
+        if (!beginOccludable(packet, i))
+            continue;
 
-    glDrawArrays(GL_TRIANGLES, 0, BricksParallax.size() / 11);
-    glUniform1i(glGetUniformLocation(shader, "useParallax"), 0);
+        glUniform1i(glGetUniformLocation(shader, "hasNormal"), d.normal >= 0);
+        glUniform1i(glGetUniformLocation(shader, "hasSpecular"), d.specular >= 0);
 
-    // 3) Lower Building: Just Use Diffuse, no normal nor specular
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0); 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[5]);
-    glBindVertexArray(vaos[3]);
-    glDrawArrays(GL_TRIANGLES, 0, LowerBuilding.size() / 11);
-
-    // 4) Higher Building: Just Use Diffuse, no normal nor specular
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[5]); 
-    glBindVertexArray(vaos[5]);
-    glDrawArrays(GL_TRIANGLES, 0, HigherBuilding.size() / 11);
-
-    // 5) Tree Bark: Just Use Diffuse, no normal nor specular
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[9]); 
-    glBindVertexArray(vaos[8]);
-    glDrawArrays(GL_TRIANGLES, 0, TreeBark.size() / 11);
-
-    // 6) Side Station
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[11]);
-    glBindVertexArray(vaos[11]);
-    glDrawArrays(GL_TRIANGLES, 0, SideStation.size() / 11);
-
-    // 7) Office
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 1); 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[12]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[13]);
-    glBindVertexArray(vaos[12]);
-    glDrawArrays(GL_TRIANGLES, 0, Office.size() / 11);
-    
-    // 8) Bus Station
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[14]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[15]);
-    glBindVertexArray(vaos[13]);
-    glDrawArrays(GL_TRIANGLES, 0, BusStation.size() / 11);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture[d.diffuse]);
+        if (d.normal >= 0) {
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, texture[d.normal]);
+        }
+        if (d.specular >= 0) {
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, texture[d.specular]);
+        }
+        if (d.parallax) {
+            glUniform1i(glGetUniformLocation(shader, "useParallax"), 1);
+            glUniform1f(glGetUniformLocation(shader, "heightScale"), heightScale);
+            glActiveTexture(GL_TEXTURE9);
+            glBindTexture(GL_TEXTURE_2D, texture[27]); // height map for parallax
+        }
+        if (d.emissive) {
+            glUniform1i(glGetUniformLocation(shader, "isEmissive"), 1);
+            glUniform3fv(glGetUniformLocation(shader, "emissiveColor"), 1, glm::value_ptr(d.emissiveColor));
+        }
 
-    // 9) Miscellaneous
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[16]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[17]);
-    glBindVertexArray(vaos[14]);
-    glDrawArrays(GL_TRIANGLES, 0, Miscellaneous.size() / 11);
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0);
+        drawSceneMesh(modelLocation, mirrorMat, d.mesh);
 
-    // 10) Water
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[18]);
-    glBindVertexArray(vaos[15]);
-    glDrawArrays(GL_TRIANGLES, 0, Water.size() / 11);
+        endOccludable(packet, i);
 
-    // 11) Station
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 1);
-    glUniform1i(glGetUniformLocation(shader, "hasSpecular"), 1);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[19]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[20]);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, texture[21]);
-    glBindVertexArray(vaos[16]);
-    glDrawArrays(GL_TRIANGLES, 0, TrainStation.size() / 11);
-
-    // 12) Train Carts
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[22]);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texture[23]);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, texture[24]);
-    glBindVertexArray(vaos[17]);
-    glDrawArrays(GL_TRIANGLES, 0, TrainCart.size() / 11);
+        if (d.parallax) glUniform1i(glGetUniformLocation(shader, "useParallax"), 0);
+        if (d.emissive) glUniform1i(glGetUniformLocation(shader, "isEmissive"), 0);
+    }
+    if (measuring)
+        endOverdrawQuery(prepassView);
+    depthEqual(false);
+    if (mainView && occlusionMode == OCCLUSION_GPU)
+        issueOcclusionQueries(projectionTransform, viewTransform);
     glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0);
     glUniform1i(glGetUniformLocation(shader, "hasSpecular"), 0);
 
-    // 13) Lamp Posts
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[25]);
-    glBindVertexArray(vaos[18]);
-    glDrawArrays(GL_TRIANGLES, 0, LampPost.size() / 11);
-
-    // 14) Lamp Bulbs - emissive
-    glUniform1i(glGetUniformLocation(shader, "isEmissive"), 1); // for bloom on lamp bulbs
-    glUniform3f(glGetUniformLocation(shader, "emissiveColor"), 3.0f, 2.5f, 1.5f);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture[26]);
-    glBindVertexArray(vaos[19]);
-    glDrawArrays(GL_TRIANGLES, 0, LampBulb.size() / 11);
-    glUniform1i(glGetUniformLocation(shader, "isEmissive"),  0);
-
 
     /*---------------- INSTANCING FISH -----------------*/
-    computeNextFishStates(static_cast<float>(glfwGetTime()));
-
-    // update fish matrices
-    for (int i = 0; i < NUM_FISH; i++) {
-        const Fish& f = fishes[i];
-        glm::mat4 m = glm::mat4(1.0f);
-        m = glm::translate(m, f.position);
-        m *= glm::mat4_cast(f.orientation);
-        // m = glm::scale(m, glm::vec3(0.5f));
-        fishMatrices[i] = mirrorMat * m;
+    // the instances were streamed once for the frame in render(), or with --gpu-fish the
+    // shader blends them from the state buffers; the mirror goes on top through
+    // modelTransform, which is still mirrorMat here
+    GLuint fishVao = gpuFishMode ? gpuFish.drawVaos[gpuFish.current] : instancedVao;
+    bool drawFish = gpuFishMode || fishInstancesOffset >= 0;
+    if (!gpuFishMode && drawFish) {
+        glBindVertexArray(instancedVao);
+        glBindBuffer(GL_ARRAY_BUFFER, streamBuffer.buffer);
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(FishInstance), (void*)(fishInstancesOffset + offsetof(FishInstance, position)));
+        glVertexAttribPointer(5, 4, GL_SHORT, GL_TRUE, sizeof(FishInstance), (void*)(fishInstancesOffset + offsetof(FishInstance, orientation)));
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, instancedVboMatrix);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, fishMatrices.size() * sizeof(glm::mat4), fishMatrices.data());
-
     glUseProgram(shader);
     glUniformMatrix4fv(glGetUniformLocation(shader, "projectionTransform"), 1, GL_FALSE, glm::value_ptr(projectionTransform));
     glUniformMatrix4fv(glGetUniformLocation(shader, "viewTransform"), 1, GL_FALSE, glm::value_ptr(viewTransform));
     glUniform1i(glGetUniformLocation(shader, "isInstanced"), 1);
+    glUniform1i(glGetUniformLocation(shader, "isGpuFish"), gpuFishMode);
+    glUniform1f(glGetUniformLocation(shader, "fishAlpha"), gpuFish.alpha);
     glUniform1i(glGetUniformLocation(shader, "isEmissive"),  1);
     glUniform3f(glGetUniformLocation(shader, "emissiveColor"), 2.5f, 2.0f, 0.8f);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture[8]);
     
-    glBindVertexArray(instancedVao);
-    glDrawArraysInstanced(GL_TRIANGLES, 0, InstanceMesh.size() / 11, NUM_FISH);
+    if (drawFish) {
+        glBindVertexArray(fishVao);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, InstanceMesh.size() / 11, numFish);
+    }
     
     glUniform1i(glGetUniformLocation(shader, "isInstanced"), 0);
+    glUniform1i(glGetUniformLocation(shader, "isGpuFish"), 0);
     glUniform1i(glGetUniformLocation(shader, "isEmissive"),  0);
     /*--------------------------------------------------*/
 
     // --- Windows (reflective) ---
+    depthEqual(true);
     if (mirrorMat == glm::mat4(1.0f)) {
         glUniform1i(glGetUniformLocation(shader, "isReflective"), 1);
         glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0);
@@ -1703,43 +5242,68 @@ void drawScene(glm::mat4 projectionTransform, glm::mat4 viewTransform, glm::mat4
         glBindTexture(GL_TEXTURE_2D, texture[6]); // window diffuse
 
         // lower windows
-        glUniform1i(glGetUniformLocation(shader, "cubemapIndex"), 0);
-        // glActiveTexture(GL_TEXTURE7);
-        // glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[0]);
-        glBindVertexArray(vaos[4]);
-        glDrawArrays(GL_TRIANGLES, 0, LowerWindow.size() / 11);
-
+        if (aabbInFrustum(frustum, meshBounds[4])) {
+            glUniform1i(glGetUniformLocation(shader, "cubemapIndex"), 0);
+            // glActiveTexture(GL_TEXTURE7);
+            // glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[0]);
+            drawSceneMesh(modelLocation, mirrorMat, 4);
+        }
 
         // higher windows
-        glUniform1i(glGetUniformLocation(shader, "cubemapIndex"), 1);
-        // glActiveTexture(GL_TEXTURE8);
-        // glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[1]);
-        glBindVertexArray(vaos[6]);
-        glDrawArrays(GL_TRIANGLES, 0, HigherWindow.size() / 11);
+        if (aabbInFrustum(frustum, meshBounds[6])) {
+            glUniform1i(glGetUniformLocation(shader, "cubemapIndex"), 1);
+            // glActiveTexture(GL_TEXTURE8);
+            // glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[1]);
+            drawSceneMesh(modelLocation, mirrorMat, 6);
+        }
 
         // reset
         glUniform1i(glGetUniformLocation(shader, "cubemapIndex"), 0);
         glUniform1i(glGetUniformLocation(shader, "isReflective"), 0);
+
+        // the mirror itself shows the offscreen reflection; a new occlusion query
+        // is only issued once the previous one has been read back
+        if (aabbInFrustum(frustum, meshBounds[10])) {
+            glUniform1i(glGetUniformLocation(shader, "isMirror"), 1);
+            glActiveTexture(GL_TEXTURE10);
+            glBindTexture(GL_TEXTURE_2D, reflectionTexture);
+
+            bool issueQuery = !mirrorQueryPending;
+            if (issueQuery) glBeginQuery(GL_ANY_SAMPLES_PASSED, mirrorQuery);
+            drawSceneMesh(modelLocation, mirrorMat, 10);
+            if (issueQuery) {
+                glEndQuery(GL_ANY_SAMPLES_PASSED);
+                mirrorQueryPending = true;
+            }
+
+            glUniform1i(glGetUniformLocation(shader, "isMirror"), 0);
+        }
     } else {
         // else, use the window diffuse tex
         // lower windows
+        glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, texture[6]); // window diffuse lol
-        glBindVertexArray(vaos[4]);
-        glDrawArrays(GL_TRIANGLES, 0, LowerWindow.size() / 11);
+        if (aabbInFrustum(frustum, meshBounds[4])) {
+            drawSceneMesh(modelLocation, mirrorMat, 4);
+        }
 
         // higher windows
-        glBindVertexArray(vaos[6]);
-        glDrawArrays(GL_TRIANGLES, 0, HigherWindow.size() / 11);
+        if (aabbInFrustum(frustum, meshBounds[6])) {
+            drawSceneMesh(modelLocation, mirrorMat, 6);
+        }
     }
 
-    // GRASS
+    depthEqual(false);
+
+    // GRASS AND LEAVES
+    // cut out with alpha to coverage rather than blended, so they need no sorting
+    // and write depth like everything else
     if (showGrassLeaves) {
         glDisable(GL_CULL_FACE);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glEnable(GL_SAMPLE_ALPHA_TO_COVERAGE);
 
         glUniform1i(glGetUniformLocation(shader, "isAlphaBlended"), 1);
-        glUniform1f(glGetUniformLocation(shader, "alphaThreshold"), 0.1f);
+        glUniform1f(glGetUniformLocation(shader, "alphaThreshold"), 0.5f);
         glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0);
         glUniform1i(glGetUniformLocation(shader, "hasSpecular"), 0);
         glUniform1i(glGetUniformLocation(shader, "isTile"), 0);
@@ -1748,64 +5312,184 @@ void drawScene(glm::mat4 projectionTransform, glm::mat4 viewTransform, glm::mat4
         glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
                         1, GL_FALSE, glm::value_ptr(identityModel));
 
+        // the mirror is its own inverse, so this is the camera seen from the mirrored side
+        glm::vec3 eye = glm::vec3(mirrorMat * glm::inverse(viewTransform)[3]);
+
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, texture[4]);
-        glBindVertexArray(vaos[2]);
-        glDrawArrays(GL_TRIANGLES, 0, GrassMesh.size() / 11);
+        drawGrass(packet.grassDraws, packet.grassDrawCount, eye);
+
+        if (aabbInFrustum(frustum, meshBounds[9])) {
+            glBindTexture(GL_TEXTURE_2D, texture[10]);
+            drawSceneMesh(modelLocation, mirrorMat, 9);
+        }
+
+        glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+    }
+    
+    glUniform1i(glGetUniformLocation(shader, "isAlphaBlended"), 0);
+    glUniform1f(glGetUniformLocation(shader, "alphaThreshold"), 0.1f);
+    glEnable(GL_CULL_FACE);
+
+    glm::mat4 resetModel = glm::mat4(1.0f);
+    glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
+                    1, GL_FALSE, glm::value_ptr(resetModel));
+
+    // std::cout << mirrorMat[0][0] << " " << mirrorMat[1][1] << " " << mirrorMat[2][2] << std::endl;
+}
+
+// picks up the last result of the mirror's query without waiting for the GPU
+void readMirrorQuery() {
+    if (mirrorQueryPending) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(mirrorQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint anySamples = 0;
+            glGetQueryObjectuiv(mirrorQuery, GL_QUERY_RESULT, &anySamples);
+            mirrorVisible = anySamples != 0;
+            mirrorQueryPending = false;
+        }
+    }
+}
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[10]);
-        glBindVertexArray(vaos[9]);
-        glDrawArrays(GL_TRIANGLES, 0, TreeLeaves.size() / 11);
+// sets up the view mirrored about the mirror plane from the main one; not visible when the
+// camera is behind the mirror, the mirror is off-screen, or its occlusion query found it hidden
+void setupMirrorView(const ViewPacket& mainView, ViewPacket& packet) {
+    const glm::mat4& projectionTransform = mainView.projection;
+    const glm::mat4& viewTransform = mainView.view;
+    packet.visible = false;
+    packet.mainView = false;
+    if (!mirrorVisible)
+        return;
 
+    float d = glm::dot(mirrorNormal, mirrorPoint); // used for reflection matrix
+    glm::mat4 mirrorMatrix = buildReflectionMatrix(mirrorNormal, d);
+
+    // keep only what ends up behind the mirror once reflected
+    glm::vec4 clipPlane = glm::vec4(-mirrorNormal, d);
+    glm::vec4 viewClipPlane = glm::transpose(glm::inverse(viewTransform)) * clipPlane;
+    if (viewClipPlane.w >= 0.0f)
+        return; // looking at the back of the mirror
+
+    // screen space rectangle of the mirror (NDC)
+    glm::mat4 viewProjection = projectionTransform * viewTransform;
+    glm::vec2 rectMin(1.0f), rectMax(-1.0f);
+    for (size_t i = 0; i + 2 < MirrorPlane.size(); i += 11) {
+        glm::vec4 clip = viewProjection * glm::vec4(MirrorPlane[i], MirrorPlane[i + 1], MirrorPlane[i + 2], 1.0f);
+        if (clip.w <= 0.0f) {
+            // crosses the eye plane, fall back to the whole screen
+            rectMin = glm::vec2(-1.0f);
+            rectMax = glm::vec2(1.0f);
+            break;
+        }
+        glm::vec2 ndc = glm::vec2(clip) / clip.w;
+        rectMin = glm::min(rectMin, ndc);
+        rectMax = glm::max(rectMax, ndc);
     }
-    
-    glUniform1i(glGetUniformLocation(shader, "isAlphaBlended"), 0);
-    glDisable(GL_BLEND);
-    glEnable(GL_CULL_FACE);
+    rectMin = glm::max(rectMin, glm::vec2(-1.0f));
+    rectMax = glm::min(rectMax, glm::vec2(1.0f));
+    if (rectMin.x >= rectMax.x || rectMin.y >= rectMax.y)
+        return; // off-screen
+
+    // near plane on the mirror instead of a user clip distance
+    glm::mat4 reflectionProjection = obliqueProjection(projectionTransform, viewClipPlane);
+
+    // culling frustum tightened to the mirror's rectangle
+    glm::mat4 crop = glm::mat4(1.0f);
+    crop[0][0] = 2.0f / (rectMax.x - rectMin.x);
+    crop[1][1] = 2.0f / (rectMax.y - rectMin.y);
+    crop[3][0] = -(rectMax.x + rectMin.x) / (rectMax.x - rectMin.x);
+    crop[3][1] = -(rectMax.y + rectMin.y) / (rectMax.y - rectMin.y);
+    packet.frustum = frustumFromMatrix(crop * reflectionProjection * viewTransform * mirrorMatrix);
+    packet.projection = reflectionProjection;
+    packet.view = viewTransform;
+    packet.mirror = mirrorMatrix;
+    packet.eye = mainView.eye;
+
+    // only touch the pixels under the mirror (plus a texel of filtering margin)
+    int x0 = std::max(0, (int)std::floor((rectMin.x * 0.5f + 0.5f) * reflectionWidth) - 1);
+    int y0 = std::max(0, (int)std::floor((rectMin.y * 0.5f + 0.5f) * reflectionHeight) - 1);
+    int x1 = std::min(reflectionWidth, (int)std::ceil((rectMax.x * 0.5f + 0.5f) * reflectionWidth) + 1);
+    int y1 = std::min(reflectionHeight, (int)std::ceil((rectMax.y * 0.5f + 0.5f) * reflectionHeight) + 1);
+    packet.scissor[0] = x0;
+    packet.scissor[1] = y0;
+    packet.scissor[2] = x1 - x0;
+    packet.scissor[3] = y1 - y0;
+    packet.visible = true;
+}
 
-    glm::mat4 resetModel = glm::mat4(1.0f);
-    glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
-                    1, GL_FALSE, glm::value_ptr(resetModel));
+// renders the view from setupMirrorView() into reflectionTexture
+void renderMirrorReflection(const ViewPacket& packet) {
+    if (!packet.visible)
+        return;
 
-    // std::cout << mirrorMat[0][0] << " " << mirrorMat[1][1] << " " << mirrorMat[2][2] << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, reflectionFbo);
+    glViewport(0, 0, reflectionWidth, reflectionHeight);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(packet.scissor[0], packet.scissor[1], packet.scissor[2], packet.scissor[3]);
+    glClearColor(0.04f, 0.05f, 0.08f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // reflection flips the winding
+    glDisable(GL_CULL_FACE);
+    glFrontFace(GL_CW);
+    drawScene(packet);
+    glFrontFace(GL_CCW);
+    glEnable(GL_CULL_FACE);
+
+    glDisable(GL_SCISSOR_TEST);
 }
 
 void drawPostProcess() {
+    CPU_SCOPE("drawPostProcess");
+    GPU_SCOPE("post process");
+
     // pass 2: post process bloom
     glDisable(GL_DEPTH_TEST); // depth not needed for post process lol
     if (enableBloom) {
-        glBindFramebuffer(GL_FRAMEBUFFER, pingFbo);
-        glClear(GL_COLOR_BUFFER_BIT);
-        glUseProgram(bloomThresholdShader);
-        glUniform1f(glGetUniformLocation(bloomThresholdShader, "threshold"), bloomThreshold);
+        // pass 3: downsample the scene down the mip chain (the first step also does the bright pass)
+        int downsampleScope = gpuProfilerBegin("bloom downsample");
+        glUseProgram(bloomDownsampleShader);
+        glUniform1f(glGetUniformLocation(bloomDownsampleShader, "threshold"), bloomThreshold);
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, hdrColorTexture);
         glBindVertexArray(quadVao);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        for (int i = 0; i < BLOOM_MIPS; i++) {
+            glBindFramebuffer(GL_FRAMEBUFFER, bloomMipFbos[i]);
+            glViewport(0, 0, bloomMipWidths[i], bloomMipHeights[i]);
+            glUniform1i(glGetUniformLocation(bloomDownsampleShader, "firstPass"), i == 0);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+            glBindTexture(GL_TEXTURE_2D, bloomMipTextures[i]);
+        }
+        gpuProfilerEnd(downsampleScope);
 
-        // pass 3: ping pong gaussian blur
-        glUseProgram(bloomBlurShader);
-        bool horizontal = true;
-        for (int i = 0; i < bloomPasses; i++) {
-            glBindFramebuffer(GL_FRAMEBUFFER, horizontal ? pongFbo : pingFbo);
-            glClear(GL_COLOR_BUFFER_BIT);
-            glUniform1i(glGetUniformLocation(bloomBlurShader, "horizontal"), horizontal);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, horizontal ? pingTexture : pongTexture);
+        // pass 4: tent upsample back up the chain, adding each level onto the one above it
+        int upsampleScope = gpuProfilerBegin("bloom upsample");
+        glUseProgram(bloomUpsampleShader);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        for (int i = BLOOM_MIPS - 1; i > 0; i--) {
+            glBindFramebuffer(GL_FRAMEBUFFER, bloomMipFbos[i - 1]);
+            glViewport(0, 0, bloomMipWidths[i - 1], bloomMipHeights[i - 1]);
+            glBindTexture(GL_TEXTURE_2D, bloomMipTextures[i]);
             glDrawArrays(GL_TRIANGLES, 0, 6);
-            horizontal = !horizontal;
         }
+        glDisable(GL_BLEND);
+        gpuProfilerEnd(upsampleScope);
 
-        GLuint blurResult = (bloomPasses % 2 == 0) ? pingTexture : pongTexture;
+        // every level keeps the brightness of the bright pass, so the sum is averaged back down
+        GLuint blurResult = bloomMipTextures[0];
+        float bloomScale = bloomStrength / BLOOM_MIPS;
 
-        // pass 4: composite bloom with original scene
+        // pass 5: composite bloom with original scene
+        GPU_SCOPE("composite");
         glBindFramebuffer(GL_FRAMEBUFFER, 0); // back to default screen framebuffer
-        glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+        glViewport(0, 0, windowWidth, windowHeight);
         glClear(GL_COLOR_BUFFER_BIT);
         glUseProgram(bloomCompositeShader);
-        glUniform1f(glGetUniformLocation(bloomCompositeShader, "bloomStrength"), bloomStrength);
+        glUniform1f(glGetUniformLocation(bloomCompositeShader, "bloomStrength"), bloomScale);
         glUniform1f(glGetUniformLocation(bloomCompositeShader, "exposure"),      bloomExposure);
+        glUniform1i(glGetUniformLocation(bloomCompositeShader, "upscale"), renderWidth != windowWidth || renderHeight != windowHeight);
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, hdrColorTexture); // original scene
         glActiveTexture(GL_TEXTURE1);
@@ -1813,17 +5497,19 @@ void drawPostProcess() {
         glDrawArrays(GL_TRIANGLES, 0, 6);
     }
     else { // for tonemap and gamma correction without bloom since scene is rendered in HDR framebuffer and not directly to screen
+        GPU_SCOPE("composite");
        glDisable(GL_DEPTH_TEST);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+        glViewport(0, 0, windowWidth, windowHeight);
         glClear(GL_COLOR_BUFFER_BIT);
         glUseProgram(bloomCompositeShader);
         glUniform1f(glGetUniformLocation(bloomCompositeShader, "bloomStrength"), 0.0f); // no bloom added
         glUniform1f(glGetUniformLocation(bloomCompositeShader, "exposure"),      bloomExposure);
+        glUniform1i(glGetUniformLocation(bloomCompositeShader, "upscale"), renderWidth != windowWidth || renderHeight != windowHeight);
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, hdrColorTexture);
         glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, pingTexture); // bind something valid lol
+        glBindTexture(GL_TEXTURE_2D, bloomMipTextures[0]); // bind something valid lol
         glBindVertexArray(quadVao);
         glDrawArrays(GL_TRIANGLES, 0, 6); 
     }
@@ -1831,206 +5517,487 @@ void drawPostProcess() {
     glEnable(GL_DEPTH_TEST); // restore for next frame
 }
 
+/*------------------DYNAMIC RESOLUTION--------------------*/
+
+// recomputes the render resolution from the window size and render scale and
+// reallocates everything that is sized from it
+void resizeRenderTargets() {
+    renderWidth = std::max(1, (int)std::lround(windowWidth * renderScale));
+    renderHeight = std::max(1, (int)std::lround(windowHeight * renderScale));
+    setupRenderTargets();
+    setupReflection();
+    renderTargetsNeedResize = false;
+}
+
+// steps the render scale when the GPU frame time (as read back by the profiler)
+// stays over (or well under) the budget for a while
+void updateRenderScale() {
+    float frameMs = gpuPassLatest("frame");
+    if (frameMs >= 0.0f) {
+        smoothedFrameMs = smoothedFrameMs > 0.0f ? glm::mix(smoothedFrameMs, frameMs, 0.1f) : frameMs;
+
+        // the gap between the two thresholds keeps the scale from flipping back and forth
+        framesOverBudget = smoothedFrameMs > frameBudgetMs ? framesOverBudget + 1 : 0;
+        framesUnderBudget = smoothedFrameMs < frameBudgetMs * 0.75f ? framesUnderBudget + 1 : 0;
+    }
+
+    if (!enableDynamicResolution)
+        return;
+
+    // drop quickly when over budget, but only come back up after a sustained stretch under it
+    float newScale = renderScale;
+    if (framesOverBudget >= 10)
+        newScale = std::max(minRenderScale, renderScale - renderScaleStep);
+    else if (framesUnderBudget >= 120)
+        newScale = std::min(maxRenderScale, renderScale + renderScaleStep);
+
+    if (newScale != renderScale) {
+        renderScale = newScale;
+        renderTargetsNeedResize = true;
+        std::cout << "Render scale: " << renderScale << " (GPU frame " << smoothedFrameMs << " ms)\n";
+    }
+    if (framesOverBudget >= 10 || framesUnderBudget >= 120) {
+        framesOverBudget = 0;
+        framesUnderBudget = 0;
+    }
+}
+
+/*---------------------------------------------------*/
+
 // called by the main function to do rendering per frame
+// builds the frame's task graph (see FRAME TASKS) and runs it; the fish were simulated ahead
+// on their own thread already, see updateFish()
 void render()
 {
-    // render cubemap
-    if (cubemapNeedsRender) {
-        int dirIdx = 0, spotIdx = 0;
-        for (auto* light : lights) {
-            if (light->type == Light::DIRECTIONAL) renderDirectionalShadows(dirIdx++, *light);
-            else if (light->type == Light::SPOTLIGHT) renderSpotShadows(spotIdx++, *light);
+    CPU_SCOPE("render");
+    gpuProfilerBeginFrame();
+    streamBeginFrame();
+    updateRenderScale();
+    if (renderTargetsNeedResize)
+        resizeRenderTargets();
+
+    beginFrameGraph();
+    ViewPacket& mainView = viewPackets[0];
+    ViewPacket& mirrorView = viewPackets[1];
+    LightBlock* lightBlock = (LightBlock*)frameAlloc(sizeof(LightBlock));
+    FishInstance* instances = nullptr;
+    int frameScope = -1;
+
+    int sceneTask = addFrameTask("scene graph", false, {}, [] {
+        animateTrain();
+        updateSceneGraph();
+    });
+
+    int viewTask = addFrameTask("main view", false, {}, [&] {
+        // ... set up the projection matrix...
+        mainView.projection = glm::perspective(glm::radians(active_camera->fov),      // fov
+                                               (float) windowWidth / windowHeight,    // aspect ratio
+                                               0.1f,                                  // near plane
+                                               100.0f);                               // far plane
+        // ... set up the view matrix...
+        mainView.view = glm::lookAt(active_camera->position,                // eye position
+                                    active_camera->position + active_camera->front,   // center position
+                                    active_camera->up);  // up vector
+        mainView.mirror = glm::mat4(1.0f);
+        mainView.frustum = frustumFromMatrix(mainView.projection * mainView.view);
+        mainView.eye = glm::vec3(glm::inverse(mainView.view)[3]);
+        mainView.mainView = mainView.visible = true;
+    });
+
+    int lightsTask = addFrameTask("pack lights", false, { viewTask }, [&] {
+        packLightBlock(mainView.view, *lightBlock);
+    });
+
+    int queriesTask = addFrameTask("query results", true, {}, [] {
+        readMirrorQuery();
+        readOcclusionResults();
+    });
+
+    int mirrorTask = addFrameTask("mirror view", false, { viewTask, queriesTask }, [&] {
+        setupMirrorView(mainView, mirrorView);
+    });
+
+    // render cubemap, and recapture the probes something moved in front of
+    int probesTask = addFrameTask("probes", true, { sceneTask }, [&] {
+        if (cubemapNeedsRender) {
+            GPU_SCOPE("cubemap bake");
+            bakeCubemaps();
+
+            glActiveTexture(GL_TEXTURE7);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[0]);
+            glActiveTexture(GL_TEXTURE8);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[1]);
+            cubemapNeedsRender = false;
         }
-        renderCubemap(0);
-        renderCubemap(1);
 
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[0]);
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture[1]);
-        cubemapNeedsRender = false;
-    }   
+        // the one-off cubemap bake above is left out of the frame time
+        frameScope = gpuProfilerBegin("frame");
+        refreshStaleCubemaps();
+    });
+
+    // the CPU occlusion rasterizer is shared with the probes and between the views
+    int cullMirrorTask = addFrameTask("cull mirror", false, { mirrorTask, sceneTask, probesTask }, [&] {
+        if (mirrorView.visible)
+            cullView(mirrorView);
+    });
+    int cullMainTask = addFrameTask("cull main", false, { viewTask, sceneTask, queriesTask, cullMirrorTask }, [&] {
+        cullView(mainView);
+    });
+
+    // the instances are written straight into the streaming buffer, which nothing else may
+    // use while it is mapped, so it is mapped after the probes and unmapped before the uniforms
+    int mapTask = -1, fishTask = -1, unmapTask = -1;
+    if (!gpuFishMode) {
+        mapTask = addFrameTask("map fish instances", true, { probesTask }, [&] {
+            instances = (FishInstance*)streamMap(numFish * sizeof(FishInstance), 16, fishInstancesOffset);
+            if (!instances)
+                fishInstancesOffset = -1; // leaves the fish out rather than drawing stale data
+        });
+        fishTask = addFrameTask("fish instances", false, { mapTask }, [&] {
+            if (instances)
+                writeFishInstances(instances);
+        });
+    }
 
     // draw shadow map
-    if (enableShadows) {
+    int shadowsTask = addFrameTask("shadows", true, { sceneTask }, [] {
+        if (!enableShadows)
+            return;
+        GPU_SCOPE("shadows");
         int dirIdx = 0, spotIdx = 0;
         for (auto* light : lights) {
             if (light->type == Light::DIRECTIONAL) {
+                GPU_SCOPE("directional " + std::to_string(dirIdx));
                 renderDirectionalShadows(dirIdx++, *light);
             } 
             else if (light->type == Light::SPOTLIGHT) {
+                GPU_SCOPE("spot " + std::to_string(spotIdx));
                 renderSpotShadows(spotIdx++, *light);
             } 
             else if (light->type == Light::POINT) {
                 // TODO: lol
             }
         }
+    });
+
+    if (!gpuFishMode) {
+        unmapTask = addFrameTask("unmap fish instances", true, { fishTask }, [&] {
+            if (instances)
+                streamUnmap();
+        });
     }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, hdrFbo); // bind HDR framebuffer for main scene rendering
+    int uniformsTask = addFrameTask("uniforms", true, { lightsTask, shadowsTask, unmapTask }, [&] {
+        // using our shader program...
+        glUseProgram(shader);
 
-    // before drawing the final scene, we need to set drawing to the whole window
-    int width, height;
-    glfwGetFramebufferSize(pWindow, &width, &height);
-    glViewport(0, 0, width, height);
+        // update PCF parameters
+        glUniform1f(glGetUniformLocation(shader, "radius"), pcfRadius);
+        glUniform1i(glGetUniformLocation(shader, "pcfFilterSize"), pcfFilterSize);
 
-    // clear the whole frame
-    glClearColor(0.04f, 0.05f, 0.08f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        glUniform1f(glGetUniformLocation(shader, "time"), sceneTime());
+        glUniformMatrix4fv(glGetUniformLocation(shader, "projectionTransform"),
+                           1, GL_FALSE, glm::value_ptr(mainView.projection));
+        glUniformMatrix4fv(glGetUniformLocation(shader, "viewTransform"),
+                           1, GL_FALSE, glm::value_ptr(mainView.view));
 
-    // using our shader program...
-    glUseProgram(shader);
-    
-    // update PCF parameters
-    glUniform1f(glGetUniformLocation(shader, "radius"), pcfRadius);
-    glUniform1i(glGetUniformLocation(shader, "pcfFilterSize"), pcfFilterSize);
+        // uploading camera position
+        glUniform3fv(glGetUniformLocation(shader, "cameraWorldPos"),
+                 1, glm::value_ptr(active_camera->position));
 
-    glUniform1f(glGetUniformLocation(shader, "time"), (float)glfwGetTime());
-    // ... set up the projection matrix...
-    glm::mat4 projectionTransform;
-    projectionTransform = glm::perspective(glm::radians(active_camera->fov),      // fov
-                                           (float) WINDOW_WIDTH / WINDOW_HEIGHT,  // aspect ratio
-                                           0.1f,                                  // near plane
-                                           100.0f);                               // far plane
-    glUniformMatrix4fv(glGetUniformLocation(shader, "projectionTransform"),
-                       1, GL_FALSE, glm::value_ptr(projectionTransform));
+        // ... set up the model matrix... (just identity for this demo)
+        glm::mat4 modelTransform = glm::mat4(1.0f);
+        glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
+                           1, GL_FALSE, glm::value_ptr(modelTransform));
 
-    // ... set up the view matrix...
-    glm::mat4 viewTransform;
-    viewTransform = glm::lookAt(active_camera->position,                // eye position
-                                active_camera->position + active_camera->front,   // center position
-                                active_camera->up);  // up vector
-    glUniformMatrix4fv(glGetUniformLocation(shader, "viewTransform"),
-                       1, GL_FALSE, glm::value_ptr(viewTransform));
+        uploadLightBlock(*lightBlock);
 
-    // uploading camera position
-    glUniform3fv(glGetUniformLocation(shader, "cameraWorldPos"),
-             1, glm::value_ptr(active_camera->position));
+        glUniform1i(glGetUniformLocation(shader, "enableShadows"), enableShadows);
 
-    // ... set up the model matrix... (just identity for this demo)
-    glm::mat4 modelTransform = glm::mat4(1.0f);
-    glUniformMatrix4fv(glGetUniformLocation(shader, "modelTransform"),
-                       1, GL_FALSE, glm::value_ptr(modelTransform));
+        // fog stuff
+        glUniform1i(glGetUniformLocation(shader, "enableFog"), enableFog);
+        glUniform1f(glGetUniformLocation(shader, "fogStart"), fogStart);
+        glUniform1f(glGetUniformLocation(shader, "fogEnd"), fogEnd);
+        glUniform3fv(glGetUniformLocation(shader, "fogColor"), 1, glm::value_ptr(fogColor));
 
-    uploadLightUniforms(viewTransform);
+        if (enableShadows) {
+            // Upload light-space transform matrices
+            for (int i = 0; i < (int)directionalLightTransforms.size(); i++) {
+                std::string name = "directionalLightTransforms[" + std::to_string(i) + "]";
+                glUniformMatrix4fv(glGetUniformLocation(shader, name.c_str()),
+                                1, GL_FALSE, glm::value_ptr(directionalLightTransforms[i]));
+            }
+            for (int i = 0; i < (int)spotLightTransforms.size(); i++) {
+                std::string name = "spotLightTransforms[" + std::to_string(i) + "]";
+                glUniformMatrix4fv(glGetUniformLocation(shader, name.c_str()),
+                                1, GL_FALSE, glm::value_ptr(spotLightTransforms[i]));
+            }
 
-    glUniform1i(glGetUniformLocation(shader, "enableShadows"), enableShadows);
-    
-    // fog stuff
-    glUniform1i(glGetUniformLocation(shader, "enableFog"), enableFog);
-    glUniform1f(glGetUniformLocation(shader, "fogStart"), fogStart);
-    glUniform1f(glGetUniformLocation(shader, "fogEnd"), fogEnd);
-    glUniform3fv(glGetUniformLocation(shader, "fogColor"), 1, glm::value_ptr(fogColor));
+            // Bind the shadow arrays to their fixed units
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, directionalShadowArray);
 
-    if (enableShadows) {
-        // Upload light-space transform matrices
-        for (int i = 0; i < (int)directionalLightTransforms.size(); i++) {
-            std::string name = "directionalLightTransforms[" + std::to_string(i) + "]";
-            glUniformMatrix4fv(glGetUniformLocation(shader, name.c_str()),
-                            1, GL_FALSE, glm::value_ptr(directionalLightTransforms[i]));
+            glActiveTexture(GL_TEXTURE4);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, spotShadowArray);
+
+            glActiveTexture(GL_TEXTURE12);
+            glBindTexture(GL_TEXTURE_3D, offsetTexture);
+            glUniform1i(glGetUniformLocation(shader, "offsetTexture"), 12);
         }
-        for (int i = 0; i < (int)spotLightTransforms.size(); i++) {
-            std::string name = "spotLightTransforms[" + std::to_string(i) + "]";
-            glUniformMatrix4fv(glGetUniformLocation(shader, name.c_str()),
-                            1, GL_FALSE, glm::value_ptr(spotLightTransforms[i]));
+
+        // setting up default uniforms
+        glUniform1i(glGetUniformLocation(shader, "isInstanced"), 0);
+        glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0); 
+        glUniform1i(glGetUniformLocation(shader, "hasSpecular"), 0);
+        glUniform1i(glGetUniformLocation(shader, "isTile"), 0);
+        glUniform1i(glGetUniformLocation(shader, "isAlphaBlended"), 0);
+
+        glUniform2f(glGetUniformLocation(shader, "viewportSize"), (float)renderWidth, (float)renderHeight);
+    });
+
+    // the mirror renders into its own target first
+    int mirrorDrawTask = addFrameTask("mirror", true, { cullMirrorTask, uniformsTask }, [&] {
+        GPU_SCOPE("mirror");
+        renderMirrorReflection(mirrorView);
+    });
+
+    int mainDrawTask = addFrameTask("main", true, { cullMainTask, mirrorDrawTask }, [&] {
+        GPU_SCOPE("main");
+        glBindFramebuffer(GL_FRAMEBUFFER, hdrFbo); // bind HDR framebuffer for main scene rendering
+
+        // before drawing the final scene, we need to set drawing to the whole render target
+        glViewport(0, 0, renderWidth, renderHeight);
+
+        // clear the whole frame
+        glClearColor(0.04f, 0.05f, 0.08f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        drawScene(mainView);
+    });
+
+    addFrameTask("post process", true, { mainDrawTask }, [] {
+        drawPostProcess();
+
+        if (showGpuProfiler) {
+            GPU_SCOPE("overlay");
+            drawGpuProfilerOverlay();
         }
+    });
 
-        // Bind the shadow arrays to their fixed units
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, directionalShadowArray);
+    runFrameGraph();
 
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, spotShadowArray);
+    gpuProfilerEnd(frameScope);
+    gpuProfilerEndFrame();
+    streamEndFrame();
+}
 
-        glActiveTexture(GL_TEXTURE12);
-        glBindTexture(GL_TEXTURE_3D, offsetTexture);
-        glUniform1i(glGetUniformLocation(shader, "offsetTexture"), 12);
-    }
+/*****************************************************************************/
 
-    // setting up default uniforms
-    glUniform1i(glGetUniformLocation(shader, "isInstanced"), 0);
-    glUniform1i(glGetUniformLocation(shader, "hasNormal"), 0); 
-    glUniform1i(glGetUniformLocation(shader, "hasSpecular"), 0);
-    glUniform1i(glGetUniformLocation(shader, "isTile"), 0);
-    glUniform1i(glGetUniformLocation(shader, "isAlphaBlended"), 0);
+/*------------------CAMERA PATH--------------------*/
 
-    // do mirror plane stuff first 
-    // I put this n and mirrorPoint manually from the Finals-Data-MirrorPlane.txt
-    glm::vec3 n = glm::normalize(glm::vec3(-0.9848f, 0.1736f, 0.0f));
-    glm::vec3 mirrorPoint = glm::vec3(19.272734f, 2.855113f, 5.277397f);
-    float d = glm::dot(n, mirrorPoint); // used for reflection matrix
-    glm::mat4 mirrorMatrix = buildReflectionMatrix(n, d);
-    
-    // glm::mat4 lol(1.0f);
+// the camera pose is recorded at a fixed tick rate, independent of the frame rate
+#define CAMERA_PATH_TICK_RATE 60
+#define CAMERA_PATH_VERSION 1
 
-    glm::vec3 clipNormal = -n;
-    float clipD = glm::dot(clipNormal, mirrorPoint);
-    glm::vec4 clipPlane = glm::vec4(clipNormal.x, clipNormal.y, clipNormal.z, -clipD);
+struct CameraPose {
+    glm::vec3 position;
+    float yaw, pitch, fov;
+    uint32_t camera; // index into pathCameras, i.e. the camera picked with keys 1-4
+};
 
-    //  1: draw mirror into stencil buffer
-    glEnable(GL_STENCIL_TEST);
-    glStencilFunc(GL_ALWAYS, 1, 0xFF);
-    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-    glStencilMask(0xFF);
-    
-    // no need for color and depth for now
-    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-    glDepthMask(GL_FALSE);
+// Finals-Path.bin is this header followed by count CameraPose records, one per tick
+struct CameraPathHeader {
+    char magic[4]; // "FCAM"
+    uint32_t version;
+    uint32_t tickRate;
+    uint32_t count;
+};
 
-    // the mirror:
-    glBindVertexArray(vaos[10]);
-    glDrawArrays(GL_TRIANGLES, 0, MirrorPlane.size() / 11);
+Camera* pathCameras[] = {&main_camera, &main_light.cam, &spotlight1.cam, &spotlight2.cam};
 
-    // enable color and depth for the rest
-    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-    glDepthMask(GL_TRUE);
+bool recordingCameraPath = false;
+double recordStartTime = 0.0;
+std::vector<CameraPose> recordedPoses;
 
-    // 2: draw the scene (reflected) clipped to the stencil
-    glStencilFunc(GL_EQUAL, 1, 0xFF);
-    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
-    glStencilMask(0x00); // don't modify stencil anymore :)
-    glDisable(GL_CULL_FACE);
+// the path being replayed; a recording is interpolated linearly from tick to tick, while
+// hand-written keyframes are far apart and go through a Catmull-Rom spline instead
+std::vector<float> replayTimes;
+std::vector<CameraPose> replayPoses;
+bool replaySpline = false;
 
-    // clipped plane to be used in vs
-    glEnable(GL_CLIP_DISTANCE0);
-    glUniform4fv(glGetUniformLocation(shader, "clipPlane"), 1, glm::value_ptr(clipPlane));
+glm::vec3 cameraFront(float yaw, float pitch) {
+    glm::vec3 cam_dir;
+    cam_dir.x = cos(glm::radians(yaw)) * cos(glm::radians(pitch));
+    cam_dir.y = sin(glm::radians(pitch));
+    cam_dir.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
+    return glm::normalize(cam_dir);
+}
 
-    glFrontFace(GL_CW);
+CameraPose currentCameraPose() {
+    CameraPose pose = {active_camera->position, active_camera->yaw, active_camera->pitch, active_camera->fov, 0};
+    for (uint32_t i = 0; i < 4; i++)
+        if (pathCameras[i] == active_camera)
+            pose.camera = i;
+    return pose;
+}
 
-    drawScene(projectionTransform, viewTransform, mirrorMatrix);
-    glFrontFace(GL_CCW);
+void applyCameraPose(const CameraPose& pose) {
+    active_camera = pathCameras[std::min(pose.camera, 3u)];
+    active_camera->position = pose.position;
+    active_camera->yaw = pose.yaw;
+    active_camera->pitch = pose.pitch;
+    active_camera->fov = pose.fov;
+    active_camera->front = cameraFront(pose.yaw, pose.pitch);
+}
 
-    glDisable(GL_CLIP_DISTANCE0);
-    glEnable(GL_CULL_FACE);
+bool writeCameraPath(const char* filename, const std::vector<CameraPose>& poses) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cout << "Cannot write '" << filename << "'\n";
+        return false;
+    }
+    CameraPathHeader header = {{'F', 'C', 'A', 'M'}, CAMERA_PATH_VERSION, CAMERA_PATH_TICK_RATE, (uint32_t)poses.size()};
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)poses.data(), poses.size() * sizeof(CameraPose));
+    std::cout << "Saved " << poses.size() << " camera ticks (" << (float)poses.size() / CAMERA_PATH_TICK_RATE
+              << " s) to " << filename << "\n";
+    return true;
+}
 
-    // 3: mirror depth (placing mirror in the world):
-    // same stencil
-    glStencilFunc(GL_EQUAL, 1, 0xFF);
-    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
-    glStencilMask(0x00);
+void toggleCameraRecording() {
+    if (cameraReplayActive)
+        return;
 
-    // no color but we need the depth
-    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE); 
-    glDepthMask(GL_TRUE);
-    glDepthFunc(GL_ALWAYS);
+    recordingCameraPath = !recordingCameraPath;
+    if (recordingCameraPath) {
+        recordedPoses.clear();
+        recordStartTime = glfwGetTime();
+        std::cout << "Recording the camera path, press C again to stop\n";
+    }
+    else {
+        writeCameraPath("Finals-Path.bin", recordedPoses);
+    }
+}
 
-    glBindVertexArray(vaos[10]);
-    glDrawArrays(GL_TRIANGLES, 0, MirrorPlane.size() / 11);
+// reads either a recording made with C, or a text file with one keyframe per line:
+// time x y z yaw pitch fov [camera], where # starts a comment
+bool loadCameraPath(const char* filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cout << "Cannot open camera path '" << filename << "'\n";
+        return false;
+    }
 
-    // revert back the normal and depth testing
-    glDepthFunc(GL_LESS);
-    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    CameraPathHeader header;
+    if (file.read((char*)&header, sizeof(header)) && memcmp(header.magic, "FCAM", 4) == 0) {
+        if (header.version != CAMERA_PATH_VERSION || header.tickRate == 0) {
+            std::cout << "Unsupported camera path '" << filename << "'\n";
+            return false;
+        }
+        replayPoses.resize(header.count);
+        if (!file.read((char*)replayPoses.data(), header.count * sizeof(CameraPose))) {
+            std::cout << "Camera path '" << filename << "' is truncated\n";
+            return false;
+        }
+        for (uint32_t i = 0; i < header.count; i++)
+            replayTimes.push_back((float)i / header.tickRate);
+        replaySpline = false;
+    }
+    else {
+        file.clear();
+        file.seekg(0);
+        std::string line;
+        for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+            std::istringstream in(line.substr(0, line.find('#')));
+            float time;
+            CameraPose pose = {};
+            if (!(in >> time))
+                continue;
+            if (!(in >> pose.position.x >> pose.position.y >> pose.position.z >> pose.yaw >> pose.pitch >> pose.fov) ||
+                (!replayTimes.empty() && time <= replayTimes.back())) {
+                std::cout << filename << ":" << lineNumber << ": expected 'time x y z yaw pitch fov [camera]' with increasing times\n";
+                return false;
+            }
+            in >> pose.camera; // optional, stays 0 (main camera) when missing
+            replayTimes.push_back(time);
+            replayPoses.push_back(pose);
+        }
+        replaySpline = true;
+    }
 
-    // 4: real world
-    glStencilMask(0xFF);
-    glClear(GL_STENCIL_BUFFER_BIT);
-    glDisable(GL_STENCIL_TEST);
+    if (replayPoses.empty()) {
+        std::cout << "Camera path '" << filename << "' is empty\n";
+        return false;
+    }
+    cameraReplayActive = true;
+    std::cout << "Replaying " << replayPoses.size() << " camera keyframes (" << replayTimes.back() << " s) from "
+              << filename << "\n";
+    return true;
+}
 
-    drawScene(projectionTransform, viewTransform);
-    drawPostProcess();
+template <typename T>
+T catmullRom(const T& p0, const T& p1, const T& p2, const T& p3, float t) {
+    return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t * t +
+                   (3.0f * p1 - p0 - 3.0f * p2 + p3) * t * t * t);
 }
 
-/*****************************************************************************/
+CameraPose sampleCameraPath(float time) {
+    size_t last = replayPoses.size() - 1;
+    size_t next = std::upper_bound(replayTimes.begin(), replayTimes.end(), time) - replayTimes.begin();
+    if (next == 0)
+        return replayPoses.front();
+    if (next > last)
+        return replayPoses.back();
+
+    // a change of camera happens at the next keyframe rather than being blended
+    const CameraPose& a = replayPoses[next - 1];
+    const CameraPose& b = replayPoses[next];
+    if (a.camera != b.camera)
+        return a;
+
+    float t = (time - replayTimes[next - 1]) / (replayTimes[next] - replayTimes[next - 1]);
+    CameraPose pose = a;
+    if (replaySpline) {
+        const CameraPose& before = replayPoses[next > 1 ? next - 2 : next - 1];
+        const CameraPose& after = replayPoses[std::min(next + 1, last)];
+        pose.position = catmullRom(before.position, a.position, b.position, after.position, t);
+        pose.yaw = catmullRom(before.yaw, a.yaw, b.yaw, after.yaw, t);
+        pose.pitch = glm::clamp(catmullRom(before.pitch, a.pitch, b.pitch, after.pitch, t), -89.0f, 89.0f);
+        pose.fov = glm::clamp(catmullRom(before.fov, a.fov, b.fov, after.fov, t), 1.0f, 90.0f);
+    }
+    else {
+        pose.position = glm::mix(a.position, b.position, t);
+        pose.yaw = glm::mix(a.yaw, b.yaw, t);
+        pose.pitch = glm::mix(a.pitch, b.pitch, t);
+        pose.fov = glm::mix(a.fov, b.fov, t);
+    }
+    return pose;
+}
+
+// called once per frame before render(); the replay is sampled at the scene clock, so the
+// fish and the camera stay in step however long the frames take
+void updateCameraPath() {
+    if (recordingCameraPath) {
+        // every tick that passed since the last frame gets the current pose
+        CameraPose pose = currentCameraPose();
+        double elapsed = glfwGetTime() - recordStartTime;
+        while (recordedPoses.size() <= elapsed * CAMERA_PATH_TICK_RATE)
+            recordedPoses.push_back(pose);
+    }
+
+    if (cameraReplayActive) {
+        float time = sceneTime();
+        applyCameraPose(sampleCameraPath(time));
+
+        // the benchmark holds the last pose if it outlasts the path
+        if (!benchMode && time > replayTimes.back()) {
+            cameraReplayActive = false;
+            std::cout << "Camera path finished\n";
+        }
+    }
+}
+
+/*---------------------------------------------------*/
 
 // for continuosly checking if certain keys are pressed and moving the camera accordingly
 void processInput(GLFWwindow *pWindow, float deltaTime) {
@@ -2095,6 +6062,12 @@ void processInput(GLFWwindow *pWindow, float deltaTime) {
 }
 
 void mouse_callback(GLFWwindow* pWindow, double xpos, double ypos) {
+    // the replay owns the camera; pick up from wherever the mouse is once it is done
+    if (cameraReplayActive) {
+        firstMouse = true;
+        return;
+    }
+
     if (firstMouse)
     {
         lastX = xpos;
@@ -2123,12 +6096,7 @@ void mouse_callback(GLFWwindow* pWindow, double xpos, double ypos) {
         active_camera->pitch = -89.0f;
     }
 
-    glm::vec3 cam_dir;
-    cam_dir.x = cos(glm::radians(active_camera->yaw)) * cos(glm::radians(active_camera->pitch));
-    cam_dir.y = sin(glm::radians(active_camera->pitch));
-    cam_dir.z = sin(glm::radians(active_camera->yaw)) * cos(glm::radians(active_camera->pitch));
-    active_camera->front = glm::normalize(cam_dir);
-    
+    active_camera->front = cameraFront(active_camera->yaw, active_camera->pitch);
 }
 
 void scroll_callback(GLFWwindow *pWindow, double xoffset, double yoffset) {
@@ -2242,12 +6210,54 @@ void handleKeys(GLFWwindow* pWindow, int key, int scancode, int action, int mode
         case GLFW_KEY_G:
             showGrassLeaves = !showGrassLeaves;
             break;
+        case GLFW_KEY_J:
+            trainRunning = !trainRunning;
+            break;
         case GLFW_KEY_B:
             enableBloom = !enableBloom;
             break;
         case GLFW_KEY_V:
             enableFog = !enableFog;
             break;
+        case GLFW_KEY_M:
+            reflectionScaleIndex = (reflectionScaleIndex + 1) % 3;
+            setupReflection();
+            std::cout << "Mirror resolution: " << reflectionWidth << "x" << reflectionHeight << "\n";
+            break;
+        case GLFW_KEY_N:
+            enableDynamicResolution = !enableDynamicResolution;
+            if (!enableDynamicResolution && renderScale != maxRenderScale) {
+                renderScale = maxRenderScale;
+                renderTargetsNeedResize = true;
+            }
+            std::cout << "Dynamic resolution " << (enableDynamicResolution ? "on" : "off") << "\n";
+            break;
+        case GLFW_KEY_H:
+            depthPrepassMode = (DepthPrepassMode)((depthPrepassMode + 1) % 3);
+            std::cout << "Depth prepass " << depthPrepassModeNames[depthPrepassMode] << " (overdraw "
+                      << depthPrepassViews[0].overdraw << " main, " << depthPrepassViews[1].overdraw << " mirror)\n";
+            break;
+        case GLFW_KEY_I:
+            occlusionMode = (OcclusionMode)((occlusionMode + 1) % 3);
+            for (OcclusionState& state : occlusionStates) {
+                state.visible = true;
+                state.nextQueryFrame = 0;
+            }
+            std::cout << "Occlusion culling: " << occlusionModeNames[occlusionMode] << "\n";
+            break;
+        case GLFW_KEY_O:
+            showGpuProfiler = !showGpuProfiler;
+            break;
+        case GLFW_KEY_K:
+            dumpGpuProfilerCsv("Finals-GpuProfile.csv");
+            break;
+        case GLFW_KEY_T:
+            writeCpuTrace("Finals-Trace.json");
+            break;
+
+        case GLFW_KEY_C:
+            toggleCameraRecording();
+            break;
     }
 }
 
@@ -2256,17 +6266,518 @@ void handleResize(GLFWwindow* pWindow, int width, int height)
 {
     // tell OpenGL to do its drawing within the entire "client area" (area within the borders) of the window
     glViewport(0, 0, width, height);
+
+    // the render targets follow the window size (skipped while minimized)
+    if (width > 0 && height > 0 && (width != windowWidth || height != windowHeight)) {
+        windowWidth = width;
+        windowHeight = height;
+        renderTargetsNeedResize = true;
+    }
+}
+
+/*------------------BENCHMARK--------------------*/
+
+struct BenchOptions {
+    int frames = 300;
+    int warmup = 10; // not timed; the first frame also bakes or loads the cubemaps
+    unsigned int seed = 1;
+    const char* json = "Finals-Bench.json";
+    const char* capture = nullptr; // PPM of the last frame
+    const char* golden = nullptr;  // PPM the last frame is compared against
+    int tolerance = 2;             // largest per-channel difference (out of 255) still counted as equal
+};
+BenchOptions benchOptions;
+const char* replayFile = nullptr; // camera path for --replay, with or without --bench
+bool fishBenchmark = false;       // --bench-fish, see runFishBenchmark()
+
+bool parseArguments(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--bench") == 0) benchMode = true;
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue) benchOptions.frames = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--warmup") == 0 && hasValue) benchOptions.warmup = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--seed") == 0 && hasValue) benchOptions.seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--json") == 0 && hasValue) benchOptions.json = argv[++i];
+        else if (strcmp(argv[i], "--capture") == 0 && hasValue) benchOptions.capture = argv[++i];
+        else if (strcmp(argv[i], "--golden") == 0 && hasValue) benchOptions.golden = argv[++i];
+        else if (strcmp(argv[i], "--tolerance") == 0 && hasValue) benchOptions.tolerance = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--replay") == 0 && hasValue) replayFile = argv[++i];
+        else if (strcmp(argv[i], "--fish") == 0 && hasValue) numFish = glm::clamp(atoi(argv[++i]), 1, 1 << 20);
+        else if (strcmp(argv[i], "--gpu-fish") == 0) gpuFishMode = true;
+        else if (strcmp(argv[i], "--flow-volume") == 0) useFlowVolume = true;
+        else if (strcmp(argv[i], "--bench-fish") == 0) fishBenchmark = true;
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue) workerThreadLimit = std::max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--train") == 0) trainRunning = true;
+        else if (strcmp(argv[i], "--serial-frame") == 0) frameGraph.serial = true;
+        else if (strcmp(argv[i], "--sim-budget") == 0 && hasValue) fishSimBudgetUs = std::max(0.0f, (float)atof(argv[++i]));
+        else {
+            std::cout << "Unknown option '" << argv[i] << "'\n"
+                      << "Usage: " << argv[0] << " [--replay FILE] [--fish N] [--gpu-fish] [--flow-volume] [--threads N] [--sim-budget US] [--train] [--serial-frame] [--bench [--frames N] [--warmup N] [--seed N] [--json FILE]\n"
+                      << "                [--capture FILE.ppm] [--golden FILE.ppm] [--tolerance N]] [--bench-fish [--seed N]]\n";
+            return false;
+        }
+    }
+
+    // the CPU path streams every instance each frame, so the fish have to fit in a frame of it
+    if (!gpuFishMode && numFish > MAX_STREAMED_FISH) {
+        std::cout << "--fish: at most " << MAX_STREAMED_FISH << " fish without --gpu-fish\n";
+        numFish = MAX_STREAMED_FISH;
+    }
+    return true;
+}
+
+struct FrameTimeStats {
+    float min = 0.0f, avg = 0.0f, p50 = 0.0f, p99 = 0.0f;
+};
+
+FrameTimeStats frameTimeStats(std::vector<float> samples) {
+    FrameTimeStats stats;
+    if (samples.empty())
+        return stats;
+
+    std::sort(samples.begin(), samples.end());
+    float total = 0.0f;
+    for (float s : samples)
+        total += s;
+    stats.min = samples.front();
+    stats.avg = total / samples.size();
+    stats.p50 = samples[(samples.size() - 1) / 2];
+    stats.p99 = samples[std::min(samples.size() - 1, (size_t)(samples.size() * 0.99f))];
+    return stats;
+}
+
+void writeFrameTimeStats(std::ostream& out, const char* name, const FrameTimeStats& stats, int count) {
+    out << "  \"" << name << "\": { \"samples\": " << count << ", \"min\": " << stats.min << ", \"avg\": " << stats.avg
+        << ", \"p50\": " << stats.p50 << ", \"p99\": " << stats.p99 << " }";
+}
+
+// reads the finished frame back from the default framebuffer, top row first
+std::vector<unsigned char> readFrame(int width, int height) {
+    std::vector<unsigned char> pixels(width * height * 3), flipped(width * height * 3);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    for (int y = 0; y < height; y++)
+        std::copy_n(&pixels[(height - 1 - y) * width * 3], width * 3, &flipped[y * width * 3]);
+    return flipped;
+}
+
+bool writePpm(const char* filename, int width, int height, const std::vector<unsigned char>& rgb) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cout << "Cannot write '" << filename << "'\n";
+        return false;
+    }
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write((const char*)rgb.data(), rgb.size());
+    return true;
+}
+
+// only handles the binary RGB files written by writePpm
+bool readPpm(const char* filename, int& width, int& height, std::vector<unsigned char>& rgb) {
+    std::ifstream file(filename, std::ios::binary);
+    std::string magic;
+    int maxValue;
+    if (!(file >> magic >> width >> height >> maxValue) || magic != "P6" || maxValue != 255) {
+        std::cout << "Cannot read '" << filename << "' as a binary PPM\n";
+        return false;
+    }
+    file.get(); // the single whitespace after the header
+    rgb.resize(width * height * 3);
+    return (bool)file.read((char*)rgb.data(), rgb.size());
+}
+
+// times the fish simulation over a sweep of fish counts, and needs no window:
+// - neighbor avoidance for one step, brute force against the spatial hash, which have to
+//   agree to the bit (brute force stops at FISH_BENCHMARK_BRUTE_MAX, past that only the grid
+//   is timed)
+// - the rest of the step, the AoS glm loop against the SIMD kernel; their sin/cos differ
+//   slightly, so the kernel only has to stay within FISH_BENCHMARK_TOLERANCE of the loop
+// - whole steps on 1 up to all of the worker threads plus the caller, which have to agree to
+//   the bit, with the speedup and the parallel efficiency (speedup / threads)
+// - whole steps with the simulation level of detail at a few near distances, with how many
+//   fish end up on each tier
+// - the flow field volume against flowField() at random points over a few key frames, as the
+//   angle between the two, and what a sample, an analytic evaluation and a step's bake cost
+#define FISH_BENCHMARK_BRUTE_MAX 16000
+#define FISH_BENCHMARK_STEPS 10
+#define FISH_BENCHMARK_SCALING_FISH 100000
+#define FLOW_BENCHMARK_POINTS 100000
+#define FISH_BENCHMARK_TOLERANCE 1e-4f
+
+bool runFishBenchmark() {
+    auto milliseconds = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - since).count();
+    };
+    makeAABBs();
+
+    bool passed = true;
+    char line[96];
+    std::cout << "Neighbor avoidance, one step\n"
+              << "    fish   build ms    grid ms   brute ms  match\n";
+    for (int count = 1000; count <= 128000; count *= 2) {
+        srand(benchOptions.seed);
+        std::vector<Fish> school = spawnFish(count);
+        FishState state;
+        loadFishState(state, school);
+
+        FishGrid grid;
+        auto start = std::chrono::steady_clock::now();
+        buildFishGrid(grid, state);
+        float buildMs = milliseconds(start);
+
+        std::vector<glm::vec3> fromGrid(count), fromBrute;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++)
+            fromGrid[i] = avoidNeighborsGrid(grid, state, i);
+        float gridMs = milliseconds(start);
+
+        if (count <= FISH_BENCHMARK_BRUTE_MAX) {
+            fromBrute.resize(count);
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; i++)
+                fromBrute[i] = avoidNeighbors(school[i], school);
+            float bruteMs = milliseconds(start);
+
+            bool match = memcmp(fromGrid.data(), fromBrute.data(), count * sizeof(glm::vec3)) == 0;
+            passed = passed && match;
+            snprintf(line, sizeof(line), "%8d %10.2f %10.2f %10.2f  %s\n", count, buildMs, gridMs, bruteMs, match ? "yes" : "NO");
+        }
+        else
+            snprintf(line, sizeof(line), "%8d %10.2f %10.2f %10s  -\n", count, buildMs, gridMs, "-");
+        std::cout << line << std::flush;
+    }
+
+    std::cout << "Steering and integration, " << FISH_BENCHMARK_STEPS << " steps, " << FISH_LANES << " fish per instruction\n"
+              << "    fish     AoS ms     SoA ms    speedup   max diff\n";
+    for (int count : { 1000, 10000, 100000 }) {
+        srand(benchOptions.seed);
+        std::vector<Fish> school = spawnFish(count);
+        FishState state;
+        loadFishState(state, school);
+
+        // both start from the same neighbor avoidance, which stays fixed over the steps
+        FishGrid grid;
+        buildFishGrid(grid, state);
+        std::vector<glm::vec3> avoid(count);
+        for (int i = 0; i < count; i++) {
+            avoid[i] = avoidNeighborsGrid(grid, state, i);
+            state.ax[i] = avoid[i].x; state.ay[i] = avoid[i].y; state.az[i] = avoid[i].z;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (int step = 0; step < FISH_BENCHMARK_STEPS; step++)
+            stepFishAoS(school, avoid, step * FISH_TICK);
+        float aosMs = milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (int step = 0; step < FISH_BENCHMARK_STEPS; step++)
+            stepFishSoA(state, step * FISH_TICK);
+        float soaMs = milliseconds(start);
+
+        // positions, and orientations through the direction they turn -z to
+        float maxDiff = 0.0f;
+        for (int i = 0; i < count; i++) {
+            FishPose pose = fishPose(state, i);
+            maxDiff = std::max(maxDiff, glm::length(pose.position - school[i].position));
+            maxDiff = std::max(maxDiff, glm::length(pose.orientation * glm::vec3(0, 0, -1) - school[i].orientation * glm::vec3(0, 0, -1)));
+        }
+        bool match = maxDiff <= FISH_BENCHMARK_TOLERANCE;
+        passed = passed && match;
+        snprintf(line, sizeof(line), "%8d %10.2f %10.2f %9.1fx %10.2g%s\n", count, aosMs, soaMs, aosMs / soaMs, maxDiff, match ? "" : "  TOO FAR");
+        std::cout << line << std::flush;
+    }
+
+    std::cout << "Whole steps, " << FISH_BENCHMARK_SCALING_FISH << " fish\n"
+              << " threads    step ms    speedup  efficiency  match\n";
+    srand(benchOptions.seed);
+    FishState initial;
+    loadFishState(initial, spawnFish(FISH_BENCHMARK_SCALING_FISH));
+    auto poses = [] {
+        std::vector<float> result;
+        for (const std::vector<float>* array : { &fishState.x, &fishState.y, &fishState.z, &fishState.qx, &fishState.qy, &fishState.qz, &fishState.qw })
+            result.insert(result.end(), array->begin(), array->end());
+        return result;
+    };
+    int maxThreads = (int)workerPool.threads.size() + 1;
+    std::vector<float> reference;
+    float oneThreadMs = 0.0f;
+    for (int threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+        setActiveWorkers(threads - 1);
+        fishState = initial;
+        auto start = std::chrono::steady_clock::now();
+        for (int step = 0; step < FISH_BENCHMARK_STEPS; step++)
+            computeNextFishStates(step * FISH_TICK);
+        float stepMs = milliseconds(start) / FISH_BENCHMARK_STEPS;
+
+        bool match = true;
+        if (threads == 1) {
+            reference = poses();
+            oneThreadMs = stepMs;
+        }
+        else
+            match = poses() == reference;
+        passed = passed && match;
+        float speedup = oneThreadMs / stepMs;
+        snprintf(line, sizeof(line), "%8d %10.2f %9.2fx %10.0f%%  %s\n", threads, stepMs, speedup, 100.0f * speedup / threads, match ? "yes" : "NO");
+        std::cout << line << std::flush;
+        if (threads == maxThreads)
+            break;
+    }
+    setActiveWorkers(maxThreads - 1);
+
+    // the tiers seen from the default camera, at a few fixed distances instead of a budget
+    std::cout << "Simulation LOD, " << FISH_BENCHMARK_SCALING_FISH << " fish, default camera\n"
+              << "  near m      near       mid       far    step ms\n";
+    FishLodView view;
+    view.eye = main_camera.position;
+    view.worldToClip = glm::perspective(glm::radians(main_camera.fov), (float)WINDOW_WIDTH / WINDOW_HEIGHT, 0.1f, 100.0f)
+                     * glm::lookAt(main_camera.position, main_camera.position + main_camera.front, main_camera.up);
+    for (float nearDistance : { 0.0f, 24.0f, 12.0f, 6.0f }) {
+        fishState = initial;
+        resetFishStrides();
+        fishLodNear = nearDistance;
+        int tiers[3] = {};
+        auto start = std::chrono::steady_clock::now();
+        for (int step = 0; step < FISH_BENCHMARK_STEPS; step++) {
+            if (nearDistance > 0.0f)
+                assignFishLod(step, view);
+            computeNextFishStates(step * FISH_TICK);
+        }
+        float stepMs = milliseconds(start) / FISH_BENCHMARK_STEPS;
+        for (int i = 0; i < fishState.count; i++)
+            tiers[fishState.lod[i]]++;
+        if (nearDistance > 0.0f)
+            snprintf(line, sizeof(line), "%8.0f %9d %9d %9d %10.2f\n", nearDistance, tiers[0], tiers[1], tiers[2], stepMs);
+        else
+            snprintf(line, sizeof(line), "%8s %9d %9d %9d %10.2f\n", "off", tiers[0], tiers[1], tiers[2], stepMs);
+        std::cout << line << std::flush;
+    }
+
+    std::cout << "Flow field volume, " << FLOW_GRID << "^3 samples, key frames every " << FLOW_KEY_TICKS << " steps\n"
+              << "  mean error   p99 error   max error  analytic ns  sample ns  bake ms/step\n";
+    std::mt19937 random(benchOptions.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<glm::vec3> points(FLOW_BENCHMARK_POINTS), sampled(FLOW_BENCHMARK_POINTS), exact(FLOW_BENCHMARK_POINTS);
+    for (glm::vec3& point : points)
+        point = TANK_MIN + (TANK_MAX - TANK_MIN) * glm::vec3(unit(random), unit(random), unit(random));
+
+    std::vector<float> errors;
+    float analyticMs = 0.0f, sampleMs = 0.0f, bakeMs = 0.0f;
+    const int flowTicks = 4 * FLOW_KEY_TICKS;
+    for (long long tick = 0; tick <= flowTicks; tick++) {
+        auto start = std::chrono::steady_clock::now();
+        prepareFlowVolume(tick);
+        if (tick > 0) // the first one bakes whole key frames
+            bakeMs += milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < FLOW_BENCHMARK_POINTS; i++)
+            sampled[i] = sampleFlowVolume(points[i]);
+        sampleMs += milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < FLOW_BENCHMARK_POINTS; i++)
+            exact[i] = flowField(points[i], tick * FISH_TICK);
+        analyticMs += milliseconds(start);
+
+        for (int i = 0; i < FLOW_BENCHMARK_POINTS; i++)
+            errors.push_back(glm::degrees(acos(glm::clamp(glm::dot(sampled[i], exact[i]), -1.0f, 1.0f))));
+    }
+    std::sort(errors.begin(), errors.end());
+    double errorSum = 0.0;
+    for (float error : errors)
+        errorSum += error;
+    float perPoint = 1e6f / ((flowTicks + 1.0f) * FLOW_BENCHMARK_POINTS);
+    snprintf(line, sizeof(line), "%10.2fd %10.2fd %10.2fd %12.1f %10.1f %13.3f\n", errorSum / errors.size(), errors[errors.size() * 99 / 100],
+             errors.back(), analyticMs * perPoint, sampleMs * perPoint, bakeMs / flowTicks);
+    std::cout << line << std::flush;
+
+    std::cout << (passed ? "Fish simulation checks passed\n" : "Fish simulation checks FAILED\n");
+    return passed;
+}
+
+// --bench-fish --gpu-fish: one step of the GPU simulation against computeNextFishStates() from
+// the same start, then both timed; the GPU's sin/cos and the summing order of the neighbors
+// differ, so the steps only have to agree within FISH_BENCHMARK_TOLERANCE
+#define GPU_FISH_BENCHMARK_STEPS 3
+
+bool runGpuFishBenchmark() {
+    auto milliseconds = [](std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - since).count();
+    };
+    makeAABBs();
+    std::cout << "GPU steps (" << glGetString(GL_RENDERER) << ") against the CPU\n"
+              << "    fish     CPU ms     GPU ms   max diff\n";
+
+    bool passed = true;
+    char line[96];
+    for (int count : { 1000, 10000, 100000, 1000000 }) {
+        srand(benchOptions.seed);
+        numFish = count;
+        loadFishState(fishState, spawnFish(count));
+        if (!setupGpuFish())
+            return false;
+
+        stepGpuFish(0.0f);
+        computeNextFishStates(0.0f);
+        std::vector<glm::vec4> state(3 * count);
+        glBindBuffer(GL_COPY_READ_BUFFER, gpuFish.stateBuffers[gpuFish.current]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, state.size() * sizeof(glm::vec4), state.data());
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        // positions, velocities, and orientations through the direction they turn -z to
+        float maxDiff = 0.0f;
+        for (int i = 0; i < count; i++) {
+            FishPose pose = fishPose(fishState, i);
+            glm::quat orientation(state[3 * i + 2].w, state[3 * i + 2].x, state[3 * i + 2].y, state[3 * i + 2].z);
+            maxDiff = std::max(maxDiff, glm::length(pose.position - glm::vec3(state[3 * i])));
+            maxDiff = std::max(maxDiff, glm::length(glm::vec3(fishState.vx[i], fishState.vy[i], fishState.vz[i]) - glm::vec3(state[3 * i + 1])));
+            maxDiff = std::max(maxDiff, glm::length(pose.orientation * glm::vec3(0, 0, -1) - orientation * glm::vec3(0, 0, -1)));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (int step = 1; step <= GPU_FISH_BENCHMARK_STEPS; step++)
+            computeNextFishStates(step * FISH_TICK);
+        float cpuMs = milliseconds(start) / GPU_FISH_BENCHMARK_STEPS;
+
+        glFinish();
+        start = std::chrono::steady_clock::now();
+        for (int step = 1; step <= GPU_FISH_BENCHMARK_STEPS; step++)
+            stepGpuFish(step * FISH_TICK);
+        glFinish();
+        float gpuMs = milliseconds(start) / GPU_FISH_BENCHMARK_STEPS;
+        releaseGpuFish();
+
+        bool match = maxDiff <= FISH_BENCHMARK_TOLERANCE;
+        passed = passed && match;
+        snprintf(line, sizeof(line), "%8d %10.2f %10.2f %10.2g%s\n", count, cpuMs, gpuMs, maxDiff, match ? "" : "  TOO FAR");
+        std::cout << line << std::flush;
+    }
+
+    std::cout << (passed ? "GPU fish simulation checks passed\n" : "GPU fish simulation checks FAILED\n");
+    return passed;
+}
+
+// renders a fixed number of frames without vsync and writes min/avg/p50/p99 CPU and GPU
+// frame times as JSON; returns false if the last frame does not match the golden image
+bool runBenchmark() {
+    std::vector<float> cpuTimes, gpuTimes;
+    std::vector<unsigned char> lastFrame;
+    int totalFrames = benchOptions.warmup + benchOptions.frames;
+
+    // the profiler hands back the GPU time of a frame GPU_PROFILER_FRAMES frames later
+    auto collectGpuTime = [&](int frame) {
+        float gpuMs = gpuPassLatest("frame");
+        if (frame >= benchOptions.warmup && gpuMs >= 0.0f)
+            gpuTimes.push_back(gpuMs);
+    };
+
+    for (int i = 0; i < totalFrames; i++) {
+        benchFrame = i;
+        auto start = std::chrono::steady_clock::now();
+        updateCameraPath();
+        if (gpuFishMode) updateGpuFish();
+        else updateFish();
+        render();
+        auto rendered = std::chrono::steady_clock::now();
+        collectGpuTime(i - GPU_PROFILER_FRAMES);
+
+        // read back before the swap, and outside of the timed part of the frame
+        if (i == totalFrames - 1)
+            lastFrame = readFrame(windowWidth, windowHeight);
+
+        auto swapStart = std::chrono::steady_clock::now();
+        glfwSwapBuffers(pWindow);
+        auto end = std::chrono::steady_clock::now();
+
+        if (i >= benchOptions.warmup)
+            cpuTimes.push_back(std::chrono::duration<float, std::milli>((rendered - start) + (end - swapStart)).count());
+    }
+
+    // collect the frames still in flight
+    glFinish();
+    for (int i = 0; i < GPU_PROFILER_FRAMES; i++) {
+        gpuProfilerBeginFrame();
+        collectGpuTime(totalFrames - GPU_PROFILER_FRAMES + i);
+        gpuProfilerEndFrame();
+    }
+
+    bool passed = true;
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"frames\": " << benchOptions.frames << ",\n"
+         << "  \"warmup\": " << benchOptions.warmup << ",\n"
+         << "  \"seed\": " << benchOptions.seed << ",\n"
+         << "  \"width\": " << windowWidth << ",\n"
+         << "  \"height\": " << windowHeight << ",\n"
+         << "  \"renderer\": \"" << (const char*)glGetString(GL_RENDERER) << "\",\n";
+    writeFrameTimeStats(json, "cpu_ms", frameTimeStats(cpuTimes), (int)cpuTimes.size());
+    json << ",\n";
+    writeFrameTimeStats(json, "gpu_ms", frameTimeStats(gpuTimes), (int)gpuTimes.size());
+
+    if (benchOptions.capture)
+        writePpm(benchOptions.capture, windowWidth, windowHeight, lastFrame);
+
+    if (benchOptions.golden) {
+        int goldenWidth, goldenHeight;
+        std::vector<unsigned char> golden;
+        int maxDiff = 255, differingPixels = windowWidth * windowHeight;
+        if (readPpm(benchOptions.golden, goldenWidth, goldenHeight, golden) &&
+            goldenWidth == windowWidth && goldenHeight == windowHeight) {
+            maxDiff = 0;
+            differingPixels = 0;
+            for (size_t p = 0; p < golden.size(); p += 3) {
+                int pixelDiff = 0;
+                for (int c = 0; c < 3; c++)
+                    pixelDiff = std::max(pixelDiff, std::abs((int)golden[p + c] - (int)lastFrame[p + c]));
+                maxDiff = std::max(maxDiff, pixelDiff);
+                differingPixels += pixelDiff > benchOptions.tolerance;
+            }
+        }
+        passed = differingPixels == 0;
+        json << ",\n  \"golden\": { \"file\": \"" << benchOptions.golden << "\", \"max_diff\": " << maxDiff
+             << ", \"differing_pixels\": " << differingPixels << ", \"pass\": " << (passed ? "true" : "false") << " }";
+    }
+    json << "\n}\n";
+
+    std::cout << json.str();
+    std::ofstream file(benchOptions.json);
+    if (file)
+        file << json.str();
+    else
+        std::cout << "Cannot write '" << benchOptions.json << "'\n";
+    return passed;
 }
 
+/*---------------------------------------------------*/
+
 // main function
 int main(int argc, char** argv)
 {
+    if (!parseArguments(argc, argv) || (replayFile && !loadCameraPath(replayFile)))
+        return -1;
+    startWorkerPool();
+    if (fishBenchmark && !gpuFishMode)
+        return runFishBenchmark() ? 0 : 1;
+
+    // the benchmark needs no display: GLFW's null platform renders through OSMesa
+    // (llvmpipe), so it also runs on machines without a GPU
+    bool headless = benchMode || fishBenchmark;
+    if (headless && glfwPlatformSupported(GLFW_PLATFORM_NULL))
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+
     // initialize GLFW and ask for OpenGL 3.3 core
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    if (headless) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        if (glfwGetPlatform() == GLFW_PLATFORM_NULL)
+            glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    }
 
     // create a GLFW window with the specified width, height, and title
     pWindow = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
@@ -2281,7 +6792,7 @@ int main(int argc, char** argv)
     // make the window the current context of subsequent OpenGL commands,
     // and enable vertical sync and aspect-ratio correction on the GLFW window
     glfwMakeContextCurrent(pWindow);
-    glfwSwapInterval(1);
+    glfwSwapInterval(benchMode ? 0 : 1); // the benchmark measures the frame, not the display
     glfwSetWindowAspectRatio(pWindow, WINDOW_WIDTH, WINDOW_HEIGHT);
 
     // set up callback functions to handle window system events
@@ -2299,13 +6810,37 @@ int main(int argc, char** argv)
     // initialize GLAD, which acts as a library loader for the current OS's native OpenGL library
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
 
+    // the framebuffer can be larger than the window on high DPI displays
+    glfwGetFramebufferSize(pWindow, &windowWidth, &windowHeight);
+    renderWidth = windowWidth;
+    renderHeight = windowHeight;
+
+    if (fishBenchmark) {
+        int exitCode = runGpuFishBenchmark() ? 0 : 1;
+        glfwTerminate();
+        return exitCode;
+    }
+
+    // fixed seed for the fish and PCF offsets, and no resolution changes mid-run
+    if (benchMode) {
+        srand(benchOptions.seed);
+        enableDynamicResolution = false;
+    }
+
     float delta;
     float last_frame = 0.0f;
+    int exitCode = 0;
     // if our initial setup is successful...
     if (setup())
     {
+        if (benchMode)
+            exitCode = runBenchmark() ? 0 : 1;
+
+        // the replay and its scene clock start with the first frame, not with the loading
+        replayStartTime = cameraReplayActive ? glfwGetTime() : 0.0;
+
         // do rendering in a loop until the user closes the window
-        while (! glfwWindowShouldClose(pWindow))
+        while (! benchMode && ! glfwWindowShouldClose(pWindow))
         {
             // render our next frame
             // (by default, GLFW uses double-buffering with a front and back buffer;
@@ -2313,18 +6848,29 @@ int main(int argc, char** argv)
             float current_frame = glfwGetTime();
             delta = current_frame - last_frame;
             last_frame = current_frame;
-            processInput(pWindow, delta);
+            if (! cameraReplayActive)
+                processInput(pWindow, delta);
+            updateCameraPath();
+            if (gpuFishMode) updateGpuFish();
+            else updateFish();
             render();
 
             // swap the GLFW front and back buffers to show the next frame
-            glfwSwapBuffers(pWindow);
+            {
+                CPU_SCOPE("glfwSwapBuffers");
+                glfwSwapBuffers(pWindow);
+            }
 
             // process any window events (such as moving, resizing, keyboard presses, etc.)
             glfwPollEvents();
         }
     }
 
+#if ENABLE_CPU_TRACE
+    writeCpuTrace("Finals-Trace.json");
+#endif
+
     // gracefully terminate the program
     glfwTerminate();
-    return 0;
+    return exitCode;
 }